@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include "mfs.h"
+#include "udp.h"
+#include "lz.h"
+
+#define BUFFER_SIZE (MFS_REQ_ID + MFS_TRAILER)
+
+//One simulated client with its own socket and at most one request outstanding
+typedef struct {
+	int sd;
+	int inum;
+	int next;      //Requests issued so far
+	double sent;   //When the outstanding request was (re)sent, 0 if none
+	double first;  //When the outstanding request was first sent
+	char msg[BUFFER_SIZE];
+} bench_client_t;
+
+struct sockaddr_in server;
+char *workload = "write";
+int size = MFS_BLOCK_SIZE;
+int blksize;    //Block size of the image, as stat reports it
+int file_bytes; //Max file size, workloads wrap around inside it
+int flags = 0;
+long wire = 0; //Bytes put on and taken off the wire during the run
+unsigned int next_id; //Id of the last request built, see set_args
+
+//A thread calling through the client library, see -l
+typedef struct {
+	MFS_Client *c;
+	int inum;
+	int n;         //Calls to make
+	double *lat;   //Latency of each
+	int failed;
+	char buf[MFS_MAX_PAYLOAD];
+} lib_client_t;
+
+//Fault profiles -F runs through, see UDP_Faults
+char *profiles[] = {
+	"",
+	"loss=0.01",
+	"loss=0.05",
+	"dup=0.05",
+	"reorder=0.05",
+	"delay=1,jitter=1",
+	"loss=0.01,dup=0.01,reorder=0.02,delay=1,jitter=1",
+};
+
+void usage() {
+	fprintf(stderr, "usage: bench [-w write|read|stat] [-c <clients>] [-n <requests>] [-s <bytes>] [-z] [-v <volumes>] [-l] [-F] [-t <ms>] <host> <port>\n");
+	fprintf(stderr, "  -l  call through the client library, one thread and client each\n");
+	fprintf(stderr, "  -F  call through the client library under each fault profile in turn, see UDP_Faults\n");
+	fprintf(stderr, "  -t  resend timeout of the client library\n");
+	exit(1);
+}
+
+double now_us(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int cmp_double(const void *a, const void *b){
+	double x = *(double*)a, y = *(double*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Sends a request, as a compressed frame when compression is on, trimmed otherwise
+ */
+void send_msg(int sd, char *msg){
+	memcpy(&msg[MFS_FLAGS], &flags, sizeof(int));
+	if(flags & MFS_FLAG_LZ){
+		char frame[LZ_HEADER + MFS_REQ_ID];
+		int n = LZ_Pack(msg, LZ_RequestLen(msg), frame, sizeof(frame));
+		UDP_Write(sd, &server, frame, n);
+		wire += n;
+		return;
+	}
+	struct iovec iov[2];
+	LZ_Trim(msg, LZ_RequestLen(msg), iov);
+	UDP_WriteV(sd, &server, iov, 2);
+	wire += iov[0].iov_len + iov[1].iov_len;
+}
+
+/**
+ * Receives a reply, unpacking it if it came as a compressed frame and putting it back together if trimmed
+ * Returns the bytes received, -1 if nothing was
+ */
+int recv_msg(int sd, char *msg){
+	struct sockaddr_in from;
+	char frame[BUFFER_SIZE];
+	int n = UDP_Read(sd, &from, frame, BUFFER_SIZE);
+	wire += n > 0 ? n : 0;
+	if(n >= (int) sizeof(int) && *(int*) frame == LZ_MARKER){
+		if(LZ_Unpack(frame, n, msg, BUFFER_SIZE) != 0){
+			*(int*) msg = RES_FAIL;
+		}
+	}else if(n > 0){
+		memcpy(msg, frame, n);
+		if(LZ_Expand(msg, n, MFS_REQ_ID) != 0){
+			*(int*) msg = RES_FAIL;
+		}
+	}
+	return n;
+}
+
+/**
+ * Sends a request and waits for its reply, used to set up and tear down files
+ * Returns the reply code
+ */
+int call(int sd, char *msg){
+	while(1){
+		send_msg(sd, msg);
+		struct pollfd pfd = { sd, POLLIN, 0 };
+		if(poll(&pfd, 1, 1000) > 0 && recv_msg(sd, msg) > 0){
+			break;
+		}
+	}
+	return *(int*) msg;
+}
+
+/**
+ * Fills a payload with log lines, the kind of data compression is meant for
+ */
+void fill_log(char *buf, int n, int seed){
+	static const char *levels[] = { "INFO", "DEBUG", "WARN", "INFO" };
+	int off = 0;
+	while(off < n){
+		char line[128];
+		int len = snprintf(line, sizeof(line), "{\"ts\":%d,\"level\":\"%s\",\"req\":%d,\"msg\":\"served block %d in %d us\"}\n",
+			1700000000 + seed * 7 + off / 97, levels[(seed + off) % 4], seed * 31 + off % 1000, (seed * 13 + off) % 4096, 40 + (seed * off) % 300);
+		if(len > n - off){
+			len = n - off;
+		}
+		memcpy(&buf[off], line, len);
+		off += len;
+	}
+}
+
+void set_args(char *msg, int op, int a, int b, int c){
+	//Each request gets its own id, the server answers resends of some from what it kept
+	unsigned int id = __sync_add_and_fetch(&next_id, 1);
+	memcpy(&msg[MFS_REQ_ID], &id, sizeof(id));
+	memcpy(&msg[0], &op, sizeof(int));
+	memcpy(&msg[4], &a, sizeof(int));
+	memcpy(&msg[8], &b, sizeof(int));
+	memcpy(&msg[12], &c, sizeof(int));
+}
+
+/**
+ * Builds the next request of the workload for a client
+ */
+void next_request(bench_client_t *c){
+	int offset = (c->next * size) % (file_bytes - size + 1);
+	if(strcmp(workload, "stat") == 0){
+		set_args(c->msg, OP_STAT, c->inum, 0, 0);
+	}else if(strcmp(workload, "read") == 0){
+		set_args(c->msg, OP_READ, c->inum, size, offset);
+	}else{
+		set_args(c->msg, OP_WRITE, c->inum, size, offset);
+		fill_log(&c->msg[16], size, c->next);
+	}
+	c->next++;
+}
+
+/**
+ * Makes the calls of one library client, timing each
+ */
+void *lib_run(void *arg){
+	lib_client_t *c = arg;
+	MFS_Stat_t m;
+	c->failed = 0;
+	for(int i = 0; i < c->n; i++){
+		int offset = (i * size) % (file_bytes - size + 1);
+		double t = now_us();
+		int rc;
+		if(strcmp(workload, "stat") == 0){
+			rc = MFS_Client_Stat(c->c, c->inum, &m);
+		}else if(strcmp(workload, "read") == 0){
+			rc = MFS_Client_Read(c->c, c->inum, c->buf, offset, size);
+		}else{
+			fill_log(c->buf, size, i);
+			rc = MFS_Client_Write(c->c, c->inum, c->buf, offset, size);
+		}
+		c->lat[i] = now_us() - t;
+		c->failed += rc < 0;
+	}
+	return NULL;
+}
+
+/**
+ * Drives a server through the client library, once for every fault profile
+ * given, and reports throughput and latency under each. The files are set
+ * up and removed with faults off.
+ * timeout[in] - Resend timeout of the library in ms, 0 to leave it
+ */
+void lib_bench(char *host, int port, int nclients, int total, int nvolumes, int timeout, char **specs, int nspecs){
+	lib_client_t *clients = calloc(nclients, sizeof(lib_client_t));
+	double *lat = malloc(total * sizeof(double));
+	for(int i = 0; i < nclients; i++){
+		lib_client_t *c = &clients[i];
+		c->c = MFS_Client_Init(host, port);
+		if(!c->c){
+			exit(1);
+		}
+		MFS_Client_Volume(c->c, i % nvolumes);
+		MFS_Client_Compress(c->c, flags & MFS_FLAG_LZ);
+		if(timeout){
+			MFS_Client_Timeout(c->c, timeout);
+		}
+
+		char name[28];
+		snprintf(name, sizeof(name), "bench-%d-%d", getpid() % 100000, i);
+		MFS_Client_Creat(c->c, 0, MFS_REGULAR_FILE, name);
+		c->inum = MFS_Client_Lookup(c->c, 0, name);
+		MFS_Stat_t m;
+		if(c->inum < 0 || MFS_Client_Stat(c->c, c->inum, &m) < 0){
+			fprintf(stderr, "cannot create %s\n", name);
+			exit(1);
+		}
+		if(!blksize){
+			blksize = m.blksize;
+			file_bytes = 30 * blksize;
+			if(size > blksize){
+				fprintf(stderr, "requests of %d bytes do not fit in the %d byte blocks of the image\n", size, blksize);
+				exit(1);
+			}
+		}
+		if(strcmp(workload, "read") == 0){
+			for(int off = 0; off < file_bytes; off += blksize){
+				fill_log(c->buf, blksize, off);
+				MFS_Client_Write(c->c, c->inum, c->buf, off, blksize);
+			}
+		}
+
+		//Calls are split evenly, the first clients make the ones left over
+		c->n = total / nclients + (i < total % nclients);
+		c->lat = &lat[i * (total / nclients) + (i < total % nclients ? i : total % nclients)];
+	}
+
+	printf("%s: %d clients, %d library calls of %d bytes per profile\n", workload, nclients, total, strcmp(workload, "stat") ? size : 0);
+	for(int p = 0; p < nspecs; p++){
+		if(UDP_Faults(specs[p]) < 0){
+			fprintf(stderr, "cannot parse fault profile %s\n", specs[p]);
+			exit(1);
+		}
+		pthread_t *threads = malloc(nclients * sizeof(pthread_t));
+		double start = now_us();
+		for(int i = 0; i < nclients; i++){
+			pthread_create(&threads[i], NULL, lib_run, &clients[i]);
+		}
+		int failed = 0;
+		for(int i = 0; i < nclients; i++){
+			pthread_join(threads[i], NULL);
+			failed += clients[i].failed;
+		}
+		double elapsed = (now_us() - start) / 1e6;
+		UDP_Faults(NULL);
+		free(threads);
+
+		qsort(lat, total, sizeof(double), cmp_double);
+		printf("%-50s %9.1f ops/s  latency (us) p50 %8.1f p99 %9.1f max %9.1f  %d failed\n", specs[p][0] ? specs[p] : "no faults",
+			total / elapsed, lat[total / 2], lat[(int)(total * 0.99)], lat[total - 1], failed);
+	}
+
+	for(int i = 0; i < nclients; i++){
+		char name[28];
+		snprintf(name, sizeof(name), "bench-%d-%d", getpid() % 100000, i);
+		MFS_Client_Unlink(clients[i].c, 0, name);
+		MFS_Client_Close(clients[i].c);
+	}
+	free(lat);
+	free(clients);
+}
+
+// drives a server with many concurrent clients and reports throughput and latency
+int main(int argc, char *argv[]) {
+	int ch;
+	int nclients = 1;
+	int total = 10000;
+	int nvolumes = 1;
+	int library = 0;
+	int all_faults = 0;
+	int timeout = 0;
+	next_id = (unsigned int) now_us();
+
+	while((ch = getopt(argc, argv, "w:c:n:s:zv:lFt:")) != -1){
+		switch(ch){
+			case 'w':
+				workload = optarg;
+				break;
+			case 'c':
+				nclients = atoi(optarg);
+				break;
+			case 'n':
+				total = atoi(optarg);
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 'z':
+				flags |= MFS_FLAG_LZ;
+				break;
+			case 'v':
+				nvolumes = atoi(optarg);
+				break;
+			case 'l':
+				library = 1;
+				break;
+			case 'F':
+				all_faults = 1;
+				break;
+			case 't':
+				timeout = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if(argc != 2 || nclients < 1 || total < 1 || size < 1 || size > MFS_MAX_PAYLOAD || nvolumes < 1 || timeout < 0 || total < nclients){
+		usage();
+	}
+	if(strcmp(workload, "write") && strcmp(workload, "read") && strcmp(workload, "stat")){
+		usage();
+	}
+
+	if(UDP_FillSockAddr(&server, argv[0], atoi(argv[1])) < 0){
+		exit(1);
+	}
+
+	//Faults set up through UDP_FAULTS apply to the library run as they are
+	if(library || all_faults){
+		char *env = getenv("UDP_FAULTS");
+		char *spec = env ? env : "";
+		lib_bench(argv[0], atoi(argv[1]), nclients, total, nvolumes, timeout,
+		          all_faults ? profiles : &spec, all_faults ? sizeof(profiles) / sizeof(profiles[0]) : 1);
+		return 0;
+	}
+
+	//Every client gets its own file, filled up front when reading. Clients are spread
+	//across the volumes of the server, all on volumes of the same block size.
+	bench_client_t *clients = calloc(nclients, sizeof(bench_client_t));
+	struct pollfd *fds = calloc(nclients, sizeof(struct pollfd));
+	for(int i = 0; i < nclients; i++){
+		bench_client_t *c = &clients[i];
+		c->sd = UDP_Open(0);
+		if(c->sd < 0){
+			exit(1);
+		}
+		fds[i].fd = c->sd;
+		fds[i].events = POLLIN;
+		//Replies carry the trailer back, so the volume stays set in the message
+		int volume = i % nvolumes;
+		memcpy(&c->msg[MFS_VOLUME], &volume, sizeof(int));
+
+		char name[28];
+		snprintf(name, sizeof(name), "bench-%d-%d", getpid() % 100000, i);
+		set_args(c->msg, OP_CREAT, 0, MFS_REGULAR_FILE, 0);
+		strcpy(&c->msg[12], name);
+		call(c->sd, c->msg);
+		set_args(c->msg, OP_LOOKUP, 0, 0, 0);
+		strcpy(&c->msg[8], name);
+		c->inum = call(c->sd, c->msg);
+		if(c->inum < 0){
+			fprintf(stderr, "cannot create %s\n", name);
+			exit(1);
+		}
+
+		//No request may move more than a block of the image
+		if(!blksize){
+			set_args(c->msg, OP_STAT, c->inum, 0, 0);
+			call(c->sd, c->msg);
+			blksize = *(int*) &c->msg[12];
+			file_bytes = 30 * blksize;
+			if(size > blksize){
+				fprintf(stderr, "requests of %d bytes do not fit in the %d byte blocks of the image\n", size, blksize);
+				exit(1);
+			}
+		}
+
+		if(strcmp(workload, "read") == 0){
+			for(int off = 0; off < file_bytes; off += blksize){
+				set_args(c->msg, OP_WRITE, c->inum, blksize, off);
+				fill_log(&c->msg[16], blksize, off);
+				call(c->sd, c->msg);
+			}
+		}
+	}
+
+	double *lat = malloc(total * sizeof(double));
+	int issued = 0, done = 0, failed = 0, busy = 0;
+	char reply[BUFFER_SIZE];
+
+	wire = 0;
+	double start = now_us();
+	for(int i = 0; i < nclients && issued < total; i++, issued++){
+		next_request(&clients[i]);
+		clients[i].sent = clients[i].first = now_us();
+		send_msg(clients[i].sd, clients[i].msg);
+	}
+
+	while(done < total){
+		int rc = poll(fds, nclients, 100);
+		double t = now_us();
+
+		for(int i = 0; i < nclients; i++){
+			bench_client_t *c = &clients[i];
+			if(rc > 0 && fds[i].revents & POLLIN){
+				if(recv_msg(c->sd, reply) <= 0){
+					continue;
+				}
+				if(c->sent == 0){
+					continue; //Late duplicate of a retransmitted request
+				}
+				if(*(int*) reply == RES_BUSY){
+					//Resend through the retransmit path once the server asks
+					c->sent = t - 1e6 + *(int*) &reply[4] * 1e3;
+					busy++;
+					continue;
+				}
+				failed += *(int*) reply < 0;
+				lat[done++] = t - c->first;
+				c->sent = 0;
+
+				if(issued < total){
+					next_request(c);
+					c->sent = c->first = t;
+					send_msg(c->sd, c->msg);
+					issued++;
+				}
+			}else if(c->sent && t - c->sent > 1e6){
+				c->sent = t;
+				send_msg(c->sd, c->msg);
+			}
+		}
+	}
+	double elapsed = (now_us() - start) / 1e6;
+	long run_wire = wire;
+
+	double sum = 0;
+	for(int i = 0; i < total; i++){
+		sum += lat[i];
+	}
+	qsort(lat, total, sizeof(double), cmp_double);
+
+	int bytes = strcmp(workload, "stat") ? size : 0;
+	printf("%s: %d clients, %d requests of %d bytes in %.3f s, %d failed, %d busy replies\n", workload, nclients, total, bytes, elapsed, failed, busy);
+	printf("throughput %.1f ops/s, %.2f MB/s effective, %.2f MB/s on the wire%s\n", total / elapsed, (double) total * bytes / elapsed / (1 << 20),
+		run_wire / elapsed / (1 << 20), flags & MFS_FLAG_LZ ? " compressed" : "");
+	printf("latency (us) avg %.1f p50 %.1f p99 %.1f max %.1f\n", sum / total, lat[total / 2], lat[(int)(total * 0.99)], lat[total - 1]);
+
+	//Clean up
+	for(int i = 0; i < nclients; i++){
+		char name[28];
+		snprintf(name, sizeof(name), "bench-%d-%d", getpid() % 100000, i);
+		set_args(clients[i].msg, OP_UNLINK, 0, 0, 0);
+		strcpy(&clients[i].msg[8], name);
+		call(clients[i].sd, clients[i].msg);
+		UDP_Close(clients[i].sd);
+	}
+	return 0;
+}
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cache.h"
+
+//One block sized frame of the cache. Cache_Try reads block, pins and next
+//without the lock, so they are changed with atomics.
+typedef struct {
+	int block;  //Image block held, -1 if the frame is unused or being filled
+	int pins;   //Users of the frame, it is never evicted while pinned. -1 while it is being refilled.
+	int dirty;  //Changed since it was last handed out for write back
+	int ref;    //CLOCK reference bit, set on every use
+	int next;   //Next frame in the same hash bucket, -1 at the end
+} frame_t;
+
+//A cache over one image
+struct __Cache {
+	int img_fd;
+	int bsize;
+	Cache_Flush on_full;
+	Cache_Verify on_read;
+	void *arg;          //Passed to both callbacks
+
+	char *pool;         //Frame buffers, aligned for O_DIRECT
+	frame_t *frames;
+	int nframes;
+	int *buckets;       //First frame of each hash bucket, -1 if empty
+	int mask;           //Number of buckets - 1
+	int hand;           //CLOCK hand
+
+	unsigned long hits, misses, evictions;
+
+	pthread_mutex_t lock; //Taken by every call but Cache_Try and Cache_Put, which make do with atomics
+};
+
+/**
+ * Sets up a cache of nframes blocks over an open image. Buffers are aligned
+ * to the block size so fd may be opened with O_DIRECT.
+ * Returns the cache, NULL if it can't be allocated
+ * fd[in] - The image, every block read goes through it
+ * block_size[in] - Size of a block and of a frame
+ * flush[in] - Called when no frame can be evicted until dirty frames are written back
+ * verify[in] - Called on every block read from the image, NULL if blocks are not checked
+ * arg[in] - Passed to flush and verify
+ */
+Cache *Cache_Init(int fd, int n, int block_size, Cache_Flush flush, Cache_Verify verify, void *arg){
+	Cache *c = calloc(1, sizeof(Cache));
+	if(!c){
+		return NULL;
+	}
+	c->img_fd = fd;
+	c->bsize = block_size;
+	c->on_full = flush;
+	c->on_read = verify;
+	c->arg = arg;
+	c->nframes = n < CACHE_MIN_FRAMES ? CACHE_MIN_FRAMES : n;
+	pthread_mutex_init(&c->lock, NULL);
+
+	if(posix_memalign((void**)&c->pool, c->bsize, (size_t) c->nframes * c->bsize) != 0){
+		c->pool = NULL;
+		Cache_Close(c);
+		return NULL;
+	}
+	c->frames = malloc(c->nframes * sizeof(frame_t));
+
+	//Keep chains short by having at least as many buckets as frames
+	int nbuckets = 1;
+	while(nbuckets < c->nframes){
+		nbuckets <<= 1;
+	}
+	c->mask = nbuckets - 1;
+	c->buckets = malloc(nbuckets * sizeof(int));
+	if(!c->frames || !c->buckets){
+		Cache_Close(c);
+		return NULL;
+	}
+
+	memset(c->buckets, -1, nbuckets * sizeof(int));
+	for(int i = 0; i < c->nframes; i++){
+		c->frames[i].block = -1;
+		c->frames[i].pins = 0;
+		c->frames[i].dirty = 0;
+		c->frames[i].ref = 0;
+		c->frames[i].next = -1;
+	}
+	return c;
+}
+
+/**
+ * Returns the frame holding a block, -1 if it is not cached
+ */
+static int find(Cache *c, int block){
+	int f = c->buckets[block & c->mask];
+	while(f != -1 && c->frames[f].block != block){
+		f = c->frames[f].next;
+	}
+	return f;
+}
+
+/**
+ * Takes a frame out of its hash bucket
+ */
+static void unhash(Cache *c, int f){
+	int *p = &c->buckets[c->frames[f].block & c->mask];
+	while(*p != f){
+		p = &c->frames[*p].next;
+	}
+	__atomic_store_n(p, c->frames[f].next, __ATOMIC_RELEASE);
+}
+
+/**
+ * Picks a frame to reuse with CLOCK. Pinned and dirty frames are passed over,
+ * recently used ones get a second chance.
+ * Returns the frame or -1 if every frame is pinned or dirty
+ */
+static int victim(Cache *c){
+	for(int i = 0; i < 2 * c->nframes; i++){
+		int f = c->hand;
+		c->hand = (c->hand + 1) % c->nframes;
+
+		if(__atomic_load_n(&c->frames[f].pins, __ATOMIC_RELAXED) || c->frames[f].dirty){
+			continue;
+		}
+		if(c->frames[f].ref && c->frames[f].block != -1){
+			c->frames[f].ref = 0;
+			continue;
+		}
+
+		//Cache_Try may pin it at any moment, so it is claimed only if it is still unpinned
+		int unpinned = 0;
+		if(__atomic_compare_exchange_n(&c->frames[f].pins, &unpinned, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+			return f;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Reads a block from the image into a frame. Blocks past the end of the image read as zeros.
+ */
+static void read_block(Cache *c, int block, char *buf){
+	int done = 0;
+	while(done < c->bsize){
+		int rc = pread(c->img_fd, buf + done, c->bsize - done, (off_t) block * c->bsize + done);
+		if(rc < 0 && errno == EINTR){
+			continue;
+		}
+		if(rc < 0){
+			fprintf(stderr, "read of block %d failed: %s\n", block, strerror(errno));
+		}
+		if(rc <= 0){
+			memset(buf + done, 0, c->bsize - done);
+			break;
+		}
+		done += rc;
+	}
+}
+
+/**
+ * Returns the cached copy of a block and pins it. Every call must be matched
+ * by a Cache_Put once the caller is done with the buffer.
+ * block[in] - The block address within the image
+ * read[in] - 0 if the caller overwrites the whole block, so a miss need not read it
+ */
+char *Cache_Get(Cache *c, int block, int read){
+	pthread_mutex_lock(&c->lock);
+	int f = find(c, block);
+	if(f != -1){
+		__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+		c->frames[f].ref = 1;
+		__atomic_add_fetch(&c->frames[f].pins, 1, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&c->lock);
+		return &c->pool[(size_t) f * c->bsize];
+	}
+
+	c->misses++;
+	f = victim(c);
+	if(f == -1){
+		//Everything left is dirty, write it back to make room. Write back calls back into the cache.
+		pthread_mutex_unlock(&c->lock);
+		c->on_full(c->arg);
+		pthread_mutex_lock(&c->lock);
+
+		//Another thread may have brought the block in meanwhile
+		f = find(c, block);
+		if(f != -1){
+			c->frames[f].ref = 1;
+			__atomic_add_fetch(&c->frames[f].pins, 1, __ATOMIC_ACQUIRE);
+			pthread_mutex_unlock(&c->lock);
+			return &c->pool[(size_t) f * c->bsize];
+		}
+		f = victim(c);
+		if(f == -1){
+			fprintf(stderr, "buffer cache exhausted, every frame is pinned\n");
+			exit(1);
+		}
+	}
+
+	//The frame is claimed, a Cache_Try that still finds it by its old block can't pin it
+	if(c->frames[f].block != -1){
+		unhash(c, f);
+		c->evictions++;
+	}
+	__atomic_store_n(&c->frames[f].block, -1, __ATOMIC_RELAXED);
+	c->frames[f].dirty = 0;
+	c->frames[f].ref = 1;
+	__atomic_store_n(&c->frames[f].next, c->buckets[block & c->mask], __ATOMIC_RELAXED);
+	__atomic_store_n(&c->buckets[block & c->mask], f, __ATOMIC_RELEASE);
+
+	//Other threads wait for the read under the lock, Cache_Try only matches the frame once it is filled in
+	char *buf = &c->pool[(size_t) f * c->bsize];
+	if(read){
+		read_block(c, block, buf);
+		if(c->on_read){
+			c->on_read(c->arg, block, buf);
+		}
+	}
+	__atomic_store_n(&c->frames[f].block, block, __ATOMIC_RELEASE);
+	__atomic_store_n(&c->frames[f].pins, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&c->lock);
+	return buf;
+}
+
+/**
+ * Returns the cached copy of a block pinned like Cache_Get, or NULL if it is
+ * not cached. Never reads the image or makes room, so it is safe for callers
+ * that must not cause a write back.
+ * Takes no lock. The hash chains may change under it, so it gives up after
+ * as many steps as there are frames and may miss a block that is cached.
+ * A frame found is pinned unless it is being refilled, and is only kept if
+ * it still holds the block once pinned.
+ * block[in] - The block address within the image
+ */
+char *Cache_Try(Cache *c, int block){
+	int f = __atomic_load_n(&c->buckets[block & c->mask], __ATOMIC_ACQUIRE);
+	for(int steps = 0; f != -1 && steps < c->nframes; steps++){
+		if(__atomic_load_n(&c->frames[f].block, __ATOMIC_RELAXED) == block){
+			break;
+		}
+		f = __atomic_load_n(&c->frames[f].next, __ATOMIC_ACQUIRE);
+	}
+	if(f == -1 || __atomic_load_n(&c->frames[f].block, __ATOMIC_RELAXED) != block){
+		return NULL;
+	}
+
+	frame_t *fr = &c->frames[f];
+	int pins = __atomic_load_n(&fr->pins, __ATOMIC_RELAXED);
+	do{
+		if(pins < 0){
+			return NULL;
+		}
+	}while(!__atomic_compare_exchange_n(&fr->pins, &pins, pins + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	if(__atomic_load_n(&fr->block, __ATOMIC_ACQUIRE) != block){
+		__atomic_sub_fetch(&fr->pins, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	__atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&fr->ref, 1, __ATOMIC_RELAXED);
+	return &c->pool[(size_t) f * c->bsize];
+}
+
+/**
+ * Unpins a frame returned by Cache_Get, Cache_Try or Cache_Writeback. Takes no lock.
+ * buf[in] - Any address within the frame
+ */
+void Cache_Put(Cache *c, char *buf){
+	__atomic_sub_fetch(&c->frames[(buf - c->pool) / c->bsize].pins, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Records that a cached block was changed. It stays cached until it has been written back.
+ * block[in] - The block address within the image
+ */
+void Cache_Dirty(Cache *c, int block){
+	pthread_mutex_lock(&c->lock);
+	int f = find(c, block);
+	if(f != -1){
+		c->frames[f].dirty = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Hands a dirty block out to be written. The frame counts as clean and stays
+ * pinned until the caller does a Cache_Put once the write is done.
+ * Returns the frame or NULL if the block is not cached
+ * block[in] - The block address within the image
+ */
+char *Cache_Writeback(Cache *c, int block){
+	pthread_mutex_lock(&c->lock);
+	int f = find(c, block);
+	if(f != -1){
+		c->frames[f].dirty = 0;
+		__atomic_add_fetch(&c->frames[f].pins, 1, __ATOMIC_ACQUIRE);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return f == -1 ? NULL : &c->pool[(size_t) f * c->bsize];
+}
+
+/**
+ * Returns the cached copy of a block without pinning it, NULL if it is not cached.
+ * Only safe for blocks that can't be evicted meanwhile, such as dirty ones.
+ * block[in] - The block address within the image
+ */
+char *Cache_Peek(Cache *c, int block){
+	pthread_mutex_lock(&c->lock);
+	int f = find(c, block);
+	pthread_mutex_unlock(&c->lock);
+	return f == -1 ? NULL : &c->pool[(size_t) f * c->bsize];
+}
+
+/**
+ * Prints the hit rate of the cache
+ */
+void Cache_Stats(Cache *c, FILE *out){
+	pthread_mutex_lock(&c->lock);
+	unsigned long total = c->hits + c->misses;
+	fprintf(out, "cache: %d frames, %lu hits, %lu misses, %lu evictions, %.1f%% hit rate\n",
+	        c->nframes, c->hits, c->misses, c->evictions, total ? 100.0 * c->hits / total : 0);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Releases the cache. Dirty frames must have been written back.
+ */
+void Cache_Close(Cache *c){
+	pthread_mutex_destroy(&c->lock);
+	free(c->pool);
+	free(c->frames);
+	free(c->buckets);
+	free(c);
+}
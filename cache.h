@@ -0,0 +1,26 @@
+#ifndef __Cache_h__
+#define __Cache_h__
+
+#include <stdio.h>
+
+#define CACHE_MIN_FRAMES (16) // enough for the blocks a single request keeps pinned
+
+// a block cache over one image, every call may be made from any thread
+typedef struct __Cache Cache;
+
+// called when every frame is pinned or dirty, must write the dirty frames back
+typedef void (*Cache_Flush)(void *arg);
+// called with every block read from the image, before anyone sees it
+typedef void (*Cache_Verify)(void *arg, int block, char *buf);
+
+Cache *Cache_Init(int fd, int nframes, int block_size, Cache_Flush flush, Cache_Verify verify, void *arg);
+char *Cache_Get(Cache *c, int block, int read);
+char *Cache_Try(Cache *c, int block);
+char *Cache_Peek(Cache *c, int block);
+void Cache_Put(Cache *c, char *buf);
+void Cache_Dirty(Cache *c, int block);
+char *Cache_Writeback(Cache *c, int block);
+void Cache_Stats(Cache *c, FILE *out);
+void Cache_Close(Cache *c);
+
+#endif // __Cache_h__
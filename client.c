@@ -1,8 +1,76 @@
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 #include "udp.h"
 #include "mfs.h"
 
+int shared_dir; //Inode of "my dir" for the threads below
+
+//Mixes calls with different answers on a client shared by several threads
+void *shared_calls(void *arg){
+	MFS_Client *c = arg;
+	MFS_Stat_t m;
+	for(int i = 0; i < 100; i++){
+		assert(MFS_Client_Lookup(c, 0, "my dir") == shared_dir); //Test: Each thread gets its own reply
+		assert(MFS_Client_Lookup(c, 0, ".") == 0);
+		assert(MFS_Client_Stat(c, shared_dir, &m) == 0);
+		assert(m.size == 2 * sizeof(MFS_DirEnt_t));
+		assert(MFS_Client_Stat(c, 0, &m) == 0);
+		assert(m.size == 4 * sizeof(MFS_DirEnt_t));
+	}
+	return NULL;
+}
+
+//Waits up to five seconds for the defragmenter to leave a file in one run
+//Returns 1 once it is, 0 if it never was
+int wait_contiguous(int inum){
+	MFS_Stat_t m;
+	for(int i = 0; i < 250; i++){
+		if(MFS_Stat(inum, &m) == 0 && m.extents == 1){
+			return 1;
+		}
+		usleep(20000);
+	}
+	return 0;
+}
+
+#define APPENDS (100) //Records each producer appends to the shared log
+
+int shared_log; //Inode of the file the producers below append to
+int producers;  //Hands each producer its number
+
+//Appends fixed size records to a shared log, each one carries the producer and its number
+void *append_records(void *arg){
+	MFS_Client *c = arg;
+	int rec[4] = { __sync_fetch_and_add(&producers, 1), 0, 0, 0 };
+	for(int i = 0; i < APPENDS; i++){
+		rec[1] = i;
+		int offset = MFS_Client_Append(c, shared_log, (char*) rec, sizeof(rec));
+		assert(offset >= 0 && offset % sizeof(rec) == 0); //Test: Appends land on record boundaries
+	}
+	return NULL;
+}
+
+#define SCAN_BLOCKS (6) //Blocks of each file the scanners below read
+
+MFS_Client *scan_client; //Client the scanners share
+int scan_files[2];       //Inode each scanner reads
+int scanners;            //Hands each scanner its file
+
+//Reads a file from start to end a few times, so it is fetched ahead, and checks every byte
+void *scan_file(void *arg){
+	int n = __sync_fetch_and_add(&scanners, 1);
+	char buf[1024];
+	for(int pass = 0; pass < 3; pass++){
+		for(int off = 0; off < SCAN_BLOCKS * 4096; off += sizeof(buf)){
+			assert(MFS_Client_Read(scan_client, scan_files[n], buf, off, sizeof(buf)) == 0);
+			for(int i = 0; i < (int) sizeof(buf); i++){
+				assert(buf[i] == (char) ((off + i) * 7 + n)); //Test: Each reader gets its own file
+			}
+		}
+	}
+	return NULL;
+}
 
 //Testing code for the mfs library
 int main(int argc, char *argv[]) {
@@ -39,9 +107,11 @@ int main(int argc, char *argv[]) {
 		int myfile = MFS_Lookup(0, "Hello File");
 		assert(myfile != -1);
 
-		//Tests that we can write 30 blocks (Max file size)
+		//Tests that we can write 30 blocks (Max file size), each different so a server that dedups can't share them
 		char buf[4096];
+		memset(buf, 0, sizeof(buf));
 		for(int i = 0; i < 30; i++){
+			buf[0] = i;
 			assert(MFS_Write(myfile, buf, i * 4096, 4096) == 0);
 		}
 
@@ -56,7 +126,9 @@ int main(int argc, char *argv[]) {
 		int myfile2 = MFS_Lookup(0, "File 2");
 		assert(myfile2 != -1);
 
+		buf[0] = 30;
 		assert(MFS_Write(myfile2, buf, 0, 4096) == 0);        //Test: Can write to last remaining block
+		buf[0] = 31;
 		assert(MFS_Write(myfile2, buf, 4096, 4096) == -1);    //Test: Write fails when no more storage space
 		assert(MFS_Creat(0, MFS_DIRECTORY, "dir") == -1);     //Test: Directory fails to create when no more storage space
 
@@ -64,6 +136,108 @@ int main(int argc, char *argv[]) {
 		printf("FILL TESTS PASSED\n");
 		return 0;
 	}
+	//Test volumes of a server hosting several images
+	//Should be run on a server given two clean images
+	else if(argc == 3 && strcmp(argv[2], "3") == 0){
+		char msgn[12];
+		assert(MFS_Creat(0, MFS_REGULAR_FILE, b) == 0);
+		int myfile = MFS_Lookup(0, b);
+		assert(MFS_Write(myfile, msg, 0, 12) == 0);
+
+		assert(MFS_Volume(1) == 0);
+		assert(MFS_Lookup(0, b) == -1);                   //Test: Other volume is another image
+		assert(MFS_Creat(0, MFS_DIRECTORY, c) == 0);
+		assert(MFS_Lookup(0, c) != -1);
+
+		//Back and forth, so a server keeping one volume in memory evicts and reloads them
+		for(int i = 0; i < 4; i++){
+			assert(MFS_Volume(i % 2) == 0);
+			assert(MFS_Lookup(0, i % 2 ? c : b) != -1);   //Test: Files stay on their own volume
+			assert(MFS_Lookup(0, i % 2 ? b : c) == -1);
+		}
+		assert(MFS_Volume(0) == 0);
+		assert(MFS_Read(myfile, msgn, 0, 12) == 0);
+		assert(strcmp(msg, msgn) == 0);                   //Test: Data written before switching volumes is read back
+
+		MFS_Client *other = MFS_Client_Init("localhost", atoi(argv[1]));
+		assert(MFS_Client_Volume(other, 1) == 0);
+		assert(MFS_Client_Lookup(other, 0, c) != -1);     //Test: Clients pick volumes on their own
+		assert(MFS_Lookup(0, c) == -1);
+		assert(MFS_Client_Volume(other, 2) == 0);
+		assert(MFS_Client_Stat(other, 0, &m) == -1);      //Test: Volume the server does not have
+		MFS_Client_Close(other);
+
+		MFS_Shutdown();
+		printf("VOLUME TESTS PASSED\n");
+		return 0;
+	}
+	//Test files moved by the defragmenter while they are in use
+	//Should be run on a clean image with a server given -f
+	else if(argc == 3 && strcmp(argv[2], "4") == 0){
+		char buf[4096], back[4096];
+		assert(MFS_Creat(0, MFS_REGULAR_FILE, "frag a") == 0);
+		assert(MFS_Creat(0, MFS_REGULAR_FILE, "frag b") == 0);
+		int fa = MFS_Lookup(0, "frag a");
+		int fb = MFS_Lookup(0, "frag b");
+
+		//Written by turns, so the blocks of each file alternate in the image
+		memset(buf, 0, sizeof(buf));
+		for(int i = 0; i < 8; i++){
+			buf[0] = i;
+			buf[1] = 'a';
+			assert(MFS_Write(fa, buf, i * 4096, 4096) == 0);
+			buf[1] = 'b';
+			assert(MFS_Write(fb, buf, i * 4096, 4096) == 0);
+		}
+		assert(wait_contiguous(fa));                      //Test: Each file is moved into one run
+		assert(wait_contiguous(fb));
+
+		buf[0] = 3;
+		buf[1] = 'c';
+		assert(MFS_Write(fa, buf, 3 * 4096, 4096) == 0); //Test: Writes go to where the file was moved
+		assert(wait_contiguous(fa));
+		for(int i = 0; i < 8; i++){
+			assert(MFS_Read(fa, back, i * 4096, 4096) == 0);
+			assert(back[0] == i && back[1] == (i == 3 ? 'c' : 'a')); //Test: Moved blocks keep their contents
+			assert(MFS_Read(fb, back, i * 4096, 4096) == 0);
+			assert(back[0] == i && back[1] == 'b');
+		}
+		MFS_Stat(fa, &m);
+		assert(m.size == 8 * 4096);
+
+		MFS_Shutdown();
+		printf("DEFRAG TESTS PASSED\n");
+		return 0;
+	}
+
+	//Test inode numbers past 127, which don't fit in a signed byte
+	//Should be run on a clean image with 256 inodes
+	else if(argc == 3 && strcmp(argv[2], "5") == 0){
+		char name[28];
+		int last = 0;
+		for(int i = 0; i < 200; i++){
+			sprintf(name, "file %d", i);
+			assert(MFS_Creat(0, i == 199 ? MFS_DIRECTORY : MFS_REGULAR_FILE, name) == 0);
+			int inum = MFS_Lookup(0, name);
+			assert(inum > last);                          //Test: Lookups return the whole inode number
+			last = inum;
+		}
+		assert(last > 127);
+		assert(MFS_Stat(last, &m) == 0 && m.type == MFS_DIRECTORY);
+		assert(MFS_Creat(last, MFS_REGULAR_FILE, b) == 0); //Test: Parents past 127 are found
+		int inner = MFS_Lookup(last, b);
+		assert(inner > last);
+		assert(MFS_Write(inner, msg, 0, 12) == 0);
+		char msgn[12];
+		assert(MFS_Read(inner, msgn, 0, 12) == 0);
+		assert(strcmp(msg, msgn) == 0);
+		assert(MFS_Unlink(last, b) == 0);
+		assert(MFS_Lookup(last, b) == -1);
+
+		MFS_Shutdown();
+		printf("INODE TESTS PASSED\n");
+		return 0;
+	}
 
 	//Note: Tests assume fresh test file image of with 64 data blocks/64 inodes
 	assert(MFS_Lookup(0, a) == 0); //Test: get root directory
@@ -76,6 +250,8 @@ int main(int argc, char *argv[]) {
 	assert(MFS_Stat(0, &m) == 0); //Test: return 0 on valid inode
 	assert(m.type == MFS_DIRECTORY); //Test: Correct file type returned
 	assert(m.size == 2 * sizeof(MFS_DirEnt_t)); //Test: Directory is correct size
+	int bs = m.blksize;
+	assert(bs >= MFS_BLOCK_SIZE && bs <= MFS_MAX_PAYLOAD && (bs & (bs - 1)) == 0); //Test: Stat reports the block size
 												
 	assert(MFS_Creat(0, MFS_REGULAR_FILE, a) == 0); //Test: Create already existing file fails
 	assert(MFS_Creat(1, MFS_REGULAR_FILE, b) == -1); //Test: Create file in non-existent inode
@@ -96,7 +272,7 @@ int main(int argc, char *argv[]) {
 
 	MFS_Stat(fd, &m);
 	assert(m.size == 0);                             //Test: Asserts new file has size 0
-	assert(MFS_Write(fd, msg, 0, 5000) == -1);        //Test: Write greater than 4096 bytes (illegal)
+	assert(MFS_Write(fd, msg, 0, MFS_MAX_PAYLOAD + 1) == -1); //Test: Write greater than the largest payload (illegal)
 	assert(MFS_Write(pdir, msg, 0, 12) == -1);        //Test: Write to directory (illegal)
 	assert(MFS_Write(fd, msg, -1, 12) == -1);         //Test: Write to a negative offset (illegal)
 	assert(MFS_Write(fd, msg, 0, 12) == 0);           //Test: Write buffer to file
@@ -105,7 +281,12 @@ int main(int argc, char *argv[]) {
 	assert(MFS_Write(fd, b, 0, 8) == 0);			  //Test: Overwrite part of file
 	MFS_Stat(fd, &m);
 	assert(m.size == 12);                             //Test: Overwriting file does not cause size to increase when smaller than original
-	assert(MFS_Write(fd, b, 14, 8) == -1);            //Test: offset cant be greater than file size
+	assert(MFS_Write(fd, b, 14, 8) == 0);             //Test: Writing past the end of file leaves a hole
+	MFS_Stat(fd, &m);
+	assert(m.size == 22);                             //Test: Size covers the hole
+	char hole[2] = { 1, 1 };
+	assert(MFS_Read(fd, hole, 12, 2) == 0);           //Test: Hole is readable
+	assert(hole[0] == 0 && hole[1] == 0);             //Test: Hole reads back as zeros
 											  
 
 	MFS_Write(fd, msg, 0, 12);
@@ -145,6 +326,41 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	//Test: The same small writes give the same file when buffered, swapping the messages
+	assert(MFS_Buffer(1) == 0);
+	for(int i = 0; i < 500; i++){
+		assert(MFS_Write(file, i % 2 == 0 ? msg2 : msg1, i * 10, 10) == 0);
+	}
+	assert(MFS_Stat(file, &m) == 0);
+	assert(m.size == 10 * 500);                       //Test: Stat sees buffered writes
+	for(int i = 0; i < 500; i++){
+		assert(MFS_Read(file, msg_tmp, i * 10, 10) == 0);
+		assert(strcmp(i % 2 == 0 ? msg2 : msg1, msg_tmp) == 0);
+	}
+	assert(MFS_Write(pdir, msg, 0, 12) == 0);         //Test: Buffered write to a directory is taken for now
+	assert(MFS_Sync() == -1);                         //Test: Its failure is reported by the sync
+	assert(MFS_Write(file, msg, 5000, 12) == 0);
+	usleep(200000);
+	MFS_Client *reader = MFS_Client_Init("localhost", atoi(argv[1]));
+	assert(MFS_Client_Read(reader, file, msg_read, 5000, 12) == 0);
+	assert(strcmp(msg, msg_read) == 0);               //Test: A buffered write goes out on its own after a while
+	MFS_Client_Close(reader);
+	assert(MFS_Buffer(0) == 0);
+	assert(MFS_Read(file, msg_tmp, 0, 10) == 0);
+	assert(MFS_Read(file, msg_tmp, 10, 10) == 0);     //Sequential, the blocks after are fetched ahead
+	assert(MFS_Write(file, msg1, 20, 10) == 0);
+	assert(MFS_Read(file, msg_tmp, 20, 10) == 0);
+	assert(strcmp(msg1, msg_tmp) == 0);               //Test: A write is seen by a reader that fetched ahead
+
+	assert(MFS_Fallocate(fd, 4096, 2 * 4096) == 0);   //Test: Reserve blocks past the end of file
+	MFS_Stat(fd, &m);
+	assert(m.size == 3 * 4096);                       //Test: File grows to cover the reserved range
+	assert(MFS_Read(fd, msg_tmp, 2 * 4096, 10) == 0); //Test: Reserved range is readable
+	assert(msg_tmp[0] == 0 && msg_tmp[9] == 0);       //Test: Reserved range reads back as zeros
+	assert(MFS_Read(fd, msg_read, 0, 12) == 0);
+	assert(strcmp(msg, msg_read) == 0);               //Test: Existing data survives moving out of the inode
+	assert(MFS_Fallocate(fd, 29 * bs, 2 * bs) == -1); //Test: Range past the max file size fails
+
 	assert(MFS_Unlink(pdir, c) == 0);				//Test: Remove succeeds when file doesn't exist
 	assert(MFS_Unlink(0, c) == -1);                 //Test: Remove fails when directory isn't empty
 	assert(MFS_Unlink(pdir, b) == 0);               //Test: File remove succeeds
@@ -156,6 +372,174 @@ int main(int argc, char *argv[]) {
 	MFS_Creat(0, MFS_DIRECTORY, c);
 	int new_dir = MFS_Lookup(0, c);
 	assert(new_dir == pdir);                        //Test: Ensures new file gets previously freed inode
+
+	//Test: Threads can share one client and more clients can run next to it
+	shared_dir = new_dir;
+	MFS_Client *shared = MFS_Client_Init("localhost", atoi(argv[1]));
+	MFS_Client *other = MFS_Client_Init("localhost", atoi(argv[1]));
+	assert(shared != NULL && other != NULL);
+	pthread_t threads[4];
+	for(int i = 0; i < 4; i++){
+		assert(pthread_create(&threads[i], NULL, shared_calls, i < 3 ? shared : other) == 0);
+	}
+	for(int i = 0; i < 4; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	//Test: Producers on several clients append to one file without overwriting each other
+	assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "log") == 0);
+	shared_log = MFS_Lookup(new_dir, "log");
+	assert(MFS_Append(shared_log, msg, 12) == 0);     //Test: Append to an empty file starts at 0
+	assert(MFS_Append(shared_log, msg, 4) == 12);     //Test: Append returns the old end of file
+	assert(MFS_Append(new_dir, msg, 4) == -1);        //Test: Append to a directory (illegal)
+	assert(MFS_Unlink(new_dir, "log") == 0);
+	assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "log") == 0);
+	shared_log = MFS_Lookup(new_dir, "log");
+	for(int i = 0; i < 4; i++){
+		assert(pthread_create(&threads[i], NULL, append_records, i % 2 ? shared : other) == 0);
+	}
+	for(int i = 0; i < 4; i++){
+		pthread_join(threads[i], NULL);
+	}
+	MFS_Stat(shared_log, &m);
+	assert(m.size == 4 * APPENDS * 4 * sizeof(int));  //Test: Every append grew the file
+	int seen[4][APPENDS] = { { 0 } };
+	for(int off = 0; off < m.size; off += 4 * sizeof(int)){
+		int rec[4];
+		assert(MFS_Read(shared_log, (char*) rec, off, sizeof(rec)) == 0);
+		assert(rec[0] >= 0 && rec[0] < 4 && rec[1] >= 0 && rec[1] < APPENDS);
+		assert(seen[rec[0]][rec[1]]++ == 0);          //Test: Every record is there once, none was overwritten
+	}
+	assert(MFS_Unlink(new_dir, "log") == 0);
+
+	//Test: Threads reading different inodes on one client run at once, each with its own read ahead
+	char block[4096];
+	for(int n = 0; n < 2; n++){
+		char name[28];
+		sprintf(name, "scan %d", n);
+		assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, name) == 0);
+		scan_files[n] = MFS_Lookup(new_dir, name);
+		for(int off = 0; off < SCAN_BLOCKS * 4096; off += 4096){
+			for(int i = 0; i < 4096; i++){
+				block[i] = (off + i) * 7 + n;
+			}
+			assert(MFS_Write(scan_files[n], block, off, 4096) == 0);
+		}
+	}
+	scan_client = shared;
+	for(int i = 0; i < 2; i++){
+		assert(pthread_create(&threads[i], NULL, scan_file, NULL) == 0);
+	}
+	for(int i = 0; i < 2; i++){
+		pthread_join(threads[i], NULL);
+	}
+	assert(MFS_Unlink(new_dir, "scan 0") == 0);
+	assert(MFS_Unlink(new_dir, "scan 1") == 0);
+	MFS_Client_Close(shared);
+	MFS_Client_Close(other);
+
+	//Test: Snapshots keep the image as it was, over and over so blocks that leak would run out
+	for(int round = 0; round < 20; round++){
+		assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "snap") == 0);
+		int snapped = MFS_Lookup(new_dir, "snap");
+		for(int i = 0; i < 3; i++){
+			assert(MFS_Write(snapped, msg1, i * 4096, 10) == 0);
+		}
+		int snap = MFS_Snapshot();
+		assert(snap > 0);                                 //Test: Snapshot succeeds
+		assert(MFS_Write(snapped, msg2, 4096, 10) == 0);  //Test: Overwrite a block the snapshot holds
+		assert(MFS_Write(snapped, msg2, 3 * 4096, 10) == 0);
+		assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "after") == 0);
+		int after = MFS_Lookup(new_dir, "after");
+
+		assert(MFS_UseSnapshot(snap) == 0);
+		assert(MFS_Stat(after, &m) == -1);                //Test: Inodes made later are not in the snapshot
+		assert(MFS_Read(snapped, msg_tmp, 4096, 10) == 0);
+		assert(strcmp(msg1, msg_tmp) == 0);               //Test: Snapshot reads the old data
+		MFS_Stat(snapped, &m);
+		assert(m.size == 2 * 4096 + 10);                  //Test: Snapshot has the old size
+		assert(MFS_Lookup(new_dir, "after") == -1);       //Test: Files created later are not in the snapshot
+		assert(MFS_UseSnapshot(0) == 0);
+		assert(MFS_Read(snapped, msg_tmp, 4096, 10) == 0);
+		assert(strcmp(msg2, msg_tmp) == 0);               //Test: Live image has the new data
+
+		assert(MFS_Unlink(new_dir, "snap") == 0);
+		assert(MFS_Unlink(new_dir, "after") == 0);
+		MFS_UseSnapshot(snap);
+		assert(MFS_Lookup(new_dir, "snap") == snapped);   //Test: Snapshot still has the removed file
+		assert(MFS_Read(snapped, msg_tmp, 2 * 4096, 10) == 0);
+		assert(strcmp(msg1, msg_tmp) == 0);
+		MFS_UseSnapshot(0);
+
+		assert(MFS_DeleteSnapshot(snap) == 0);            //Test: Delete snapshot
+		assert(MFS_DeleteSnapshot(snap) == -1);           //Test: Delete a snapshot that is gone
+		MFS_UseSnapshot(snap);
+		assert(MFS_Stat(0, &m) == -1);                    //Test: Deleted snapshot can't be read
+		MFS_UseSnapshot(0);
+	}
+
+	//Test: Compressed requests and replies carry the same data, text and noise alike
+	char text[4096], noise[4096], back[4096];
+	for(int i = 0; i < 4096; i++){
+		text[i] = "level=info msg=\"served\"\n"[i % 24];
+		noise[i] = rand();
+	}
+	assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "packed") == 0);
+	int packed = MFS_Lookup(new_dir, "packed");
+	MFS_Compress(1);
+	assert(MFS_Write(packed, text, 0, 4096) == 0);
+	assert(MFS_Write(packed, noise, 4096, 4096) == 0);
+	assert(MFS_Read(packed, back, 0, 4096) == 0);
+	assert(memcmp(text, back, 4096) == 0);           //Test: Text round trips compressed
+	assert(MFS_Read(packed, back, 4096, 4096) == 0);
+	assert(memcmp(noise, back, 4096) == 0);          //Test: Incompressible data is stored and round trips
+	MFS_Stat(packed, &m);
+	assert(m.size == 2 * 4096);                      //Test: Stat replies come through compressed
+	assert(MFS_Lookup(new_dir, "packed") == packed);
+	MFS_Compress(0);
+	assert(MFS_Read(packed, back, 0, 4096) == 0);
+	assert(memcmp(text, back, 4096) == 0);           //Test: Data written compressed reads back plain
+	assert(MFS_Unlink(new_dir, "packed") == 0);
+
+	//Test: Files written with the same blocks stay independent, whether or not the server dedups them
+	assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "twin1") == 0);
+	assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "twin2") == 0);
+	int twin1 = MFS_Lookup(new_dir, "twin1");
+	int twin2 = MFS_Lookup(new_dir, "twin2");
+	for(int i = 0; i < 3; i++){
+		assert(MFS_Write(twin1, text, i * 4096, 4096) == 0);
+		assert(MFS_Write(twin2, text, i * 4096, 4096) == 0);
+	}
+	assert(MFS_Write(twin1, msg2, 4096 + 100, 10) == 0);   //Test: Change a block both files may share
+	assert(MFS_Write(twin2, noise, 2 * 4096, 4096) == 0);  //Test: Replace a whole block both files may share
+	assert(MFS_Read(twin2, back, 4096, 4096) == 0);
+	assert(memcmp(text, back, 4096) == 0);                 //Test: The other file keeps its data
+	assert(MFS_Read(twin1, back, 2 * 4096, 4096) == 0);
+	assert(memcmp(text, back, 4096) == 0);
+	assert(MFS_Read(twin1, msg_tmp, 4096 + 100, 10) == 0);
+	assert(strcmp(msg2, msg_tmp) == 0);
+	assert(MFS_Unlink(new_dir, "twin1") == 0);
+	assert(MFS_Read(twin2, back, 0, 4096) == 0);
+	assert(memcmp(text, back, 4096) == 0);                 //Test: Removing one file leaves the blocks the other uses
+	assert(MFS_Unlink(new_dir, "twin2") == 0);
+
+	//Test: Reads and writes move up to a block of whatever size the image was made with
+	static char big[MFS_MAX_PAYLOAD + 1], big_back[MFS_MAX_PAYLOAD];
+	for(int i = 0; i < bs; i++){
+		big[i] = i * 7 + i / 251;
+	}
+	assert(MFS_Creat(new_dir, MFS_REGULAR_FILE, "big") == 0);
+	int bigf = MFS_Lookup(new_dir, "big");
+	assert(MFS_Write(bigf, big, 0, bs) == 0);                //Test: Write a whole block in one request
+	assert(MFS_Write(bigf, big, bs + bs / 2, bs) == 0);      //Test: Write a block's worth across two blocks
+	assert(MFS_Write(bigf, big, 0, bs + 1) == -1);           //Test: More than a block in one request fails
+	assert(MFS_Read(bigf, big_back, 0, bs) == 0);
+	assert(memcmp(big, big_back, bs) == 0);
+	assert(MFS_Read(bigf, big_back, bs + bs / 2, bs) == 0);
+	assert(memcmp(big, big_back, bs) == 0);                  //Test: Read a block's worth across two blocks
+	MFS_Stat(bigf, &m);
+	assert(m.size == 2 * bs + bs / 2);
+	assert(MFS_Unlink(new_dir, "big") == 0);
 													
 	//Test: 
 													
@@ -0,0 +1,159 @@
+#include <string.h>
+#include "crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define POLY (0x82f63b78) //CRC32C (Castagnoli), reflected
+#define LANE (1360)       //Bytes of each of the three streams the instructions interleave, three fill most of a 4 KB block
+
+static unsigned int table[8][256];
+static unsigned int shift[4][256]; //What a checksum becomes over LANE more zero bytes, by each of its bytes
+static unsigned int (*update)(unsigned int crc, const char *buf, long len);
+
+/**
+ * Eight bytes per step through eight tables, for CPUs without the instructions
+ */
+static unsigned int update_table(unsigned int crc, const char *buf, long len){
+	const unsigned char *p = (const unsigned char*) buf;
+	while(len >= 8){
+		unsigned int lo, hi;
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo ^= crc;
+		crc = table[7][lo & 0xff] ^ table[6][lo >> 8 & 0xff] ^ table[5][lo >> 16 & 0xff] ^ table[4][lo >> 24] ^
+		      table[3][hi & 0xff] ^ table[2][hi >> 8 & 0xff] ^ table[1][hi >> 16 & 0xff] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while(len-- > 0){
+		crc = table[0][(crc ^ *p++) & 0xff] ^ crc >> 8;
+	}
+	return crc;
+}
+
+/**
+ * Moves a checksum past LANE zero bytes. With no inversions the checksum of
+ * A followed by B is that of A moved past B, xor that of B alone.
+ */
+static unsigned int shift_lane(unsigned int crc){
+	return shift[0][crc & 0xff] ^ shift[1][crc >> 8 & 0xff] ^ shift[2][crc >> 16 & 0xff] ^ shift[3][crc >> 24];
+}
+
+//The instructions take a few cycles to give a result but accept a new one every
+//cycle, so three independent streams run at once and are joined after each round.
+//Blocks are aligned, so words are loaded directly.
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int update_hw(unsigned int crc, const char *buf, long len){
+	while(len >= 3 * LANE){
+		unsigned long a = crc, b = 0, c = 0;
+		for(int i = 0; i < LANE; i += 8){
+			a = _mm_crc32_u64(a, *(const unsigned long*) &buf[i]);
+			b = _mm_crc32_u64(b, *(const unsigned long*) &buf[LANE + i]);
+			c = _mm_crc32_u64(c, *(const unsigned long*) &buf[2 * LANE + i]);
+		}
+		crc = shift_lane(shift_lane(a) ^ b) ^ c;
+		buf += 3 * LANE;
+		len -= 3 * LANE;
+	}
+
+	unsigned long c = crc;
+	while(len >= 8){
+		c = _mm_crc32_u64(c, *(const unsigned long*) buf);
+		buf += 8;
+		len -= 8;
+	}
+	while(len-- > 0){
+		c = _mm_crc32_u8(c, *buf++);
+	}
+	return c;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static unsigned int update_hw(unsigned int crc, const char *buf, long len){
+	while(len >= 3 * LANE){
+		unsigned int a = crc, b = 0, c = 0;
+		for(int i = 0; i < LANE; i += 8){
+			a = __crc32cd(a, *(const unsigned long*) &buf[i]);
+			b = __crc32cd(b, *(const unsigned long*) &buf[LANE + i]);
+			c = __crc32cd(c, *(const unsigned long*) &buf[2 * LANE + i]);
+		}
+		crc = shift_lane(shift_lane(a) ^ b) ^ c;
+		buf += 3 * LANE;
+		len -= 3 * LANE;
+	}
+
+	while(len >= 8){
+		crc = __crc32cd(crc, *(const unsigned long*) buf);
+		buf += 8;
+		len -= 8;
+	}
+	while(len-- > 0){
+		crc = __crc32cb(crc, *buf++);
+	}
+	return crc;
+}
+#endif
+
+/**
+ * Builds the tables and picks the CRC32C instructions when the CPU has them.
+ * Must be called before CRC_32C.
+ * Returns CRC_HW or CRC_TABLE
+ */
+int CRC_Init(){
+	for(int i = 0; i < 256; i++){
+		unsigned int crc = i;
+		for(int j = 0; j < 8; j++){
+			crc = crc & 1 ? crc >> 1 ^ POLY : crc >> 1;
+		}
+		table[0][i] = crc;
+	}
+	for(int i = 0; i < 256; i++){
+		for(int k = 1; k < 8; k++){
+			table[k][i] = table[0][table[k - 1][i] & 0xff] ^ table[k - 1][i] >> 8;
+		}
+	}
+
+	//Moving a checksum past zeros is linear in it, so each table entry is the xor of what its bits become
+	static const char zeros[LANE];
+	unsigned int bit[32];
+	for(int i = 0; i < 32; i++){
+		bit[i] = update_table(1U << i, zeros, LANE);
+	}
+	for(int k = 0; k < 4; k++){
+		for(int i = 0; i < 256; i++){
+			shift[k][i] = 0;
+			for(int j = 0; j < 8; j++){
+				shift[k][i] ^= i >> j & 1 ? bit[8 * k + j] : 0;
+			}
+		}
+	}
+
+	update = update_table;
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")){
+		update = update_hw;
+	}
+#elif defined(__aarch64__)
+	if(getauxval(AT_HWCAP) & HWCAP_CRC32){
+		update = update_hw;
+	}
+#endif
+	return update == update_table ? CRC_TABLE : CRC_HW;
+}
+
+/**
+ * Continues a CRC32C over buf. There is no inversion going in or coming out,
+ * so from a start of 0 a run of zeros checksums to 0; invert crc before and
+ * after for the standard CRC32C.
+ * crc[in] - The checksum so far, 0 to start
+ */
+unsigned int CRC_32C(unsigned int crc, const char *buf, long len){
+	return update(crc, buf, len);
+}
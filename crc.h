@@ -0,0 +1,10 @@
+#ifndef __CRC_h__
+#define __CRC_h__
+
+#define CRC_TABLE (0) // slicing by 8 tables, any CPU
+#define CRC_HW    (1) // the SSE4.2 or ARMv8 CRC32C instructions
+
+int CRC_Init();
+unsigned int CRC_32C(unsigned int crc, const char *buf, long len);
+
+#endif // __CRC_h__
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+
+#define PRIME1 (0x9e3779b185ebca87UL)
+#define PRIME2 (0xc2b2ae3d27d4eb4fUL)
+
+//A block last seen with some content hash
+typedef struct {
+	unsigned long hash;
+	int block;  //-1 if the slot is empty
+} entry_t;
+
+//The index of one image
+struct __Dedup {
+	entry_t *table;
+	int mask;          //Number of slots - 1
+	int *slot_of;      //Slot each block is indexed in, -1 if none
+
+	unsigned long writes, shared, ns_spent;
+};
+
+/**
+ * Sets up an empty index for an image with nblocks data blocks. Slots are
+ * direct mapped, there are at least twice as many as blocks so few collide.
+ * Returns the index, NULL if it can't be allocated
+ * nblocks[in] - Blocks in the data region
+ */
+Dedup *Dedup_Init(int nblocks){
+	Dedup *d = calloc(1, sizeof(Dedup));
+	if(!d){
+		return NULL;
+	}
+	int nslots = 1;
+	while(nslots < 2 * nblocks){
+		nslots <<= 1;
+	}
+	d->mask = nslots - 1;
+
+	d->table = malloc((size_t) nslots * sizeof(entry_t));
+	d->slot_of = malloc((size_t) nblocks * sizeof(int));
+	if(!d->table || !d->slot_of){
+		Dedup_Close(d);
+		return NULL;
+	}
+	for(int i = 0; i < nslots; i++){
+		d->table[i].block = -1;
+	}
+	memset(d->slot_of, -1, (size_t) nblocks * sizeof(int));
+	return d;
+}
+
+static unsigned long rotl(unsigned long x, int r){
+	return x << r | x >> (64 - r);
+}
+
+/**
+ * Hashes a block, 32 bytes at a time in four independent lanes
+ * len[in] - A multiple of 32
+ */
+unsigned long Dedup_Hash(const char *buf, int len){
+	unsigned long v[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+	for(int i = 0; i < len; i += 32){
+		for(int j = 0; j < 4; j++){
+			unsigned long w;
+			memcpy(&w, &buf[i + 8 * j], sizeof(w));
+			v[j] = rotl(v[j] + w * PRIME2, 31) * PRIME1;
+		}
+	}
+
+	unsigned long h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18) + len;
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	return h;
+}
+
+/**
+ * Returns the block last indexed with a hash, -1 if there is none
+ */
+int Dedup_Find(Dedup *d, unsigned long hash){
+	entry_t *e = &d->table[hash & d->mask];
+	return e->hash == hash ? e->block : -1;
+}
+
+/**
+ * Indexes a block under the hash of its contents, replacing whatever the slot held
+ */
+void Dedup_Insert(Dedup *d, unsigned long hash, int block){
+	int slot = hash & d->mask;
+	if(d->table[slot].block >= 0){
+		d->slot_of[d->table[slot].block] = -1;
+	}
+	Dedup_Forget(d, block);
+	d->table[slot].hash = hash;
+	d->table[slot].block = block;
+	d->slot_of[block] = slot;
+}
+
+/**
+ * Drops a block from the index, called when it is freed so it is never
+ * offered once it holds something else
+ */
+void Dedup_Forget(Dedup *d, int block){
+	if(d->slot_of[block] >= 0){
+		d->table[d->slot_of[block]].block = -1;
+		d->slot_of[block] = -1;
+	}
+}
+
+/**
+ * Counts a whole block write that went through the index
+ * was_shared[in] - 1 if it was pointed at an existing block instead of being written
+ * ns[in] - Time spent hashing, looking up and comparing
+ */
+void Dedup_Count(Dedup *d, int was_shared, long ns){
+	d->writes++;
+	d->shared += was_shared;
+	d->ns_spent += ns;
+}
+
+/**
+ * Prints how many block writes were saved and what the index cost per write
+ */
+void Dedup_Stats(Dedup *d, FILE *out){
+	fprintf(out, "dedup: %lu block writes, %lu shared, %.2f:1 ratio, %.0f ns per write\n",
+	        d->writes, d->shared, (double) d->writes / (d->writes > d->shared ? d->writes - d->shared : 1),
+	        d->writes ? (double) d->ns_spent / d->writes : 0);
+}
+
+/**
+ * Releases the index
+ */
+void Dedup_Close(Dedup *d){
+	free(d->table);
+	free(d->slot_of);
+	free(d);
+}
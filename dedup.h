@@ -0,0 +1,21 @@
+#ifndef __Dedup_h__
+#define __Dedup_h__
+
+#include <stdio.h>
+
+// an index from the content hash of a block to a block holding that content.
+// Entries are only hints: a slot holds the last block put there, and the
+// caller compares contents before sharing a block it was pointed to.
+// One index per image, calls on it are not locked
+typedef struct __Dedup Dedup;
+
+Dedup *Dedup_Init(int nblocks);
+unsigned long Dedup_Hash(const char *buf, int len);
+int Dedup_Find(Dedup *d, unsigned long hash);
+void Dedup_Insert(Dedup *d, unsigned long hash, int block);
+void Dedup_Forget(Dedup *d, int block);
+void Dedup_Count(Dedup *d, int shared, long ns);
+void Dedup_Stats(Dedup *d, FILE *out);
+void Dedup_Close(Dedup *d);
+
+#endif // __Dedup_h__
@@ -0,0 +1,707 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ufs.h"
+#include "img.h"
+#include "crc.h"
+
+#define MAX_THREADS (64)
+#define DIR_ENTS    (DIRECT_PTRS * bsize / (int) sizeof(dir_ent_t)) //Most entries a directory holds
+#define FILE_MAX    (DIRECT_PTRS * bsize) //Largest file the image can hold
+#define SCRUB_RUN   (256) //Data blocks read at once when checking their checksums
+
+int nthreads;
+
+int repair;            //1 with -r
+int scrub;             //1 with -c
+int verbose;           //1 with -v
+int fix_tree;          //1 if inodes and directories may be repaired too, not just the bitmaps and reference counts
+
+//What was found, by data block relative to the data region and by inode
+int *live;             //Pointers to each block from inodes in use
+int *held;             //Holds on each block by the snapshots
+unsigned char *is_copy;  //1 for blocks holding a snapshot's copy of an inode table block
+unsigned char *kept;     //Used while repairing blocks pointed at more than once, 2 for blocks files share on purpose
+unsigned char *reached;  //1 for inodes found walking the tree from the root
+int *parent;             //Parent of each directory reached, -1 if its .. is taken as it is
+
+//Directories of the level of the tree being walked, and of the next one
+int *level, nlevel;
+int *next_level, nnext;
+
+//A directory entry to be rewritten, applied once the walk is over
+typedef struct {
+	int block;       //Image block address
+	int slot;
+	dir_ent_t ent;
+} ent_fix_t;
+
+ent_fix_t *fixes;
+int nfixes, fixes_cap;
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; //Guards the problem counts, the fix list and the next level
+int problems, repaired;
+long files, dirs, used_blocks;
+
+void usage() {
+	fprintf(stderr, "usage: fsck -f <image_file> [-r] [-c] [-v] [-j <threads>]\n");
+	fprintf(stderr, "  -r  repair what is found, the image is otherwise only read\n");
+	fprintf(stderr, "  -c  also read every data block in use and check its checksum\n");
+	fprintf(stderr, "  -v  also list how fragmented every file is\n");
+	fprintf(stderr, "  -j  threads to check with, one per CPU by default\n");
+	fprintf(stderr, "the server must not be running on the image. After a crash start it once first,\n");
+	fprintf(stderr, "so writes left in its delayed allocation log are applied\n");
+	fprintf(stderr, "exit status: 0 clean, 1 problems were repaired, 4 problems were left, 8 the check failed\n");
+	exit(8);
+}
+
+/**
+ * Reports a problem and whether it was repaired
+ * fixed[in] - 1 if it was repaired
+ */
+void problem(int fixed, const char *fmt, ...){
+	va_list ap;
+	pthread_mutex_lock(&lock);
+	fprintf(stdout, "fsck: ");
+	va_start(ap, fmt);
+	vfprintf(stdout, fmt, ap);
+	va_end(ap);
+	fprintf(stdout, "%s\n", fixed ? ", repaired" : "");
+	problems++;
+	repaired += fixed;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Runs fn on every thread and waits for all of them, fn gets the thread number
+ */
+void run_threads(void *(*fn)(void*)){
+	pthread_t threads[MAX_THREADS];
+	for(long i = 0; i < nthreads; i++){
+		if(pthread_create(&threads[i], NULL, fn, (void*) i) != 0){
+			die("cannot start", "thread");
+		}
+	}
+	for(int i = 0; i < nthreads; i++){
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/**
+ * Splits n items into one range per thread. Ranges start on a multiple of 32
+ * so no two threads ever touch the same bitmap word.
+ */
+void thread_range(long id, int n, int *lo, int *hi){
+	int per = (n / nthreads + 32) / 32 * 32;
+	*lo = id * per < n ? id * per : n;
+	*hi = *lo + per < n ? *lo + per : n;
+}
+
+int is_csum_block(int block){
+	return block >= s->csum_addr && block < s->csum_addr + s->csum_len;
+}
+
+/**
+ * Checks the metadata against its checksums before anything changes it. Blocks
+ * that fail are still checked like the rest, a repair takes their checksums again.
+ */
+void check_meta(){
+	for(int b = 0; b < s->data_region_addr; b++){
+		if(!is_csum_block(b) && CRC_32C(0, &meta[(size_t) b * bsize], bsize) != csums[b]){
+			problem(repair, "metadata block %d fails its checksum", b);
+		}
+	}
+}
+
+/**
+ * Takes the checksums of the metadata again once repairs have changed it
+ */
+void csum_meta(){
+	for(int b = 0; b < s->data_region_addr; b++){
+		if(!is_csum_block(b)){
+			csums[b] = CRC_32C(0, &meta[(size_t) b * bsize], bsize);
+		}
+	}
+}
+
+/**
+ * Returns the inode table map of a snapshot slot
+ */
+unsigned int *snap_map(int slot){
+	int map_len = (s->snap_len - 1) / UFS_MAX_SNAPSHOTS;
+	return (unsigned int*) &meta[(s->snap_addr + 1 + slot * map_len) * bsize];
+}
+
+/**
+ * Counts a pointer from a live inode, so blocks pointed at twice show up
+ */
+void claim(int block){
+	__sync_fetch_and_add(&live[block], 1);
+}
+
+/**
+ * Checks the inodes in use in one thread's share of the inode table: their
+ * type, size and block pointers. Every valid pointer is claimed.
+ */
+void *check_inodes(void *arg){
+	int lo, hi;
+	thread_range((long) arg, num_inodes, &lo, &hi);
+
+	for(int inum = lo; inum < hi; inum++){
+		if(!get_bit(inode_bitmap, inum)){
+			continue;
+		}
+		inode_t *in = &inodes[inum];
+		int type = UFS_TYPE(in->type);
+
+		if((type != UFS_REGULAR_FILE && type != UFS_DIRECTORY) || (type == UFS_DIRECTORY && in->type & UFS_INLINE)){
+			//Nothing can be trusted, freeing it leaves the entries pointing at it to be cleared
+			if(fix_tree){
+				set_bit(inode_bitmap, inum, 0);
+			}
+			problem(fix_tree, "inode %d has bad type 0x%x", inum, in->type);
+			continue;
+		}
+
+		int max = in->type & UFS_INLINE ? UFS_INLINE_MAX : FILE_MAX;
+		if(in->size < 0 || in->size > max){
+			int size = in->size;
+			if(fix_tree){
+				in->size = size < 0 ? 0 : max;
+			}
+			problem(fix_tree, "inode %d has bad size %d", inum, size);
+		}
+		if(type == UFS_DIRECTORY && (in->size % sizeof(dir_ent_t) || in->size < 2 * (int) sizeof(dir_ent_t))){
+			int size = in->size;
+			if(fix_tree){
+				in->size = size < 2 * (int) sizeof(dir_ent_t) ? 2 * sizeof(dir_ent_t) : size / sizeof(dir_ent_t) * sizeof(dir_ent_t);
+			}
+			problem(fix_tree, "directory %d has bad size %d", inum, size);
+		}
+
+		if(in->type & UFS_INLINE){
+			continue;
+		}
+		for(int i = 0; i < DIRECT_PTRS; i++){
+			unsigned int addr = in->direct[i];
+			if(block_valid(addr)){
+				claim(addr - s->data_region_addr);
+			}else if(addr != 0 && addr != (unsigned int) -1){
+				if(fix_tree){
+					in->direct[i] = 0;
+				}
+				problem(fix_tree, "inode %d has bad block pointer %u at %d", inum, addr, i);
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads the blocks of a directory into buf, one read per contiguous run.
+ * Holes read as free entries, like the server skips them.
+ */
+void read_dir(inode_t *in, char *buf){
+	for(int i = 0; i < DIRECT_PTRS;){
+		if(!block_valid(in->direct[i])){
+			memset(&buf[i * bsize], 0xff, bsize);
+			i++;
+			continue;
+		}
+		int n = 1;
+		while(i + n < DIRECT_PTRS && in->direct[i + n] == in->direct[i] + n){
+			n++;
+		}
+		img_io(0, &buf[i * bsize], (long) n * bsize, (off_t) in->direct[i] * bsize);
+		i += n;
+	}
+}
+
+/**
+ * Queues a directory entry to be rewritten once the walk is over
+ */
+void fix_entry(inode_t *dir, int slot, int inum, char *name){
+	ent_fix_t f;
+	f.block = dir->direct[slot * sizeof(dir_ent_t) / bsize];
+	f.slot = slot % (bsize / sizeof(dir_ent_t));
+	memset(&f.ent, 0, sizeof(f.ent));
+	strcpy(f.ent.name, name);
+	f.ent.inum = inum;
+
+	pthread_mutex_lock(&lock);
+	if(nfixes == fixes_cap){
+		fixes_cap = fixes_cap ? 2 * fixes_cap : 64;
+		fixes = realloc(fixes, fixes_cap * sizeof(ent_fix_t));
+	}
+	fixes[nfixes++] = f;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Checks the entries of one thread's share of the directories on the current
+ * level of the tree. Every inode an entry leads to is reached once, the
+ * directories among them make up the next level.
+ */
+void *walk_level(void *arg){
+	int lo, hi;
+	thread_range((long) arg, nlevel, &lo, &hi);
+	char *buf = malloc(FILE_MAX);
+	dir_ent_t *ents = (dir_ent_t*) buf;
+	long nfiles = 0, ndirs = 0;
+
+	for(int d = lo; d < hi; d++){
+		int inum = level[d];
+		inode_t *in = &inodes[inum];
+		read_dir(in, buf);
+
+		int last = 0;
+		for(int j = 0; j < DIR_ENTS; j++){
+			if(ents[j].inum == -1 || !block_valid(in->direct[j * sizeof(dir_ent_t) / bsize])){
+				continue;
+			}
+			last = j + 1;
+			if(j < 2){
+				continue;
+			}
+
+			int child = ents[j].inum;
+			if(!memchr(ents[j].name, 0, sizeof(ents[j].name))){
+				problem(fix_tree, "directory %d has an entry with a bad name at %d", inum, j);
+			}else if(child < 0 || child >= num_inodes || !get_bit(inode_bitmap, child)){
+				problem(fix_tree, "directory %d entry %s leads to free inode %d", inum, ents[j].name, child);
+			}else if(__sync_lock_test_and_set(&reached[child], 1)){
+				problem(fix_tree, "directory %d entry %s leads to inode %d, which is linked elsewhere", inum, ents[j].name, child);
+			}else{
+				if(UFS_TYPE(inodes[child].type) == UFS_DIRECTORY){
+					parent[child] = inum;
+					pthread_mutex_lock(&lock);
+					next_level[nnext++] = child;
+					pthread_mutex_unlock(&lock);
+					ndirs++;
+				}else{
+					nfiles++;
+				}
+				continue;
+			}
+			if(fix_tree){
+				fix_entry(in, j, -1, "");
+			}
+		}
+
+		//The first two entries are always . and ..
+		int fixable = fix_tree && block_valid(in->direct[0]);
+		if(ents[0].inum != inum || strcmp(ents[0].name, ".") != 0){
+			if(fixable){
+				fix_entry(in, 0, inum, ".");
+			}
+			problem(fixable, "directory %d has a bad . entry", inum);
+		}
+		if(parent[inum] != -1 && (ents[1].inum != parent[inum] || strcmp(ents[1].name, "..") != 0)){
+			if(fixable){
+				fix_entry(in, 1, parent[inum], "..");
+			}
+			problem(fixable, "directory %d has a bad .. entry", inum);
+		}
+
+		//The server looks up every entry of its blocks, so the size must cover them
+		if(last * (int) sizeof(dir_ent_t) > in->size){
+			int size = in->size;
+			if(fix_tree){
+				in->size = last * sizeof(dir_ent_t);
+			}
+			problem(fix_tree, "directory %d has size %d short of its last entry", inum, size);
+		}
+	}
+
+	__sync_fetch_and_add(&files, nfiles);
+	__sync_fetch_and_add(&dirs, ndirs);
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Walks the tree below a directory one level at a time, the directories of a
+ * level are shared out between the threads
+ * top[in] - The directory, already marked reached
+ */
+void walk_tree(int top){
+	level[0] = top;
+	nlevel = 1;
+
+	while(nlevel){
+		nnext = 0;
+		run_threads(walk_level);
+
+		int *t = level;
+		level = next_level;
+		next_level = t;
+		nlevel = nnext;
+	}
+}
+
+/**
+ * Deals with the inodes in use that no directory leads to, after the walk.
+ * Each is linked back into the root directory as #<inum> while the root has
+ * room, freed otherwise. Only the top of a lost subtree is reported, the walk
+ * from it reaches the rest.
+ */
+void check_orphans(){
+	inode_t *root = &inodes[0];
+	dir_ent_t *ents = malloc(FILE_MAX);
+	read_dir(root, (char*) ents);
+	int slot = 2;
+
+	for(int inum = 1; inum < num_inodes; inum++){
+		if(!get_bit(inode_bitmap, inum) || reached[inum]){
+			continue;
+		}
+		reached[inum] = 1;
+
+		while(fix_tree && slot < DIR_ENTS && (ents[slot].inum != -1 || !block_valid(root->direct[slot * sizeof(dir_ent_t) / bsize]))){
+			slot++;
+		}
+		if(fix_tree && slot == DIR_ENTS){
+			inode_t *in = &inodes[inum];
+			set_bit(inode_bitmap, inum, 0);
+			for(int i = 0; !(in->type & UFS_INLINE) && i < DIRECT_PTRS; i++){
+				if(block_valid(in->direct[i])){
+					live[in->direct[i] - s->data_region_addr]--;
+				}
+			}
+			in->size = 0;
+			memset(in->direct, 0, sizeof(in->direct));
+			problem(1, "inode %d is in use but no directory leads to it, freed", inum);
+			continue;
+		}
+
+		if(fix_tree){
+			char name[28];
+			snprintf(name, sizeof(name), "#%d", inum);
+			fix_entry(root, slot, inum, name);
+			ents[slot].inum = inum;
+			if((slot + 1) * (int) sizeof(dir_ent_t) > root->size){
+				root->size = (slot + 1) * sizeof(dir_ent_t);
+			}
+			problem(1, "inode %d is in use but no directory leads to it, linked into the root as %s", inum, name);
+		}else{
+			problem(0, "inode %d is in use but no directory leads to it", inum);
+		}
+
+		if(UFS_TYPE(inodes[inum].type) == UFS_DIRECTORY){
+			parent[inum] = fix_tree ? 0 : -1;
+			dirs++;
+			walk_tree(inum);
+		}else{
+			files++;
+		}
+	}
+	free(ents);
+}
+
+/**
+ * Counts the holds of every snapshot: one on each inode table copy it reads,
+ * and one from each copy on every block the inodes in it point at
+ */
+void check_snapshots(){
+	inode_t table[UFS_MAX_BLOCK_SIZE / sizeof(inode_t)];
+	for(int i = 0; snaps && i < UFS_MAX_SNAPSHOTS; i++){
+		if(!snaps->ids[i]){
+			continue;
+		}
+		unsigned int *map = snap_map(i);
+		for(int k = 0; k < s->inode_region_len; k++){
+			if(!map[k]){
+				continue;
+			}
+			if(!block_valid(map[k])){
+				problem(0, "snapshot %d has bad inode table block %u", snaps->ids[i], map[k]);
+				continue;
+			}
+			int copy = map[k] - s->data_region_addr;
+			held[copy]++;
+			if(is_copy[copy]){
+				continue;
+			}
+			is_copy[copy] = 1;
+
+			img_io(0, (char*) table, bsize, (off_t) map[k] * bsize);
+			for(int n = 0; n < bsize / sizeof(inode_t); n++){
+				for(int j = 0; !(table[n].type & UFS_INLINE) && j < DIRECT_PTRS; j++){
+					if(block_valid(table[n].direct[j])){
+						held[table[n].direct[j] - s->data_region_addr]++;
+					}
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Drops all but the first pointer to each block that live inodes point at more
+ * than once. Files may share a block on purpose when the server dedups: the
+ * block then counts every pointer to it in its reference count.
+ */
+void check_shared(){
+	for(int inum = 0; inum < num_inodes; inum++){
+		inode_t *in = &inodes[inum];
+		if(!get_bit(inode_bitmap, inum) || in->type & UFS_INLINE){
+			continue;
+		}
+		for(int i = 0; i < DIRECT_PTRS; i++){
+			if(!block_valid(in->direct[i])){
+				continue;
+			}
+			int block = in->direct[i] - s->data_region_addr;
+			if(live[block] + is_copy[block] < 2){
+				continue;
+			}
+			int as_file = refs && !is_copy[block] && UFS_TYPE(in->type) == UFS_REGULAR_FILE;
+			if(as_file && (kept[block] == 2 || (!kept[block] && refs[block] >= live[block] + held[block] - 1))){
+				kept[block] = 2;
+				continue;
+			}
+			if(!kept[block] && !is_copy[block]){
+				kept[block] = 1;
+				continue;
+			}
+			if(fix_tree){
+				in->direct[i] = 0;
+				live[block]--;
+			}
+			problem(fix_tree, "inode %d block %d is also used by another file", inum, block);
+		}
+	}
+}
+
+/**
+ * Cross checks one thread's share of the data blocks against the data bitmap
+ * and the reference counts
+ */
+void *check_blocks(void *arg){
+	int lo, hi;
+	thread_range((long) arg, s->data_region_len, &lo, &hi);
+	long used = 0;
+
+	for(int b = lo; b < hi; b++){
+		int holders = live[b] + held[b];
+		used += holders > 0;
+		if(holders > 0 && !get_bit(data_bitmap, b)){
+			if(repair){
+				set_bit(data_bitmap, b, 1);
+			}
+			problem(repair, "block %d is in use but marked free", b);
+		}else if(holders == 0 && get_bit(data_bitmap, b)){
+			if(repair){
+				set_bit(data_bitmap, b, 0);
+			}
+			problem(repair, "block %d is marked in use but nothing uses it", b);
+		}
+
+		//A block has one holder besides those it counts, the live image is one holder at most unless files share it
+		int want = (live[b] > 1 && kept[b] != 2 ? 1 : live[b]) + held[b] - 1;
+		want = want < 0 ? 0 : want;
+		if(refs && refs[b] != want){
+			int was = refs[b];
+			if(repair){
+				refs[b] = want;
+			}
+			problem(repair, "block %d has reference count %d, %d expected", b, was, want);
+		}
+	}
+	__sync_fetch_and_add(&used_blocks, used);
+	return NULL;
+}
+
+/**
+ * Reads one thread's share of the data blocks in use and checks their
+ * checksums. What fails can't be repaired, the data is simply wrong.
+ */
+void *check_data(void *arg){
+	int lo, hi;
+	thread_range((long) arg, s->data_region_len, &lo, &hi);
+	char *buf = malloc((size_t) SCRUB_RUN * bsize);
+	if(!buf){
+		die("cannot allocate", "buffer");
+	}
+
+	for(int first = lo; first < hi; first += SCRUB_RUN){
+		int n = hi - first < SCRUB_RUN ? hi - first : SCRUB_RUN;
+		img_io(0, buf, (long) n * bsize, (off_t)(s->data_region_addr + first) * bsize);
+		for(int i = 0; i < n; i++){
+			int b = first + i;
+			if(live[b] + held[b] > 0 && CRC_32C(0, &buf[(size_t) i * bsize], bsize) != csums[s->data_region_addr + b]){
+				problem(0, "block %d fails its checksum", b);
+			}
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Reports how fragmented the files are: the runs of adjacent blocks past the
+ * first of each file, over the most there could be. 0 when every file is
+ * contiguous, 1 when no two blocks of any file are adjacent. The server's
+ * defragmenter (-f) works towards 0.
+ */
+void report_frag(){
+	long extra = 0, most = 0, fragmented = 0, stored = 0;
+	for(int inum = 0; inum < num_inodes; inum++){
+		inode_t *in = &inodes[inum];
+		if(!get_bit(inode_bitmap, inum) || in->type & UFS_INLINE){
+			continue;
+		}
+		int extents = 0, nblocks = 0;
+		unsigned int last = 0;
+		for(int i = 0; i < DIRECT_PTRS; i++){
+			if(block_valid(in->direct[i])){
+				extents += !nblocks || in->direct[i] != last + 1;
+				last = in->direct[i];
+				nblocks++;
+			}
+		}
+		if(!nblocks){
+			continue;
+		}
+		stored++;
+		fragmented += extents > 1;
+		extra += extents - 1;
+		most += nblocks - 1;
+		if(verbose){
+			printf("inode %d: %d blocks in %d runs, fragmentation %.3f\n",
+			       inum, nblocks, extents, nblocks > 1 ? (double) (extents - 1) / (nblocks - 1) : 0);
+		}
+	}
+	printf("%ld of %ld inodes with blocks fragmented, fragmentation %.3f\n", fragmented, stored, most ? (double) extra / most : 0);
+}
+
+// checks that the bitmaps, inodes, directories and snapshots of an image agree, and optionally repairs them
+int main(int argc, char *argv[]) {
+	int ch;
+	char *image_file = NULL;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	img_tool = "fsck";
+	img_fail = 8;
+
+	while((ch = getopt(argc, argv, "f:rcvj:")) != -1){
+		switch(ch){
+			case 'f':
+				image_file = optarg;
+				break;
+			case 'r':
+				repair = 1;
+				break;
+			case 'c':
+				scrub = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'j':
+				nthreads = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if(!image_file || optind != argc || nthreads < 1){
+		usage();
+	}
+	nthreads = nthreads > MAX_THREADS ? MAX_THREADS : nthreads;
+
+	img = open(image_file, repair ? O_RDWR : O_RDONLY);
+	if(img < 0){
+		die("cannot open", image_file);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	CRC_Init();
+	load_meta();
+	if(csums){
+		check_meta();
+	}else if(scrub){
+		fprintf(stderr, "fsck: %s has no checksums\n", image_file);
+		scrub = 0;
+	}
+
+	//Inodes and directories may be what a snapshot still reads, only the bitmaps and counts are safe to change then
+	int nsnaps = 0;
+	for(int i = 0; snaps && i < UFS_MAX_SNAPSHOTS; i++){
+		nsnaps += snaps->ids[i] != 0;
+	}
+	fix_tree = repair && !nsnaps;
+	if(repair && nsnaps){
+		fprintf(stderr, "fsck: %s has snapshots, only the bitmaps and reference counts are repaired\n", image_file);
+	}
+
+	live = calloc(s->data_region_len, sizeof(int));
+	held = calloc(s->data_region_len, sizeof(int));
+	is_copy = calloc(s->data_region_len, 1);
+	kept = calloc(s->data_region_len, 1);
+	reached = calloc(num_inodes, 1);
+	parent = calloc(num_inodes, sizeof(int));
+	if(!live || !held || !is_copy || !kept || !reached || !parent){
+		die("cannot allocate", "tables");
+	}
+
+	run_threads(check_inodes);
+	if(!get_bit(inode_bitmap, 0) || UFS_TYPE(inodes[0].type) != UFS_DIRECTORY){
+		fprintf(stderr, "fsck: %s has no root directory\n", image_file);
+		exit(8);
+	}
+	level = malloc(num_inodes * sizeof(int));
+	next_level = malloc(num_inodes * sizeof(int));
+	if(!level || !next_level){
+		die("cannot allocate", "tables");
+	}
+	reached[0] = 1;
+	dirs = 1;
+	walk_tree(0);
+	check_orphans();
+	check_snapshots();
+	check_shared();
+	run_threads(check_blocks);
+	if(scrub){
+		run_threads(check_data);
+	}
+
+	if(repair && repaired){
+		//Directories first, then the metadata, like the server orders its writes
+		char buf[UFS_MAX_BLOCK_SIZE];
+		for(int i = 0; i < nfixes; i++){
+			img_io(0, buf, bsize, (off_t) fixes[i].block * bsize);
+			memcpy(&buf[fixes[i].slot * sizeof(dir_ent_t)], &fixes[i].ent, sizeof(dir_ent_t));
+			img_io(1, buf, bsize, (off_t) fixes[i].block * bsize);
+			if(csums){
+				csums[fixes[i].block] = CRC_32C(0, buf, bsize);
+			}
+		}
+		if(fsync(img) != 0){
+			die("cannot sync", image_file);
+		}
+		if(csums){
+			csum_meta();
+		}
+		img_io(1, meta, (long) s->data_region_addr * bsize, 0);
+		if(fsync(img) != 0){
+			die("cannot sync", image_file);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%ld files, %ld directories, %ld of %d blocks in use, %d snapshots, checked with %d threads in %.3f s\n",
+	       files, dirs, used_blocks, s->data_region_len, nsnaps, nthreads, secs);
+	report_frag();
+	printf("%d problems, %d repaired\n", problems, repaired);
+	close(img);
+	return problems == 0 ? 0 : problems == repaired ? 1 : 4;
+}
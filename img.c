@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "img.h"
+
+super_t *s;
+char *meta;
+unsigned int *inode_bitmap;
+unsigned int *data_bitmap;
+inode_t *inodes;
+ufs_ref_t *refs;
+snap_table_t *snaps;
+ufs_csum_t *csums;
+int num_inodes;
+int bsize;
+int img;
+
+char *img_tool = "img";
+int img_fail = 1;
+
+/**
+ * Reports an error of a system call and gives up
+ * what[in] - What was being done
+ * path[in] - What it was done to
+ */
+void die(char *what, char *path){
+	fprintf(stderr, "%s: %s %s: %s\n", img_tool, what, path, strerror(errno));
+	exit(img_fail);
+}
+
+/**
+ * Reads or writes all of a range of the image, retrying short transfers
+ * write[in] - 1 to write buf to the image, 0 to read it
+ */
+void img_io(int write, char *buf, long len, off_t off){
+	while(len > 0){
+		ssize_t rc = write ? pwrite(img, buf, len, off) : pread(img, buf, len, off);
+		if(rc < 0 && errno == EINTR){
+			continue;
+		}
+		if(rc < 0){
+			die(write ? "cannot write" : "cannot read", "image");
+		}
+		if(rc == 0){
+			//Past the end of a sparse image reads as zeros
+			memset(buf, 0, len);
+			return;
+		}
+		buf += rc;
+		len -= rc;
+		off += rc;
+	}
+}
+
+/**
+ * Reads the super block, the bitmaps, the inode table and the reference count,
+ * snapshot and checksum regions, which sit in front of the data region
+ */
+void load_meta(){
+	super_t sb;
+	img_io(0, (char*) &sb, sizeof(sb), 0);
+	if(sb.data_region_addr <= 0 || sb.inode_region_addr <= 0 || sb.data_region_len <= 0){
+		fprintf(stderr, "%s: not an image\n", img_tool);
+		exit(img_fail);
+	}
+
+	bsize = UFS_BSIZE(&sb);
+	if(bsize < UFS_BLOCK_SIZE || bsize > UFS_MAX_BLOCK_SIZE || (bsize & (bsize - 1))){
+		fprintf(stderr, "%s: unsupported block size %d\n", img_tool, bsize);
+		exit(img_fail);
+	}
+
+	meta = malloc((size_t) sb.data_region_addr * bsize);
+	if(!meta){
+		die("cannot allocate", "metadata");
+	}
+	img_io(0, meta, (long) sb.data_region_addr * bsize, 0);
+	s = (super_t*) meta;
+	inode_bitmap = (unsigned int*) &meta[s->inode_bitmap_addr * bsize];
+	data_bitmap = (unsigned int*) &meta[s->data_bitmap_addr * bsize];
+	inodes = (inode_t*) &meta[s->inode_region_addr * bsize];
+	num_inodes = bsize * s->inode_region_len / sizeof(inode_t);
+	if(s->ref_len > 0 && s->snap_len > 1){
+		refs = (ufs_ref_t*) &meta[s->ref_addr * bsize];
+		snaps = (snap_table_t*) &meta[s->snap_addr * bsize];
+	}
+	if(s->csum_len > 0){
+		csums = (ufs_csum_t*) &meta[s->csum_addr * bsize];
+	}
+}
+
+int get_bit(unsigned int *map, int i){
+	return map[i / 32] >> (31 - i % 32) & 0x01;
+}
+
+void set_bit(unsigned int *map, int i, int on){
+	if(on){
+		map[i / 32] |= 1U << (31 - i % 32);
+	}else{
+		map[i / 32] &= ~(1U << (31 - i % 32));
+	}
+}
+
+/**
+ * Returns 1 if addr is a block in the data region, 0 for unused pointers (0 or -1)
+ */
+int block_valid(unsigned int addr){
+	return addr >= s->data_region_addr && addr < s->data_region_addr + s->data_region_len;
+}
@@ -0,0 +1,34 @@
+#ifndef __IMG_h__
+#define __IMG_h__
+
+#include <sys/types.h>
+#include "ufs.h"
+
+// helpers shared by the offline tools, fsck and imgtool, which work on an
+// image directly while no server runs on it
+
+// metadata of the image, everything in front of the data region, see load_meta
+extern super_t *s;
+extern char *meta;
+extern unsigned int *inode_bitmap;
+extern unsigned int *data_bitmap;
+extern inode_t *inodes;
+extern ufs_ref_t *refs;       // NULL on images without room for snapshots
+extern snap_table_t *snaps;   // NULL on images without room for snapshots
+extern ufs_csum_t *csums;     // NULL on images without checksums
+extern int num_inodes;
+extern int bsize;             // bytes in every block of the image
+extern int img;               // the image, opened by the tool
+
+extern char *img_tool;        // name errors are reported under
+extern int img_fail;          // exit status of a tool that gives up
+
+void die(char *what, char *path);
+void img_io(int write, char *buf, long len, off_t off);
+void load_meta();
+
+int get_bit(unsigned int *map, int i);
+void set_bit(unsigned int *map, int i, int on);
+int block_valid(unsigned int addr);
+
+#endif // __IMG_h__
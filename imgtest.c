@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "img.h"
+
+//Tests of the offline tools, run from the directory holding mkfs, fsck and imgtool
+
+char dir[64];  //Scratch directory everything is made in
+char cmd[512];
+
+/**
+ * Runs a command in the scratch directory with its output thrown away
+ * Returns its exit status
+ */
+int run(const char *fmt, ...){
+	char line[256];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	snprintf(cmd, sizeof(cmd), "cd %s && %s >/dev/null 2>&1", dir, line);
+	int rc = system(cmd);
+	return WIFEXITED(rc) ? WEXITSTATUS(rc) : -1;
+}
+
+/**
+ * Writes a host file of n bytes, each made from seed and its offset
+ */
+void make_file(char *path, int n, int seed){
+	char name[256];
+	snprintf(name, sizeof(name), "%s/%s", dir, path);
+	FILE *f = fopen(name, "w");
+	assert(f);
+	for(int i = 0; i < n; i++){
+		fputc((i * 31 + seed) & 0xff, f);
+	}
+	fclose(f);
+}
+
+/**
+ * Returns 1 if two host files under the scratch directory hold the same bytes
+ */
+int same_file(char *a, char *b){
+	char name[256];
+	snprintf(name, sizeof(name), "%s/%s", dir, a);
+	FILE *fa = fopen(name, "r");
+	snprintf(name, sizeof(name), "%s/%s", dir, b);
+	FILE *fb = fopen(name, "r");
+	int same = fa && fb;
+	while(same){
+		int ca = fgetc(fa), cb = fgetc(fb);
+		same = ca == cb;
+		if(ca == EOF){
+			break;
+		}
+	}
+	if(fa){
+		fclose(fa);
+	}
+	if(fb){
+		fclose(fb);
+	}
+	return same;
+}
+
+/**
+ * Opens an image in the scratch directory and reads its metadata
+ */
+void open_image(char *path){
+	char name[256];
+	snprintf(name, sizeof(name), "%s/%s", dir, path);
+	img = open(name, O_RDWR);
+	assert(img >= 0);
+	free(meta);
+	refs = NULL;
+	snaps = NULL;
+	csums = NULL;
+	load_meta();
+}
+
+/**
+ * Writes the metadata back and closes the image. Checksums are left as they
+ * were, so the blocks changed also fail theirs.
+ */
+void close_image(){
+	img_io(1, meta, (long) s->data_region_addr * bsize, 0);
+	close(img);
+}
+
+int main(int argc, char *argv[]) {
+	strcpy(dir, "/tmp/imgtest.XXXXXX");
+	assert(mkdtemp(dir));
+	char here[256];
+	assert(getcwd(here, sizeof(here)));
+	assert(run("cp %s/mkfs %s/fsck %s/imgtool .", here, here, here) == 0);
+
+	//A tree with an empty file, an inline one, files of several blocks and nested directories
+	assert(run("mkdir -p src/sub/deeper") == 0);
+	make_file("src/empty", 0, 0);
+	make_file("src/tiny", 50, 1);
+	make_file("src/big", 3 * 4096 + 100, 2);
+	make_file("src/sub/mid", 4096, 3);
+	make_file("src/sub/deeper/last", 2 * 4096 + 1, 4);
+
+	assert(run("./mkfs -f img -d 128 -i 64") == 0);
+	assert(run("./imgtool -f img -i src") == 0);
+	assert(run("./fsck -f img") == 0);                //Test: An imported tree is clean
+	assert(run("./imgtool -f img -e out") == 0);
+	char *files[] = { "empty", "tiny", "big", "sub/mid", "sub/deeper/last" };
+	for(int i = 0; i < 5; i++){
+		char a[64], b[64];
+		snprintf(a, sizeof(a), "src/%s", files[i]);
+		snprintf(b, sizeof(b), "out/%s", files[i]);
+		assert(same_file(a, b));                      //Test: Export gives back what was imported
+	}
+	assert(run("./imgtool -f img -i src") == 0);      //Test: Names already there are skipped
+	assert(run("./fsck -f img") == 0);
+
+	//Test: An import that runs out of blocks leaves the image as it was
+	assert(run("mkdir many") == 0);
+	for(int i = 0; i < 8; i++){
+		char name[64];
+		snprintf(name, sizeof(name), "many/f%d", i);
+		make_file(name, 5 * 4096, i);
+	}
+	assert(run("./mkfs -f small -d 32 -i 64") == 0);
+	assert(run("./imgtool -f small -i src") == 0);
+	assert(run("./imgtool -f small -i many") == 1);
+	assert(run("./fsck -f small") == 0);
+	assert(run("./imgtool -f small -e back") == 0);
+	assert(same_file("src/big", "back/big"));
+	assert(run("test -e back/f0") == 1);
+
+	//Break one of each: the bitmap, a block pointer, a reference count, and an inode nothing leads to
+	open_image("img");
+	int big = -1;
+	for(int inum = 1; inum < num_inodes; inum++){
+		if(get_bit(inode_bitmap, inum) && UFS_TYPE(inodes[inum].type) == UFS_REGULAR_FILE && inodes[inum].size > 3 * bsize){
+			big = inum;
+		}
+	}
+	assert(big > 0);
+	int orphan = 1;
+	while(get_bit(inode_bitmap, orphan)){
+		orphan++;
+	}
+	unsigned int *direct = inodes[big].direct;
+	set_bit(data_bitmap, direct[0] - s->data_region_addr, 0);
+	direct[1] = s->data_region_addr + s->data_region_len + 7;
+	assert(refs);
+	refs[direct[2] - s->data_region_addr] = 2;
+	set_bit(inode_bitmap, orphan, 1);
+	memset(&inodes[orphan], 0, sizeof(inode_t));
+	inodes[orphan].type = UFS_REGULAR_FILE;
+	close_image();
+
+	assert(run("./fsck -f img") == 4);                //Test: Problems found without -r are left
+	assert(run("./fsck -f img") == 4);                //Test: Without -r the image is only read
+	assert(run("./fsck -f img -r") == 1);             //Test: Repairs them all
+	assert(run("./fsck -f img") == 0);                //Test: Second pass is clean
+	assert(run("./fsck -f img -c") == 0);             //Test: Repaired blocks and metadata pass their checksums
+
+	open_image("img");
+	assert(get_bit(data_bitmap, inodes[big].direct[0] - s->data_region_addr));
+	assert(inodes[big].direct[1] == 0);               //Test: Bad pointer is dropped
+	assert(refs[inodes[big].direct[2] - s->data_region_addr] == 0);
+	assert(get_bit(inode_bitmap, orphan));            //Test: Orphan is linked into the root
+	close(img);
+	assert(run("rm -rf out && ./imgtool -f img -e out") == 0);
+	snprintf(cmd, sizeof(cmd), "%s/out/#%d", dir, orphan);
+	struct stat st;
+	assert(stat(cmd, &st) == 0 && st.st_size == 0);
+	assert(same_file("src/sub/deeper/last", "out/sub/deeper/last")); //Test: Files that were fine are untouched
+
+	assert(run("truncate -s 65536 junk") == 0);
+	assert(run("./fsck -f junk") == 8);               //Test: Something that is not an image
+	assert(run("./fsck -f missing") == 8);
+
+	run("rm -rf %s", dir);
+	printf("IMAGE TOOL TESTS PASSED\n");
+	return 0;
+}
@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "ufs.h"
+#include "img.h"
+#include "crc.h"
+
+#define IO_BLOCKS   (256)  //Data blocks gathered before one write to the image
+#define DIR_ENTS    (DIRECT_PTRS * bsize / (int) sizeof(dir_ent_t)) //Most entries a directory holds
+#define FILE_MAX    (DIRECT_PTRS * bsize) //Largest file the image can hold
+
+//Allocation cursors, new inodes and blocks are handed out in order so the import lays out contiguously
+int next_inode = 1;
+int next_block = 1;
+
+//Data blocks waiting to be written, always a contiguous run starting at out_first
+char *out;
+int out_first;
+int out_len;
+
+//Blocks of the root directory its new copy replaces, freed with the metadata write
+int replaced[DIRECT_PTRS];
+int nreplaced;
+
+//Totals reported at the end
+long files, dirs, blocks, bytes;
+
+//A directory being imported, with the entries it will hold
+typedef struct {
+	int inum;
+	int n;                    //Entries in use, the directory size is n entries
+	dir_ent_t ents[DIRECT_PTRS * UFS_MAX_BLOCK_SIZE / sizeof(dir_ent_t)]; //Room for DIR_ENTS at any block size
+} dir_t;
+
+void usage() {
+	fprintf(stderr, "usage: imgtool -f <image_file> (-i <src_dir> | -e <dst_dir>)\n");
+	fprintf(stderr, "  -i  copy a host directory tree into the root directory of the image\n");
+	fprintf(stderr, "  -e  copy the whole image out to a host directory\n");
+	fprintf(stderr, "the server must not be running on the image, and must have been shut down\n");
+	fprintf(stderr, "cleanly so no writes are left in its delayed allocation log\n");
+	exit(1);
+}
+
+/**
+ * Writes out the gathered data blocks in one go
+ */
+void flush_out(){
+	if(out_len){
+		img_io(1, out, (long) out_len * bsize, (off_t)(s->data_region_addr + out_first) * bsize);
+		out_len = 0;
+	}
+}
+
+/**
+ * Queues a block for writing. Blocks that continue the gathered run join it,
+ * anything else writes the run out first.
+ * block[in] - The block id, relative to the data region
+ */
+void put_block(int block, char *buf){
+	if(out_len && (block != out_first + out_len || out_len == IO_BLOCKS)){
+		flush_out();
+	}
+	if(!out_len){
+		out_first = block;
+	}
+	memcpy(&out[(size_t) out_len * bsize], buf, bsize);
+	if(csums){
+		csums[s->data_region_addr + block] = CRC_32C(0, buf, bsize);
+	}
+	out_len++;
+	blocks++;
+}
+
+/**
+ * Returns the next free inode, its bit is set and the inode cleared
+ */
+int alloc_inode(){
+	while(next_inode < num_inodes && get_bit(inode_bitmap, next_inode)){
+		next_inode++;
+	}
+	if(next_inode >= num_inodes){
+		fprintf(stderr, "imgtool: out of inodes, the image is left as it was\n");
+		exit(1);
+	}
+	set_bit(inode_bitmap, next_inode, 1);
+	memset(&inodes[next_inode], 0, sizeof(inode_t));
+	return next_inode++;
+}
+
+/**
+ * Returns the next free data block relative to the data region, its bit is set
+ */
+int alloc_block(){
+	while(next_block < s->data_region_len && get_bit(data_bitmap, next_block)){
+		next_block++;
+	}
+	if(next_block >= s->data_region_len){
+		fprintf(stderr, "imgtool: out of data blocks, the image is left as it was\n");
+		exit(1);
+	}
+	set_bit(data_bitmap, next_block, 1);
+	return next_block++;
+}
+
+/**
+ * Copies a host file into an inode. Files that fit are kept inline like the server does.
+ */
+void import_file(char *path, int inum, char *buf){
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		die("cannot open", path);
+	}
+	long size = 0;
+	while(size <= FILE_MAX){
+		ssize_t rc = read(fd, &buf[size], FILE_MAX + 1 - size);
+		if(rc < 0 && errno == EINTR){
+			continue;
+		}
+		if(rc < 0){
+			die("cannot read", path);
+		}
+		if(rc == 0){
+			break;
+		}
+		size += rc;
+	}
+	close(fd);
+	if(size > FILE_MAX){
+		fprintf(stderr, "imgtool: %s grew past %d bytes while importing\n", path, FILE_MAX);
+		exit(1);
+	}
+
+	inode_t *in = &inodes[inum];
+	in->type = UFS_REGULAR_FILE;
+	in->size = size;
+	if(size <= UFS_INLINE_MAX){
+		in->type |= UFS_INLINE;
+		memcpy(in->direct, buf, size);
+	}else{
+		memset(&buf[size], 0, FILE_MAX + bsize - size);
+		for(int i = 0; i * bsize < size; i++){
+			int block = alloc_block();
+			put_block(block, &buf[i * bsize]);
+			in->direct[i] = s->data_region_addr + block;
+		}
+	}
+	files++;
+	bytes += size;
+}
+
+/**
+ * Writes the blocks of a directory from its entries and sets its size.
+ * Blocks the directory already has in the image, which only the root
+ * directory does, are left alone and replaced by new ones. The image
+ * switches to them with the metadata write.
+ */
+void put_dir(dir_t *d){
+	inode_t *in = &inodes[d->inum];
+	in->type = UFS_DIRECTORY;
+	in->size = d->n * sizeof(dir_ent_t);
+
+	int per_block = bsize / sizeof(dir_ent_t);
+	for(int i = 0; i * per_block < d->n; i++){
+		if(block_valid(in->direct[i])){
+			replaced[nreplaced++] = in->direct[i] - s->data_region_addr;
+		}
+		in->direct[i] = s->data_region_addr + alloc_block();
+		put_block(in->direct[i] - s->data_region_addr, (char*) &d->ents[i * per_block]);
+	}
+}
+
+int cmp_name(const void *a, const void *b){
+	return strcmp(*(char**) a, *(char**) b);
+}
+
+/**
+ * Copies the contents of a host directory into d, then recurses into its subdirectories.
+ * The directory blocks go first, then the data of its files, then its subdirectories,
+ * so a fresh image is laid out in the order it will be read back.
+ * buf[in] - Scratch space for a whole file
+ */
+void import_dir(char *path, dir_t *d, char *buf){
+	DIR *dp = opendir(path);
+	if(!dp){
+		die("cannot open", path);
+	}
+
+	//Sorted so the image comes out the same every time
+	int nnames = 0, cap = 64;
+	char **names = malloc(cap * sizeof(char*));
+	struct dirent *de;
+	while((de = readdir(dp))){
+		if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0){
+			continue;
+		}
+		if(nnames == cap){
+			cap *= 2;
+			names = realloc(names, cap * sizeof(char*));
+		}
+		names[nnames++] = strdup(de->d_name);
+	}
+	closedir(dp);
+	qsort(names, nnames, sizeof(char*), cmp_name);
+
+	int *kids = malloc(nnames * sizeof(int));
+	int *is_dir = malloc(nnames * sizeof(int));
+	char child[4096];
+	for(int i = 0; i < nnames; i++){
+		kids[i] = -1;
+		snprintf(child, sizeof(child), "%s/%s", path, names[i]);
+
+		struct stat st;
+		if(lstat(child, &st) != 0){
+			die("cannot stat", child);
+		}
+		if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)){
+			fprintf(stderr, "imgtool: skipping %s, not a file or directory\n", child);
+			continue;
+		}
+		if(strlen(names[i]) >= sizeof(d->ents[0].name)){
+			fprintf(stderr, "imgtool: skipping %s, name is longer than %zu bytes\n", child, sizeof(d->ents[0].name) - 1);
+			continue;
+		}
+		if(S_ISREG(st.st_mode) && st.st_size > FILE_MAX){
+			fprintf(stderr, "imgtool: skipping %s, larger than %d bytes\n", child, FILE_MAX);
+			continue;
+		}
+
+		//Take the first free slot, like the server, and refuse names that are already there
+		int slot = d->n;
+		int taken = 0;
+		for(int j = 0; j < d->n; j++){
+			if(d->ents[j].inum == -1){
+				slot = j < slot ? j : slot;
+			}else if(strcmp(d->ents[j].name, names[i]) == 0){
+				taken = 1;
+			}
+		}
+		if(taken){
+			fprintf(stderr, "imgtool: skipping %s, already in the image\n", child);
+			continue;
+		}
+		if(slot == DIR_ENTS){
+			fprintf(stderr, "imgtool: skipping %s, directory is full\n", child);
+			continue;
+		}
+
+		kids[i] = alloc_inode();
+		is_dir[i] = S_ISDIR(st.st_mode);
+		memset(&d->ents[slot], 0, sizeof(dir_ent_t));
+		strcpy(d->ents[slot].name, names[i]);
+		d->ents[slot].inum = kids[i];
+		if(slot == d->n){
+			d->n++;
+		}
+	}
+	put_dir(d);
+
+	for(int i = 0; i < nnames; i++){
+		if(kids[i] != -1 && !is_dir[i]){
+			snprintf(child, sizeof(child), "%s/%s", path, names[i]);
+			import_file(child, kids[i], buf);
+		}
+	}
+
+	for(int i = 0; i < nnames; i++){
+		if(kids[i] != -1 && is_dir[i]){
+			dir_t *sub = malloc(sizeof(dir_t));
+			if(!sub){
+				die("cannot allocate", "directory");
+			}
+			memset(sub, 0, sizeof(dir_t));
+			for(int j = 0; j < DIR_ENTS; j++){
+				sub->ents[j].inum = -1;
+			}
+			sub->inum = kids[i];
+			strcpy(sub->ents[0].name, ".");
+			sub->ents[0].inum = kids[i];
+			strcpy(sub->ents[1].name, "..");
+			sub->ents[1].inum = d->inum;
+			sub->n = 2;
+
+			snprintf(child, sizeof(child), "%s/%s", path, names[i]);
+			dirs++;
+			import_dir(child, sub, buf);
+			free(sub);
+		}
+		free(names[i]);
+	}
+	free(names);
+	free(kids);
+	free(is_dir);
+}
+
+/**
+ * Reads the blocks of a file or directory, one pread per run of consecutive blocks.
+ * Holes read as zeros.
+ * buf[out] - At least size bytes rounded up to a block
+ */
+void read_blocks(inode_t *in, int size, char *buf){
+	int n = (size + bsize - 1) / bsize;
+	for(int i = 0; i < n;){
+		if(!block_valid(in->direct[i])){
+			memset(&buf[i * bsize], 0, bsize);
+			i++;
+			continue;
+		}
+		int run = 1;
+		while(i + run < n && in->direct[i + run] == in->direct[i] + run){
+			run++;
+		}
+		img_io(0, &buf[i * bsize], (long) run * bsize, (off_t) in->direct[i] * bsize);
+		for(int j = i; csums && j < i + run; j++){
+			if(CRC_32C(0, &buf[j * bsize], bsize) != csums[in->direct[j]]){
+				fprintf(stderr, "imgtool: block %u fails its checksum\n", in->direct[j]);
+			}
+		}
+		i += run;
+	}
+}
+
+/**
+ * Copies a file out of the image with one write
+ */
+void export_file(char *path, int inum, char *buf){
+	inode_t *in = &inodes[inum];
+	if(in->type & UFS_INLINE){
+		memcpy(buf, in->direct, in->size);
+	}else{
+		read_blocks(in, in->size, buf);
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd < 0){
+		die("cannot create", path);
+	}
+	for(long done = 0; done < in->size;){
+		ssize_t rc = write(fd, &buf[done], in->size - done);
+		if(rc < 0 && errno == EINTR){
+			continue;
+		}
+		if(rc < 0){
+			die("cannot write", path);
+		}
+		done += rc;
+	}
+	close(fd);
+	files++;
+	bytes += in->size;
+}
+
+/**
+ * Copies a directory of the image and everything below it to a host directory
+ */
+void export_dir(char *path, int inum, char *buf){
+	inode_t *in = &inodes[inum];
+	int size = in->size < FILE_MAX ? in->size : FILE_MAX;
+	dir_ent_t *ents = malloc(FILE_MAX);
+	if(!ents){
+		die("cannot allocate", "directory");
+	}
+	read_blocks(in, size, (char*) ents);
+
+	char child[4096];
+	for(int i = 0; i < size / (int) sizeof(dir_ent_t); i++){
+		int c = ents[i].inum;
+		if(c < 0 || c >= num_inodes || !get_bit(inode_bitmap, c)){
+			continue;
+		}
+		if(strcmp(ents[i].name, ".") == 0 || strcmp(ents[i].name, "..") == 0){
+			continue;
+		}
+		ents[i].name[sizeof(ents[i].name) - 1] = 0;
+		snprintf(child, sizeof(child), "%s/%s", path, ents[i].name);
+
+		if(UFS_TYPE(inodes[c].type) == UFS_DIRECTORY){
+			if(mkdir(child, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST){
+				die("cannot create", child);
+			}
+			dirs++;
+			export_dir(child, c, buf);
+		}else{
+			export_file(child, c, buf);
+		}
+	}
+	free(ents);
+}
+
+// copies a host directory tree into an image or an image out to a host directory, without a server
+int main(int argc, char *argv[]) {
+	int ch;
+	char *image_file = NULL;
+	char *import = NULL;
+	char *export = NULL;
+	img_tool = "imgtool";
+
+	while((ch = getopt(argc, argv, "f:i:e:")) != -1){
+		switch(ch){
+			case 'f':
+				image_file = optarg;
+				break;
+			case 'i':
+				import = optarg;
+				break;
+			case 'e':
+				export = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	if(!image_file || !import == !export || optind != argc){
+		usage();
+	}
+
+	img = open(image_file, import ? O_RDWR : O_RDONLY);
+	if(img < 0){
+		die("cannot open", image_file);
+	}
+	CRC_Init();
+	load_meta();
+
+	//The import frees the old blocks of the root directory, which snapshots may still hold
+	if(import && snaps){
+		for(int i = 0; i < UFS_MAX_SNAPSHOTS; i++){
+			if(snaps->ids[i]){
+				fprintf(stderr, "imgtool: delete the snapshots of %s before importing\n", image_file);
+				exit(1);
+			}
+		}
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	//Room for a whole file plus the padding of its last block
+	char *buf = malloc(FILE_MAX + bsize);
+	if(!buf){
+		die("cannot allocate", "buffer");
+	}
+
+	if(import){
+		out = malloc((size_t) IO_BLOCKS * bsize);
+		dir_t *root = calloc(1, sizeof(dir_t));
+		if(!out || !root){
+			die("cannot allocate", "buffer");
+		}
+
+		//New entries join those already in the root directory
+		int size = inodes[0].size < FILE_MAX ? inodes[0].size : FILE_MAX;
+		read_blocks(&inodes[0], size, (char*) root->ents);
+		for(int j = size / sizeof(dir_ent_t); j < DIR_ENTS; j++){
+			root->ents[j].inum = -1;
+		}
+		root->inum = 0;
+		root->n = size / sizeof(dir_ent_t);
+		import_dir(import, root, buf);
+		flush_out();
+
+		//Data first, then the metadata that points at it, so a failed import leaves the image as it was
+		if(fsync(img) != 0){
+			die("cannot sync", image_file);
+		}
+		for(int i = 0; i < nreplaced; i++){
+			set_bit(data_bitmap, replaced[i], 0);
+		}
+		for(int b = 0; csums && b < s->data_region_addr; b++){
+			if(b < s->csum_addr || b >= s->csum_addr + s->csum_len){
+				csums[b] = CRC_32C(0, &meta[(size_t) b * bsize], bsize);
+			}
+		}
+		img_io(1, meta, (long) s->data_region_addr * bsize, 0);
+		if(fsync(img) != 0){
+			die("cannot sync", image_file);
+		}
+	}else{
+		if(mkdir(export, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST){
+			die("cannot create", export);
+		}
+		export_dir(export, 0, buf);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s %ld files, %ld directories, %ld bytes in %.3f s (%.1f MB/s)\n", import ? "imported" : "exported",
+	       files, dirs, bytes, secs, secs > 0 ? bytes / secs / (1 << 20) : 0);
+	if(import){
+		printf("%ld data blocks written\n", blocks);
+	}
+	close(img);
+	return 0;
+}
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "io.h"
+
+//A write handed to the kernel, kept so short writes can be finished
+typedef struct {
+	int fd;
+	struct iovec one;    //Buffer of a plain IO_Write
+	struct iovec *iov;
+	int iovcnt;
+	int len;
+	off_t offset;
+	unsigned long tag;
+} io_slot_t;
+
+static int engine = IO_PWRITE;
+static IO_Done on_done;
+
+static int ring_fd = -1;
+static int event_fd = -1;
+static unsigned int depth;
+static io_slot_t *slots;
+static int *free_slots; //Stack of unused slot indexes
+static int nfree;
+static int queued;      //Prepared but not yet submitted
+static int inflight;    //Submitted but not yet completed
+
+//Submission queue ring
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static struct io_uring_sqe *sqes;
+//Completion queue ring
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/**
+ * Writes len bytes at offset, retrying short writes.
+ * Returns len on success or -errno
+ */
+static int write_all(int fd, char *buf, int len, off_t offset){
+	int done = 0;
+	while(done < len){
+		int rc = pwrite(fd, buf + done, len - done, offset + done);
+		if(rc < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -errno;
+		}
+		done += rc;
+	}
+	return len;
+}
+
+/**
+ * Finishes a gather write of which done bytes are already written.
+ * Returns the total length on success or -errno
+ */
+static int writev_rest(int fd, struct iovec *iov, int iovcnt, off_t offset, int done){
+	int pos = 0;
+	for(int i = 0; i < iovcnt; i++){
+		int n = iov[i].iov_len;
+		if(pos + n > done){
+			int skip = done > pos ? done - pos : 0;
+			int rc = write_all(fd, (char*)iov[i].iov_base + skip, n - skip, offset + pos + skip);
+			if(rc < 0){
+				return rc;
+			}
+		}
+		pos += n;
+	}
+	return pos;
+}
+
+/**
+ * Maps the rings of a new io_uring instance.
+ * Returns 0 on success, -1 if io_uring is not available
+ */
+static int uring_setup(unsigned int entries){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(ring_fd < 0){
+		return -1;
+	}
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size){
+		sq_size = cq_size;
+	}
+
+	char *sq = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if(sq == MAP_FAILED){
+		return -1;
+	}
+
+	char *cq = sq;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)){
+		cq = mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if(cq == MAP_FAILED){
+			return -1;
+		}
+	}
+
+	sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED){
+		return -1;
+	}
+
+	sq_head = (unsigned int*)(sq + p.sq_off.head);
+	sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned int*)(sq + p.sq_off.array);
+	cq_head = (unsigned int*)(cq + p.cq_off.head);
+	cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	//Lets the caller sleep in poll() on completions along with its sockets
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(event_fd < 0 || syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0){
+		return -1;
+	}
+
+	depth = p.sq_entries;
+	return 0;
+}
+
+/**
+ * Sets up the storage backend. One backend serves every open image, each write names its file.
+ * Returns the engine in use, IO_PWRITE if io_uring was asked for but is unavailable
+ * engine[in] - IO_PWRITE or IO_URING
+ * depth[in] - Max number of writes in flight
+ * done[in] - Called for every finished write
+ */
+int IO_Init(int eng, int max_inflight, IO_Done done){
+	on_done = done;
+	engine = IO_PWRITE;
+
+	if(eng == IO_URING){
+		if(uring_setup(max_inflight) == 0){
+			slots = calloc(depth, sizeof(io_slot_t));
+			free_slots = malloc(depth * sizeof(int));
+			for(nfree = 0; nfree < depth; nfree++){
+				free_slots[nfree] = depth - nfree - 1;
+			}
+			engine = IO_URING;
+		}else{
+			perror("io_uring");
+			if(ring_fd >= 0){
+				close(ring_fd);
+				ring_fd = -1;
+			}
+		}
+	}
+	return engine;
+}
+
+/**
+ * Queues a write of len bytes from buf to an image at offset. buf must stay
+ * untouched until the write is reported done. With IO_PWRITE the write
+ * happens, and is reported, before this returns.
+ * Returns 0 on success, -1 otherwise
+ * fd[in] - The image
+ * tag[in] - Passed back to the done callback
+ */
+int IO_Write(int fd, void *buf, int len, off_t offset, unsigned long tag){
+	struct iovec iov = { buf, len };
+	return IO_WriteV(fd, &iov, 1, offset, tag);
+}
+
+/**
+ * Queues a write gathered from iovcnt buffers to consecutive bytes of an
+ * image at offset. The buffers, but not the iov array, must stay untouched
+ * until the write is reported done.
+ * Returns 0 on success, -1 otherwise
+ * fd[in] - The image
+ * tag[in] - Passed back to the done callback
+ */
+int IO_WriteV(int fd, struct iovec *iov, int iovcnt, off_t offset, unsigned long tag){
+	if(engine == IO_PWRITE){
+		int rc;
+		while((rc = pwritev(fd, iov, iovcnt, offset)) < 0 && errno == EINTR);
+		on_done(tag, rc < 0 ? -errno : writev_rest(fd, iov, iovcnt, offset, rc));
+		return 0;
+	}
+
+	//Make room by waiting for earlier writes
+	while(nfree == 0){
+		IO_Submit();
+		if(IO_Reap(1) < 0){
+			return -1;
+		}
+	}
+
+	int slot = free_slots[--nfree];
+	io_slot_t *s = &slots[slot];
+	s->fd = fd;
+	if(iovcnt == 1){
+		s->one = iov[0];
+		s->iov = &s->one;
+	}else{
+		s->iov = malloc(iovcnt * sizeof(struct iovec));
+		memcpy(s->iov, iov, iovcnt * sizeof(struct iovec));
+	}
+	s->iovcnt = iovcnt;
+	s->len = 0;
+	for(int i = 0; i < iovcnt; i++){
+		s->len += iov[i].iov_len;
+	}
+	s->offset = offset;
+	s->tag = tag;
+
+	unsigned int tail = *sq_tail;
+	unsigned int idx = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) s->iov;
+	sqe->len = iovcnt;
+	sqe->off = offset;
+	sqe->user_data = slot;
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	queued++;
+	return 0;
+}
+
+/**
+ * Hands every queued write to the kernel in a single call
+ * Returns 0 on success, -1 otherwise
+ */
+int IO_Submit(){
+	while(queued > 0){
+		int rc = syscall(__NR_io_uring_enter, ring_fd, queued, 0, 0, NULL, 0);
+		if(rc < 0){
+			if(errno == EINTR || errno == EAGAIN){
+				continue;
+			}
+			return -1;
+		}
+		queued -= rc;
+		inflight += rc;
+	}
+	return 0;
+}
+
+/**
+ * Reports finished writes to the done callback.
+ * Returns the number of writes reported, -1 on error
+ * wait[in] - Block until at least one write finishes if none has
+ */
+int IO_Reap(int wait){
+	if(engine == IO_PWRITE){
+		return 0;
+	}
+
+	uint64_t events;
+	if(read(event_fd, &events, sizeof(events)) < 0 && errno != EAGAIN){
+		return -1;
+	}
+
+	int reaped = 0;
+	while(1){
+		unsigned int head = *cq_head;
+		unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+		if(head == tail){
+			if(!wait || reaped || inflight == 0){
+				break;
+			}
+			if(syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR){
+				return -1;
+			}
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		io_slot_t *s = &slots[cqe->user_data];
+		int res = cqe->res;
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+		//Finish short writes synchronously
+		if(res >= 0 && res < s->len){
+			res = writev_rest(s->fd, s->iov, s->iovcnt, s->offset, res);
+		}
+		if(s->iov != &s->one){
+			free(s->iov);
+		}
+
+		free_slots[nfree++] = s - slots;
+		inflight--;
+		reaped++;
+		on_done(s->tag, res);
+	}
+	return reaped;
+}
+
+/**
+ * Waits for every submitted write to finish
+ * Returns 0 on success, -1 otherwise
+ */
+int IO_Drain(){
+	if(IO_Submit() < 0){
+		return -1;
+	}
+	while(inflight > 0){
+		if(IO_Reap(1) < 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Returns an fd that polls readable when writes have finished, -1 with IO_PWRITE
+ */
+int IO_EventFd(){
+	return engine == IO_URING ? event_fd : -1;
+}
+
+/**
+ * Returns the number of writes queued or in flight
+ */
+int IO_Inflight(){
+	return queued + inflight;
+}
+
+/**
+ * Waits for all writes and releases the backend
+ */
+int IO_Close(){
+	int rc = 0;
+	if(engine == IO_URING){
+		rc = IO_Drain();
+		close(event_fd);
+		close(ring_fd);
+		free(slots);
+		free(free_slots);
+	}
+	engine = IO_PWRITE;
+	return rc;
+}
@@ -0,0 +1,24 @@
+#ifndef __IO_h__
+#define __IO_h__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define IO_PWRITE (0) // synchronous pwrite on the calling thread
+#define IO_URING  (1) // asynchronous writes submitted in batches through io_uring
+
+// called once per finished write with the tag it was queued with and
+// the number of bytes written, or -errno
+typedef void (*IO_Done)(unsigned long tag, int res);
+
+int IO_Init(int engine, int depth, IO_Done done);
+int IO_Write(int fd, void *buf, int len, off_t offset, unsigned long tag);
+int IO_WriteV(int fd, struct iovec *iov, int iovcnt, off_t offset, unsigned long tag);
+int IO_Submit();
+int IO_Reap(int wait);
+int IO_Drain();
+int IO_EventFd();
+int IO_Inflight();
+int IO_Close();
+
+#endif // __IO_h__
@@ -0,0 +1,297 @@
+#include <string.h>
+#include <sys/uio.h>
+#include "lz.h"
+#include "mfs.h"
+
+#define HASH_BITS    (12)
+#define MIN_MATCH    (4)
+#define MAX_OFFSET   (65535)
+#define SKIP_TRIGGER (5) //Every 32 misses in a row the search steps one byte further, so data that does not compress is skimmed
+
+static unsigned int hash4(const unsigned char *p){
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/*
+ * Writes a length that did not fit in its 4 bit field, 255 at a time
+ */
+static unsigned char *put_len(unsigned char *op, int len){
+	while(len >= 255){
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+/*
+ * Writes one sequence: a token, the literals and, unless mlen is 0, the match
+ * Returns the end of the output, NULL if it would pass oend
+ */
+static unsigned char *put_seq(unsigned char *op, unsigned char *oend, const unsigned char *lit, int nlit, int offset, int mlen){
+	if(op + 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > oend){
+		return NULL;
+	}
+	unsigned char *token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if(nlit >= 15){
+		op = put_len(op, nlit - 15);
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if(mlen){
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		mlen -= MIN_MATCH;
+		*token |= mlen < 15 ? mlen : 15;
+		if(mlen >= 15){
+			op = put_len(op, mlen - 15);
+		}
+	}
+	return op;
+}
+
+/*
+ * Compresses a buffer with a byte oriented LZ77 in the spirit of LZ4: runs of
+ * literals and back references into the last 64 KB, found through a hash of
+ * the next 4 bytes. The search speeds up while it keeps missing and gives up
+ * once the output grows past cap, so data that does not compress costs little.
+ * Returns the compressed length, -1 if it does not fit in cap
+ * in[in] - The data
+ * n[in] - Its length
+ * out[out] - Where the compressed data goes
+ * cap[in] - Room in out
+ */
+int LZ_Compress(char *in, int n, char *out, int cap){
+	const unsigned char *base = (unsigned char*) in;
+	const unsigned char *ip = base, *anchor = base, *end = base + n;
+	unsigned char *op = (unsigned char*) out, *oend = op + cap;
+	int table[1 << HASH_BITS];
+	int misses = 0;
+
+	memset(table, 0xff, sizeof(table));
+	while(ip + MIN_MATCH <= end){
+		unsigned int h = hash4(ip);
+		int ref = table[h];
+		table[h] = ip - base;
+		if(ref < 0 || ip - base - ref > MAX_OFFSET || memcmp(base + ref, ip, MIN_MATCH) != 0){
+			ip += 1 + (misses++ >> SKIP_TRIGGER);
+			continue;
+		}
+		misses = 0;
+
+		const unsigned char *match = base + ref;
+		int mlen = MIN_MATCH;
+		while(ip + mlen < end && match[mlen] == ip[mlen]){
+			mlen++;
+		}
+		op = put_seq(op, oend, anchor, ip - anchor, ip - match, mlen);
+		if(!op){
+			return -1;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+	return op ? op - (unsigned char*) out : -1;
+}
+
+/*
+ * Reads a length that did not fit in its 4 bit field
+ * Returns the rest of the length, -1 if the input ends first
+ */
+static int get_len(const unsigned char **ip, const unsigned char *end){
+	int len = 0;
+	while(*ip < end){
+		unsigned char b = *(*ip)++;
+		len += b;
+		if(b != 255){
+			return len;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Undoes LZ_Compress. The input is not trusted, nothing is read or written out of bounds.
+ * Returns the length of the data, -1 if the input is malformed or does not fit in cap
+ */
+int LZ_Decompress(char *in, int n, char *out, int cap){
+	const unsigned char *ip = (unsigned char*) in, *end = ip + n;
+	unsigned char *op = (unsigned char*) out, *oend = op + cap;
+
+	while(ip < end){
+		int token = *ip++;
+		int nlit = token >> 4;
+		if(nlit == 15){
+			int more = get_len(&ip, end);
+			if(more < 0){
+				return -1;
+			}
+			nlit += more;
+		}
+		if(nlit > end - ip || nlit > oend - op){
+			return -1;
+		}
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		//The last sequence has no match
+		if(ip == end){
+			break;
+		}
+		if(end - ip < 2){
+			return -1;
+		}
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		int mlen = token & 0x0f;
+		if(mlen == 15){
+			int more = get_len(&ip, end);
+			if(more < 0){
+				return -1;
+			}
+			mlen += more;
+		}
+		mlen += MIN_MATCH;
+		if(offset == 0 || offset > op - (unsigned char*) out || mlen > oend - op){
+			return -1;
+		}
+
+		//Byte by byte, a match may overlap what it copies
+		const unsigned char *match = op - offset;
+		for(int i = 0; i < mlen; i++){
+			op[i] = match[i];
+		}
+		op += mlen;
+	}
+	return op - (unsigned char*) out;
+}
+
+/*
+ * Returns how much of a request means anything, the rest of its buffer is never read
+ */
+int LZ_RequestLen(char *msg){
+	int op, nbytes;
+	memcpy(&op, &msg[0], sizeof(int));
+	memcpy(&nbytes, &msg[8], sizeof(int));
+
+	switch(op){
+		case OP_WRITE:
+		case OP_APPEND:
+			return nbytes > 0 && nbytes <= MFS_MAX_PAYLOAD ? 16 + nbytes : 16;
+		case OP_LOOKUP:
+		case OP_UNLINK:
+			return 8 + 28;
+		case OP_CREAT:
+			return 12 + 28;
+		default:
+			return 16;
+	}
+}
+
+/*
+ * Packs a message into a compressed frame: the part of it that means anything
+ * and the trailer at MFS_REQ_ID. What does not
+ * compress is stored, the frame still leaves out the rest of the buffer.
+ * Returns the length of the frame, -1 if len is out of range
+ * msg[in] - The whole message buffer
+ * len[in] - How much of it means anything, at most MFS_REQ_ID
+ * frame[out] - The frame
+ * cap[in] - Room in frame, LZ_HEADER + len is always enough
+ */
+int LZ_Pack(char *msg, int len, char *frame, int cap){
+	if(len < 0 || len > MFS_REQ_ID || cap < LZ_HEADER + len){
+		return -1;
+	}
+
+	int marker = LZ_MARKER;
+	int method = LZ_LZ;
+	memcpy(&frame[0], &marker, sizeof(int));
+	memcpy(&frame[4], &len, sizeof(int));
+	memcpy(&frame[12], &msg[MFS_REQ_ID], MFS_TRAILER);
+
+	//Only worth it if it comes out smaller
+	int n = LZ_Compress(msg, len, &frame[LZ_HEADER], len - 1);
+	if(n < 0){
+		method = LZ_STORED;
+		memcpy(&frame[LZ_HEADER], msg, len);
+		n = len;
+	}
+	memcpy(&frame[8], &method, sizeof(int));
+	return LZ_HEADER + n;
+}
+
+/*
+ * Unpacks a compressed frame into a whole message buffer. Whatever the frame
+ * left out reads as zeros.
+ * Returns 0 on success, -1 if the frame is malformed
+ * frame[in] - The frame as received
+ * n[in] - Its length
+ * msg[out] - The message, at least MFS_REQ_ID + MFS_TRAILER bytes
+ * cap[in] - Room in msg
+ */
+int LZ_Unpack(char *frame, int n, char *msg, int cap){
+	int marker, len, method;
+	if(n < LZ_HEADER || cap < MFS_REQ_ID + MFS_TRAILER){
+		return -1;
+	}
+	memcpy(&marker, &frame[0], sizeof(int));
+	memcpy(&len, &frame[4], sizeof(int));
+	memcpy(&method, &frame[8], sizeof(int));
+	if(marker != LZ_MARKER || len < 0 || len > MFS_REQ_ID){
+		return -1;
+	}
+
+	if(method == LZ_STORED){
+		if(n - LZ_HEADER != len){
+			return -1;
+		}
+		memcpy(msg, &frame[LZ_HEADER], len);
+	}else if(method != LZ_LZ || LZ_Decompress(&frame[LZ_HEADER], n - LZ_HEADER, msg, len) != len){
+		return -1;
+	}
+	memset(&msg[len], 0, MFS_REQ_ID - len);
+	memcpy(&msg[MFS_REQ_ID], &frame[12], MFS_TRAILER);
+	return 0;
+}
+
+/*
+ * Points iov at how a message goes out uncompressed: the part of it that
+ * means anything, then the trailer at MFS_REQ_ID
+ * len[in] - How much of it means anything, at most MFS_REQ_ID
+ */
+void LZ_Trim(char *msg, int len, struct iovec iov[2]){
+	iov[0].iov_base = msg;
+	iov[0].iov_len = len;
+	iov[1].iov_base = &msg[MFS_REQ_ID];
+	iov[1].iov_len = MFS_TRAILER;
+}
+
+/*
+ * Puts a message that came in trimmed back into its whole buffer: the
+ * MFS_TRAILER bytes it ended with move to MFS_REQ_ID and what the sender left out of
+ * the part the receiver reads is zeroed, never left from an earlier message.
+ * Returns 0 on success, -1 if the message is too short to be one
+ * msg[in,out] - The message as received, at least MFS_REQ_ID + MFS_TRAILER bytes
+ * n[in] - Its length
+ * want[in] - How much of the message the receiver reads, MFS_REQ_ID for all of it
+ */
+int LZ_Expand(char *msg, int n, int want){
+	if(n < (int) sizeof(int) + MFS_TRAILER || n > MFS_REQ_ID + MFS_TRAILER){
+		return -1;
+	}
+	memmove(&msg[MFS_REQ_ID], &msg[n - MFS_TRAILER], MFS_TRAILER);
+	if(want > MFS_REQ_ID){
+		want = MFS_REQ_ID;
+	}
+	if(want > n - MFS_TRAILER){
+		memset(&msg[n - MFS_TRAILER], 0, want - (n - MFS_TRAILER));
+	}
+	return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __LZ_h__
+#define __LZ_h__
+
+#include <sys/uio.h>
+#include "mfs.h"
+
+// a message sent as a compressed frame starts with this in place of the op
+// or reply code, followed by the frame header and the compressed message
+#define LZ_MARKER (0x5a4c4d46) // "FMLZ"
+#define LZ_HEADER (12 + MFS_TRAILER) // marker, message length, method, then the trailer at MFS_REQ_ID
+
+#define LZ_STORED (0) // the message is copied as it is, it did not compress
+#define LZ_LZ     (1)
+
+int LZ_Compress(char *in, int n, char *out, int cap);
+int LZ_Decompress(char *in, int n, char *out, int cap);
+int LZ_Pack(char *msg, int len, char *frame, int cap);
+int LZ_Unpack(char *frame, int n, char *msg, int cap);
+int LZ_RequestLen(char *msg);
+void LZ_Trim(char *msg, int len, struct iovec iov[2]);
+int LZ_Expand(char *msg, int n, int want);
+
+#endif // __LZ_h__
@@ -1,61 +1,667 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "mfs.h"
 #include "udp.h"
+#include "lz.h"
 
-//First 12 bytes -> Metadata
-//Remaining 4096 Bytes -> Disk block for read/write ops
-#define BUFFER_SIZE (5012)
+//First 16 bytes -> Metadata
+//Up to MFS_MAX_PAYLOAD Bytes -> File data for read/write ops, then the request id, snapshot id and flags
+#define BUFFER_SIZE (MFS_REQ_ID + MFS_TRAILER)
 
-int sd, op;
-struct sockaddr_in addrSnd, addrRcv;
-struct timeval timeout;
-fd_set rfds;
+#define TIMEOUT_MS (5000) //Resend a request after this long without a reply, see MFS_Client_Timeout
+#define WRITE_DELAY_MS (20) //Buffered writes go out after this long even if their block is not full
+#define RA_STREAMS (4) //Inodes one client reads ahead on at once
+#define RA_MIN (2)     //Blocks fetched ahead when a stream starts
+#define RA_MAX (8)     //Most blocks fetched ahead on one stream
+
+//A call waiting for its reply
+typedef struct __call_t {
+	unsigned int id;
+	char *msg;       //Where the reply goes
+	int done;
+	struct __call_t *next;
+} call_t;
+
+//A block fetched ahead of the reader
+typedef struct {
+	int block;    //Index of the block within the file, -1 if the slot is free
+	int len;      //Bytes asked for, short for the last block of the file
+	int pending;  //1 until the reply has been waited for
+	int used;     //1 once a read was served from it
+	call_t call;
+	char req[BUFFER_SIZE];
+	char msg[BUFFER_SIZE];
+} ra_block_t;
+
+//Read ahead state of one inode
+typedef struct {
+	int inum;           //-1 if the stream is free. Guarded by ra_lock, the rest by lock.
+	int readers;        //Threads in or waiting for the stream, it is not taken over while there are any. Guarded by ra_lock.
+	unsigned long used; //Last read, the stream read least recently is reused. Guarded by ra_lock.
+	pthread_mutex_t lock; //Held by a reader of the stream, also while it waits for replies
+	int filled;         //Inode the blocks below were fetched for, -1 if none
+	int next;           //Offset a sequential read starts at, -1 before the first read
+	int size;           //File size as last seen
+	int active;         //1 while reads are sequential and blocks are fetched ahead
+	int window;         //Blocks to fetch ahead, grows as they are used and shrinks as they are wasted
+	ra_block_t *blocks; //RA_MAX slots, allocated on first use
+} ra_stream_t;
+
+struct __MFS_Client {
+	int sd;
+	struct sockaddr_in server;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;  //Broadcast when a reply is handed over or the socket is free to read
+	int reading;          //1 while one of the callers is receiving for everyone
+	unsigned int next_id;
+	call_t *calls;        //Calls waiting for replies
+	int snap;             //Snapshot lookups, stats and reads look at, 0 for the live image
+	int flags;            //MFS_FLAGS of every request
+	int volume;           //Volume every request is for, see MFS_Client_Volume
+	int timeout_ms;       //Resend a request after this long without a reply
+
+	//Write buffer, see MFS_Client_Buffer. One run of contiguous bytes within one block.
+	pthread_mutex_t wb_lock;
+	pthread_cond_t wb_cond; //Wakes the timer when the buffer fills or buffering stops
+	pthread_t wb_timer;
+	int buffered;           //1 while writes are buffered
+	int wb_inum;            //-1 when the buffer is empty
+	int wb_offset;
+	int wb_len;
+	int wb_error;           //-1 if a buffered write failed and that was not reported yet
+	struct timespec wb_since; //When the first byte in the buffer was written
+	char wb_data[MFS_BLOCK_SIZE];
+
+	//Read ahead, see MFS_Client_Read. Stream locks are taken after wb_lock when both are held, since a flush
+	//forgets what was read ahead. ra_lock only picks streams, nothing else is taken while it is held.
+	pthread_mutex_t ra_lock;
+	ra_stream_t streams[RA_STREAMS];
+	unsigned long ra_clock;
+};
+
+MFS_Client *client; //Used by the calls that take no client
+
+/*
+ * Hands a reply to the call waiting for it. Late replies to resent requests have no call and are dropped.
+ * Called with the client lock held.
+ */
+static void deliver(MFS_Client *c, char *reply, int len){
+	unsigned int id;
+	memcpy(&id, &reply[MFS_REQ_ID], sizeof(id));
+	for(call_t *call = c->calls; call; call = call->next){
+		if(call->id == id && !call->done){
+			memcpy(call->msg, reply, len);
+			call->done = 1;
+			break;
+		}
+	}
+}
+
+/*
+ * Waits for the reply to a call until the deadline. Only one caller reads
+ * the socket at a time, it passes on the replies meant for the others.
+ * Returns 1 once the reply is in, 0 on timeout. Called with the client lock held.
+ */
+static int wait_reply(MFS_Client *c, call_t *call, struct timespec *deadline){
+	char frame[BUFFER_SIZE];
+	char reply[BUFFER_SIZE];
+	struct sockaddr_in from;
+
+	while(!call->done){
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+		if(ms <= 0){
+			return 0;
+		}
+
+		if(c->reading){
+			pthread_cond_timedwait(&c->cond, &c->lock, deadline);
+			continue;
+		}
+
+		c->reading = 1;
+		pthread_mutex_unlock(&c->lock);
+
+		struct timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(c->sd, &rfds);
+		int len = -1;
+		if(select(c->sd + 1, &rfds, 0, 0, &timeout) > 0){
+			len = UDP_Read(c->sd, &from, reply, BUFFER_SIZE);
+		}
+		if(len >= (int) sizeof(int) && *(int*) reply == LZ_MARKER){
+			memcpy(frame, reply, len);
+			len = LZ_Unpack(frame, len, reply, BUFFER_SIZE) == 0 ? BUFFER_SIZE : -1;
+		}else if(len >= 0){
+			len = LZ_Expand(reply, len, MFS_REQ_ID) == 0 ? BUFFER_SIZE : -1;
+		}
+
+		pthread_mutex_lock(&c->lock);
+		if(len >= MFS_REQ_ID + (int) sizeof(int)){
+			deliver(c, reply, len);
+		}
+		c->reading = 0;
+		pthread_cond_broadcast(&c->cond);
+	}
+	return 1;
+}
+
+/*
+ * Takes a call off the list of waiting calls, a reply that still comes is dropped.
+ * Called with the client lock held.
+ */
+static void call_drop(MFS_Client *c, call_t *call){
+	call_t **p = &c->calls;
+	while(*p != call){
+		p = &(*p)->next;
+	}
+	*p = call->next;
+}
+
+/*
+ * Sends a request, as a compressed frame if its flags ask for it, trimmed to what means anything otherwise
+ * Returns 0 on success, -1 otherwise
+ */
+static int send_req(MFS_Client *c, char *req){
+	if(*(int*) &req[MFS_FLAGS] & MFS_FLAG_LZ){
+		char frame[LZ_HEADER + BUFFER_SIZE];
+		int n = LZ_Pack(req, LZ_RequestLen(req), frame, sizeof(frame));
+		if(n > 0){
+			return UDP_Write(c->sd, &c->server, frame, n) < 0 ? -1 : 0;
+		}
+	}
+	struct iovec iov[2];
+	LZ_Trim(req, LZ_RequestLen(req), iov);
+	return UDP_WriteV(c->sd, &c->server, iov, 2) < 0 ? -1 : 0;
+}
+
+/*
+ * Stamps a request with a new id, the snapshot in use and the flags and sends it, without waiting for the reply.
+ * Every started call must end with call_finish or call_drop.
+ * Returns 0 on success, -1 if the request could not be sent
+ * req[in] - The request, kept for resending until the call finishes
+ * msg[out] - Where the reply goes
+ */
+static int call_start(MFS_Client *c, call_t *call, char *req, char *msg){
+	pthread_mutex_lock(&c->lock);
+	call->id = ++c->next_id;
+	call->msg = msg;
+	call->done = 0;
+	call->next = c->calls;
+	c->calls = call;
+	memcpy(&req[MFS_SNAP_ID], &c->snap, sizeof(int));
+	memcpy(&req[MFS_FLAGS], &c->flags, sizeof(int));
+	memcpy(&req[MFS_VOLUME], &c->volume, sizeof(int));
+	pthread_mutex_unlock(&c->lock);
+
+	memcpy(&req[MFS_REQ_ID], &call->id, sizeof(call->id));
+	return send_req(c, req);
+}
+
+/*
+ * Waits for the reply to a started call. The request is sent again when no
+ * reply comes in time, and after the wait a server that is too busy asks for.
+ * Returns 0 once the reply is in, -1 if a resend failed
+ */
+static int call_finish(MFS_Client *c, call_t *call, char *req){
+	int rc = 0;
+	pthread_mutex_lock(&c->lock);
+	while (1){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += c->timeout_ms / 1000;
+		deadline.tv_nsec += c->timeout_ms % 1000 * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		if(wait_reply(c, call, &deadline)){
+			int code, ms;
+			memcpy(&code, &call->msg[0], sizeof(int));
+			if(code != RES_BUSY){
+				break;
+			}
+			memcpy(&ms, &call->msg[4], sizeof(int));
+			call->done = 0;
+			pthread_mutex_unlock(&c->lock);
+			struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&c->lock);
+		}
+
+		if (send_req(c, req) < 0) {
+			rc = -1;
+			break;
+		}
+	}
+	call_drop(c, call);
+	pthread_mutex_unlock(&c->lock);
+	return rc;
+}
 
 /**
  * Sends a message to the server and waits for it to be read
  * The msg buffer will be updated to contain the server's response
+ * Any number of threads may post on one client at once, replies are matched to requests by id
  */
-int post(char *msg){
-	int rc;
-	while (1){
-		timeout.tv_sec = 5;
-		timeout.tv_usec = 0;
+static int post(MFS_Client *c, char *msg){
+	char req[BUFFER_SIZE];
+	call_t call;
 
-		rc = UDP_Write(sd, &addrSnd, msg, BUFFER_SIZE);
-		if (rc < 0) {
-			return -1;
+	memcpy(req, msg, LZ_RequestLen(msg));
+	if(call_start(c, &call, req, msg) < 0){
+		pthread_mutex_lock(&c->lock);
+		call_drop(c, &call);
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+	return call_finish(c, &call, req);
+}
+
+/*
+ * Stops fetching ahead on a stream, replies still on their way are dropped.
+ * A block fetched ahead and never used counts against the window.
+ * Called with the stream lock held.
+ */
+static void ra_stop(MFS_Client *c, ra_stream_t *s){
+	int wasted = 0;
+	for(int i = 0; s->blocks && i < RA_MAX; i++){
+		ra_block_t *b = &s->blocks[i];
+		if(b->block == -1){
+			continue;
+		}
+		if(b->pending){
+			pthread_mutex_lock(&c->lock);
+			call_drop(c, &b->call);
+			pthread_mutex_unlock(&c->lock);
+		}
+		wasted |= !b->used;
+		b->block = -1;
+	}
+	if(wasted && s->window > RA_MIN){
+		s->window /= 2;
+	}
+	s->active = 0;
+}
+
+/*
+ * Forgets what was fetched ahead of an inode once this client changed it
+ * inum[in] - The inode, -1 for every inode
+ */
+static void ra_forget(MFS_Client *c, int inum){
+	for(int i = 0; i < RA_STREAMS; i++){
+		ra_stream_t *s = &c->streams[i];
+		pthread_mutex_lock(&c->ra_lock);
+		int match = s->inum != -1 && (inum == -1 || s->inum == inum);
+		s->readers += match;
+		pthread_mutex_unlock(&c->ra_lock);
+		if(!match){
+			continue;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		if(s->filled != -1 && (inum == -1 || s->filled == inum)){
+			ra_stop(c, s);
+			s->filled = -1;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		pthread_mutex_lock(&c->ra_lock);
+		if(--s->readers == 0 && s->filled == -1){
+			s->inum = -1;
 		}
+		pthread_mutex_unlock(&c->ra_lock);
+	}
+}
 
-		rc = select(sd + 1, &rfds, 0, 0, &timeout);
-		if(rc > 0){
+/*
+ * Lets go of a stream taken with ra_stream
+ */
+static void ra_release(MFS_Client *c, ra_stream_t *s){
+	pthread_mutex_unlock(&s->lock);
+	pthread_mutex_lock(&c->ra_lock);
+	s->readers--;
+	pthread_mutex_unlock(&c->ra_lock);
+}
+
+/*
+ * Returns the stream of an inode with its lock held, taking over the least
+ * recently read one nobody is in if it has none. Readers of one inode wait
+ * for each other, those of others go on. Release it with ra_release.
+ * Returns NULL if every stream is in use for other inodes or there is no memory for the blocks.
+ */
+static ra_stream_t *ra_stream(MFS_Client *c, int inum){
+	ra_stream_t *s = NULL;
+	pthread_mutex_lock(&c->ra_lock);
+	for(int i = 0; i < RA_STREAMS; i++){
+		ra_stream_t *t = &c->streams[i];
+		if(t->inum == inum){
+			s = t;
 			break;
 		}
+		if(!t->readers && (!s || t->used < s->used)){
+			s = t;
+		}
+	}
+	if(s){
+		s->inum = inum;
+		s->readers++;
+		s->used = ++c->ra_clock;
+	}
+	pthread_mutex_unlock(&c->ra_lock);
+	if(!s){
+		return NULL;
 	}
 
-	rc = UDP_Read(sd, &addrRcv, msg, BUFFER_SIZE);
-	if(rc < 0){
-		return -1;
+	pthread_mutex_lock(&s->lock);
+	if(!s->blocks){
+		s->blocks = malloc(RA_MAX * sizeof(ra_block_t));
+		if(!s->blocks){
+			ra_release(c, s);
+			return NULL;
+		}
+		for(int i = 0; i < RA_MAX; i++){
+			s->blocks[i].block = -1;
+		}
+	}
+
+	//Taken over from another inode, or forgotten since the last read
+	if(s->filled != inum){
+		ra_stop(c, s);
+		s->filled = inum;
+		s->next = -1;
+		s->size = 0;
+		s->window = RA_MIN;
+	}
+	return s;
+}
+
+/*
+ * Returns the slot holding a block of the file, NULL if it was not fetched
+ */
+static ra_block_t *ra_find(ra_stream_t *s, int block){
+	for(int i = 0; i < RA_MAX; i++){
+		if(s->blocks[i].block == block){
+			return &s->blocks[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Drops the blocks behind the reader and sends reads for those up to the
+ * window ahead of it that are within the file. Called with the stream lock held.
+ */
+static void ra_fill(MFS_Client *c, ra_stream_t *s){
+	int first = s->next / MFS_BLOCK_SIZE;
+	for(int i = 0; i < RA_MAX; i++){
+		ra_block_t *b = &s->blocks[i];
+		if(b->block != -1 && b->block < first){
+			if(b->pending){
+				pthread_mutex_lock(&c->lock);
+				call_drop(c, &b->call);
+				pthread_mutex_unlock(&c->lock);
+			}
+			if(b->used && s->window < RA_MAX){
+				s->window++;
+			}
+			b->block = -1;
+		}
+	}
+
+	for(int block = first; block < first + s->window && block * MFS_BLOCK_SIZE < s->size; block++){
+		if(ra_find(s, block)){
+			continue;
+		}
+		ra_block_t *b = ra_find(s, -1);
+		if(!b){
+			break;
+		}
+
+		int op = OP_READ;
+		int offset = block * MFS_BLOCK_SIZE;
+		b->len = s->size - offset < MFS_BLOCK_SIZE ? s->size - offset : MFS_BLOCK_SIZE;
+		memcpy(&b->req[0], &op, sizeof(int));
+		memcpy(&b->req[4], &s->inum, sizeof(int));
+		memcpy(&b->req[8], &b->len, sizeof(int));
+		memcpy(&b->req[12], &offset, sizeof(int));
+
+		b->block = block;
+		b->used = 0;
+		b->pending = 1;
+		if(call_start(c, &b->call, b->req, b->msg) < 0){
+			pthread_mutex_lock(&c->lock);
+			call_drop(c, &b->call);
+			pthread_mutex_unlock(&c->lock);
+			b->block = -1;
+			break;
+		}
+	}
+}
+
+/*
+ * Serves a read from the blocks fetched ahead, waiting for those still on their way.
+ * Returns 0 if the whole range was served, -1 otherwise. Called with the stream lock held.
+ */
+static int ra_copy(MFS_Client *c, ra_stream_t *s, char *buffer, int offset, int nbytes){
+	for(int done = 0; done < nbytes;){
+		int off = (offset + done) % MFS_BLOCK_SIZE;
+		int len = MFS_BLOCK_SIZE - off < nbytes - done ? MFS_BLOCK_SIZE - off : nbytes - done;
+
+		ra_block_t *b = ra_find(s, (offset + done) / MFS_BLOCK_SIZE);
+		if(!b){
+			return -1;
+		}
+		if(b->pending){
+			b->pending = 0;
+			if(call_finish(c, &b->call, b->req) < 0 || *(int*) b->msg != 0){
+				b->block = -1;
+				return -1;
+			}
+		}
+		if(off + len > b->len){
+			return -1;
+		}
+
+		memcpy(&buffer[done], &b->msg[4 + off], len);
+		b->used = 1;
+		done += len;
 	}
-	
 	return 0;
 }
 
 /*
- * Connects the client to the server.
- * Returns 0 on success, -1 otherwise
+ * Connects a new client to the server. Every client has its own socket on
+ * an ephemeral port, so any number of them can run on one host.
+ * Returns the client, NULL on failure
  * hostname[in] - The address of the server
  * port[in] - The port the server is listening on
  */
-int MFS_Init(char *hostname, int port){
-	sd = UDP_Open(20000);
-	if(sd < 0){
-		return sd;
+MFS_Client *MFS_Client_Init(char *hostname, int port){
+	MFS_Client *c = calloc(1, sizeof(MFS_Client));
+	if(!c){
+		return NULL;
+	}
+
+	c->sd = UDP_Open(0);
+	if(c->sd < 0 || UDP_FillSockAddr(&c->server, hostname, port) < 0){
+		if(c->sd >= 0){
+			UDP_Close(c->sd);
+		}
+		free(c);
+		return NULL;
 	}
-	FD_SET(sd, &rfds);
 
-    return UDP_FillSockAddr(&addrSnd, hostname, port);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_mutex_init(&c->wb_lock, NULL);
+	pthread_cond_init(&c->wb_cond, NULL);
+	c->wb_inum = -1;
+	c->timeout_ms = TIMEOUT_MS;
+	pthread_mutex_init(&c->ra_lock, NULL);
+
+	//The server answers resends by request id and address, so a later client on the same port must not reuse the ids
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	c->next_id = (unsigned int) (now.tv_nsec ^ now.tv_sec * 2654435761u ^ (unsigned int) getpid() << 16);
+	for(int i = 0; i < RA_STREAMS; i++){
+		c->streams[i].inum = -1;
+		c->streams[i].filled = -1;
+		pthread_mutex_init(&c->streams[i].lock, NULL);
+	}
+
+	//Room for the replies to every block fetched ahead, best effort
+	int rcvbuf = 2 * RA_STREAMS * RA_MAX * BUFFER_SIZE;
+	setsockopt(c->sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	return c;
+}
+
+/*
+ * Releases a client, after sending any buffered writes. No calls may be in progress on it.
+ */
+void MFS_Client_Close(MFS_Client *c){
+	MFS_Client_Buffer(c, 0);
+	ra_forget(c, -1);
+	for(int i = 0; i < RA_STREAMS; i++){
+		free(c->streams[i].blocks);
+		pthread_mutex_destroy(&c->streams[i].lock);
+	}
+	pthread_mutex_destroy(&c->ra_lock);
+	pthread_mutex_destroy(&c->wb_lock);
+	pthread_cond_destroy(&c->wb_cond);
+	UDP_Close(c->sd);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	free(c);
+}
+
+/*
+ * Sends a write to the server as it is
+ */
+static int write_now(MFS_Client *c, int inum, char *buffer, int offset, int nbytes){
+	int op = OP_WRITE;
+	char msg[BUFFER_SIZE];
+
+	memcpy(&msg[0], &op, sizeof(int));
+	memcpy(&msg[4], &inum, sizeof(int));
+	memcpy(&msg[8], &nbytes, sizeof(int));
+	memcpy(&msg[12], &offset, sizeof(int));
+	memcpy(&msg[16], buffer, nbytes);
+
+	ra_forget(c, inum);
+	post(c, msg);
+	return *(int*) &msg[0];
+}
+
+/*
+ * Sends the buffered run, if any. A failure is kept in wb_error for the next write or sync to report.
+ * Called with wb_lock held.
+ */
+static void wb_flush(MFS_Client *c){
+	if(c->wb_inum == -1){
+		return;
+	}
+	if(write_now(c, c->wb_inum, c->wb_data, c->wb_offset, c->wb_len) != 0){
+		c->wb_error = -1;
+	}
+	c->wb_inum = -1;
+}
+
+/*
+ * Sends the buffered run if it belongs to inum, before a call that must see it
+ */
+static void wb_sync_inode(MFS_Client *c, int inum){
+	pthread_mutex_lock(&c->wb_lock);
+	if(c->wb_inum == inum){
+		wb_flush(c);
+	}
+	pthread_mutex_unlock(&c->wb_lock);
+}
+
+/*
+ * Sends whatever is buffered, before a call that may change any file
+ */
+static void wb_sync_all(MFS_Client *c){
+	pthread_mutex_lock(&c->wb_lock);
+	wb_flush(c);
+	pthread_mutex_unlock(&c->wb_lock);
+}
+
+/*
+ * Sends a buffered run that has waited WRITE_DELAY_MS, so a block that never fills still goes out
+ */
+static void *wb_timer(void *arg){
+	MFS_Client *c = arg;
+	pthread_mutex_lock(&c->wb_lock);
+	while(c->buffered){
+		if(c->wb_inum == -1){
+			pthread_cond_wait(&c->wb_cond, &c->wb_lock);
+			continue;
+		}
+
+		struct timespec due = c->wb_since;
+		due.tv_nsec += WRITE_DELAY_MS * 1000000L;
+		due.tv_sec += due.tv_nsec / 1000000000L;
+		due.tv_nsec %= 1000000000L;
+		//The run may have been sent and a new one begun while waiting, so look again
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if(now.tv_sec > due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec)){
+			wb_flush(c);
+		}else{
+			pthread_cond_timedwait(&c->wb_cond, &c->wb_lock, &due);
+		}
+	}
+	pthread_mutex_unlock(&c->wb_lock);
+	return NULL;
+}
+
+/*
+ * Turns the write buffer of a client on or off. While on, small writes that
+ * continue each other on one inode are gathered and sent a block at a time:
+ * when the run reaches the end of a block, when a write does not continue it,
+ * when the inode is read, stated or fallocated, before creat, unlink and
+ * shutdown, on MFS_Client_Sync and WRITE_DELAY_MS after the run began.
+ * A buffered write returns 0 before the server has seen it, if it later fails
+ * the next write or sync on the client returns -1.
+ * Returns 0, or -1 if turning the buffer off found a failed write
+ * on[in] - 1 to buffer writes, 0 to send them as they are made
+ */
+int MFS_Client_Buffer(MFS_Client *c, int on){
+	pthread_mutex_lock(&c->wb_lock);
+	if(on && !c->buffered){
+		c->buffered = 1;
+		pthread_create(&c->wb_timer, NULL, wb_timer, c);
+	}else if(!on && c->buffered){
+		wb_flush(c);
+		c->buffered = 0;
+		pthread_cond_broadcast(&c->wb_cond);
+		pthread_mutex_unlock(&c->wb_lock);
+		pthread_join(c->wb_timer, NULL);
+		pthread_mutex_lock(&c->wb_lock);
+	}
+	int rc = c->wb_error;
+	c->wb_error = 0;
+	pthread_mutex_unlock(&c->wb_lock);
+	return rc;
+}
+
+/*
+ * Sends any buffered writes and waits for the server to take them
+ * Returns 0 on success, -1 if a buffered write failed
+ */
+int MFS_Client_Sync(MFS_Client *c){
+	pthread_mutex_lock(&c->wb_lock);
+	wb_flush(c);
+	int rc = c->wb_error;
+	c->wb_error = 0;
+	pthread_mutex_unlock(&c->wb_lock);
+	return rc;
 }
 
 /*
@@ -64,8 +670,8 @@ int MFS_Init(char *hostname, int port){
  * pinum[in] - The parent directory inode number
  * name[in] - The file name
  */
-int MFS_Lookup(int pinum, char *name){
-	op = OP_LOOKUP;
+int MFS_Client_Lookup(MFS_Client *c, int pinum, char *name){
+	int op = OP_LOOKUP;
 	char msg[BUFFER_SIZE];
 
 	if(strlen(name) > 28){
@@ -75,27 +681,38 @@ int MFS_Lookup(int pinum, char *name){
 	memcpy(&msg[0], &op, sizeof(int));
 	memcpy(&msg[4], &pinum, sizeof(int));
 	memcpy(&msg[8], name, 28);
-	
-	post(msg);
-	return (int) msg[0];
+
+	post(c, msg);
+	return *(int*) &msg[0];
 }
 
 /*
- * Gets stats for the a file
- * Returns 0 on success, -1 otherwise
- * inum[in] - The inode number of the file to stat
- * m[out] - A MFS_Stat_t struct
+ * Sends a stat to the server as it is
  */
-int MFS_Stat(int inum, MFS_Stat_t *m){
-	op = OP_STAT;
+static int stat_now(MFS_Client *c, int inum, MFS_Stat_t *m){
+	int op = OP_STAT;
 	char msg[BUFFER_SIZE];
+
 	memcpy(&msg[0], &op, sizeof(int));
 	memcpy(&msg[4], &inum, sizeof(int));
-	
-	post(msg);
-	m->type = (int) msg[4];
+
+	post(c, msg);
+	m->type = *(int*) &msg[4];
 	m->size = *(int*) &msg[8];
-	return (int) msg[0];
+	m->blksize = *(int*) &msg[12];
+	m->extents = *(int*) &msg[16];
+	return *(int*) &msg[0];
+}
+
+/*
+ * Gets stats for the a file
+ * Returns 0 on success, -1 otherwise
+ * inum[in] - The inode number of the file to stat
+ * m[out] - A MFS_Stat_t struct
+ */
+int MFS_Client_Stat(MFS_Client *c, int inum, MFS_Stat_t *m){
+	wb_sync_inode(c, inum);
+	return stat_now(c, inum, m);
 }
 
 /*
@@ -106,44 +723,126 @@ int MFS_Stat(int inum, MFS_Stat_t *m){
  * offset[in] - Start at offset byte of the buffer
  * nbytes[in] - Number of bytes to write starting at offset
  */
-int MFS_Write(int inum, char *buffer, int offset, int nbytes){
-	op = OP_WRITE;
-	char msg[BUFFER_SIZE];
-
-	if(nbytes > 4096){
+int MFS_Client_Write(MFS_Client *c, int inum, char *buffer, int offset, int nbytes){
+	if(nbytes > MFS_MAX_PAYLOAD){
 		return -1;
 	}
 
+	pthread_mutex_lock(&c->wb_lock);
+	if(!c->buffered || offset < 0 || nbytes <= 0 || nbytes > MFS_BLOCK_SIZE){
+		//Keep writes in order with what is buffered
+		wb_flush(c);
+		pthread_mutex_unlock(&c->wb_lock);
+		return write_now(c, inum, buffer, offset, nbytes);
+	}
+
+	//A write that does not continue the buffered run sends it first
+	if(c->wb_inum != -1 && (c->wb_inum != inum || c->wb_offset + c->wb_len != offset)){
+		wb_flush(c);
+	}
+
+	for(int done = 0; done < nbytes;){
+		if(c->wb_inum == -1){
+			c->wb_inum = inum;
+			c->wb_offset = offset + done;
+			c->wb_len = 0;
+			clock_gettime(CLOCK_REALTIME, &c->wb_since);
+			pthread_cond_broadcast(&c->wb_cond);
+		}
+
+		//Fill up to the end of the block the run is in
+		int end = c->wb_offset + c->wb_len;
+		int room = MFS_BLOCK_SIZE - end % MFS_BLOCK_SIZE;
+		int n = room < nbytes - done ? room : nbytes - done;
+		memcpy(&c->wb_data[c->wb_len], &buffer[done], n);
+		c->wb_len += n;
+		done += n;
+
+		if((c->wb_offset + c->wb_len) % MFS_BLOCK_SIZE == 0){
+			wb_flush(c);
+		}
+	}
+
+	int rc = c->wb_error;
+	c->wb_error = 0;
+	pthread_mutex_unlock(&c->wb_lock);
+	return rc;
+}
+
+/*
+ * Sends a read to the server as it is
+ */
+static int read_now(MFS_Client *c, int inum, char *buffer, int offset, int nbytes){
+	int op = OP_READ;
+	char msg[BUFFER_SIZE];
+
 	memcpy(&msg[0], &op, sizeof(int));
 	memcpy(&msg[4], &inum, sizeof(int));
 	memcpy(&msg[8], &nbytes, sizeof(int));
 	memcpy(&msg[12], &offset, sizeof(int));
-	memcpy(&msg[16], buffer, nbytes); 
-	
-	post(msg);
-	return (int) msg[0];
+
+	post(c, msg);
+	memcpy(buffer, &msg[4], nbytes);
+	return *(int*) &msg[0];
 }
 
 /*
  * Reads a file to a buffer
+ * Once an inode is read sequentially the following blocks are fetched ahead,
+ * up to a window that grows while they are used and shrinks when the reader
+ * jumps away from them. Writes through this client drop what was fetched,
+ * writes by other clients may not be seen until the reader jumps. Threads
+ * reading different inodes on one client don't wait for each other.
  * Returns 0 on success, -1 otherwise
  * inum[in] - The inode to write to
  * buffer[out] - The buffer where data will be written to
  * offset[in] - The offset byte to start reading the file at
  * nbytes[in] - The number of bytes to read
  */
-int MFS_Read(int inum, char *buffer, int offset, int nbytes){
-	op = OP_READ;
-	char msg[BUFFER_SIZE];
+int MFS_Client_Read(MFS_Client *c, int inum, char *buffer, int offset, int nbytes){
+	if(nbytes > MFS_MAX_PAYLOAD){
+		return -1;
+	}
+	wb_sync_inode(c, inum);
+	if(offset < 0 || nbytes <= 0 || nbytes > MFS_BLOCK_SIZE){
+		return read_now(c, inum, buffer, offset, nbytes);
+	}
 
-	memcpy(&msg[0], &op, sizeof(int));
-	memcpy(&msg[4], &inum, sizeof(int));
-	memcpy(&msg[8], &nbytes, sizeof(int));
-	memcpy(&msg[12], &offset, sizeof(int)); 
+	ra_stream_t *s = ra_stream(c, inum);
+	if(!s){
+		return read_now(c, inum, buffer, offset, nbytes);
+	}
 
-	post(msg);
-	memcpy(buffer, &msg[4], nbytes);
-	return (int) msg[0];
+	if(offset != s->next){
+		//Blocks fetched ahead of a reader that jumped elsewhere are wasted
+		ra_stop(c, s);
+	}else if(!s->active){
+		//The second read in a row turns the stream on, it needs the size to stay within the file
+		MFS_Stat_t m;
+		if(stat_now(c, inum, &m) == 0){
+			s->size = m.size;
+			s->active = 1;
+		}
+	}
+
+	int rc = -1;
+	if(s->active){
+		ra_fill(c, s);
+		rc = ra_copy(c, s, buffer, offset, nbytes);
+	}
+	if(rc != 0){
+		rc = read_now(c, inum, buffer, offset, nbytes);
+	}
+
+	if(rc == 0){
+		s->next = offset + nbytes;
+		s->size = s->next > s->size ? s->next : s->size;
+		if(s->active){
+			ra_fill(c, s);
+		}
+	}
+	ra_release(c, s);
+	return rc;
 }
 
 /*
@@ -153,21 +852,22 @@ int MFS_Read(int inum, char *buffer, int offset, int nbytes){
  * type[in] - Either MFS_DIRECTORY or MFS_REGULAR_FILE
  * name[in] - The name of the file
  */
-int MFS_Creat(int pinum, int type, char *name){
-	op = OP_CREAT;
+int MFS_Client_Creat(MFS_Client *c, int pinum, int type, char *name){
+	int op = OP_CREAT;
 	char msg[BUFFER_SIZE];
 
 	if(strlen(name) > 28){
 		return -1;
 	}
+	wb_sync_all(c);
 
 	memcpy(&msg[0], &op, sizeof(int));
 	memcpy(&msg[4], &pinum, sizeof(int));
 	memcpy(&msg[8], &type, sizeof(int));
-	memcpy(&msg[12], name, 28); 
+	memcpy(&msg[12], name, 28);
 
-	post(msg);
-	return (int) msg[0];
+	post(c, msg);
+	return *(int*) &msg[0];
 }
 
 /*
@@ -176,33 +876,268 @@ int MFS_Creat(int pinum, int type, char *name){
  * pinum[in] - The parent directory inode
  * name[in] - The name of the file to remove
  */
-int MFS_Unlink(int pinum, char *name){
-	op = OP_UNLINK;
+int MFS_Client_Unlink(MFS_Client *c, int pinum, char *name){
+	int op = OP_UNLINK;
 	char msg[BUFFER_SIZE];
 
 	if(strlen(name) > 28){
 		return -1;
 	}
+	wb_sync_all(c);
+	ra_forget(c, -1);
 
 	memcpy(&msg[0], &op, sizeof(int));
 	memcpy(&msg[4], &pinum, sizeof(int));
-	memcpy(&msg[8], name, 28); 
+	memcpy(&msg[8], name, 28);
+
+	post(c, msg);
+	return *(int*) &msg[0];
+}
+
+/*
+ * Reserves disk blocks for a range of a file, preferring one contiguous run.
+ * The range reads as zeros until written and the file grows to cover it.
+ * Returns 0 on success, -1 otherwise
+ * inum[in] - The inode of the file
+ * offset[in] - The first byte of the range
+ * nbytes[in] - The length of the range
+ */
+int MFS_Client_Fallocate(MFS_Client *c, int inum, int offset, int nbytes){
+	int op = OP_FALLOCATE;
+	char msg[BUFFER_SIZE];
+	wb_sync_inode(c, inum);
+	ra_forget(c, inum);
+
+	memcpy(&msg[0], &op, sizeof(int));
+	memcpy(&msg[4], &inum, sizeof(int));
+	memcpy(&msg[8], &nbytes, sizeof(int));
+	memcpy(&msg[12], &offset, sizeof(int));
+
+	post(c, msg);
+	return *(int*) &msg[0];
+}
+
+/*
+ * Writes a buffer at the end of a file in one step, so appends from any
+ * number of clients land one after another without overwriting each other.
+ * Returns the offset the buffer was written at, -1 on failure
+ * inum[in] - The inode to append to
+ * buffer[in] - The buffer to be written
+ * nbytes[in] - Number of bytes to write
+ */
+int MFS_Client_Append(MFS_Client *c, int inum, char *buffer, int nbytes){
+	int op = OP_APPEND;
+	char msg[BUFFER_SIZE];
+
+	if(nbytes > MFS_MAX_PAYLOAD){
+		return -1;
+	}
+	wb_sync_inode(c, inum);
+	ra_forget(c, inum);
+
+	memcpy(&msg[0], &op, sizeof(int));
+	memcpy(&msg[4], &inum, sizeof(int));
+	memcpy(&msg[8], &nbytes, sizeof(int));
+	memcpy(&msg[16], buffer, nbytes);
+
+	if(post(c, msg) < 0){
+		return -1;
+	}
+	return *(int*) &msg[0];
+}
+
+/*
+ * Takes a snapshot of the whole image, including writes buffered by this client.
+ * It costs about the same however large the image is, blocks are only copied
+ * once the live image changes them.
+ * Returns the id of the snapshot, -1 on failure
+ */
+int MFS_Client_Snapshot(MFS_Client *c){
+	int op = OP_SNAPSHOT;
+	char msg[BUFFER_SIZE];
+	wb_sync_all(c);
+
+	memcpy(&msg[0], &op, sizeof(int));
+
+	if(post(c, msg) < 0){
+		return -1;
+	}
+	return *(int*) &msg[0];
+}
+
+/*
+ * Deletes a snapshot, the blocks only it still held are freed
+ * Returns 0 on success, -1 otherwise
+ * id[in] - The snapshot id
+ */
+int MFS_Client_DeleteSnapshot(MFS_Client *c, int id){
+	int op = OP_SNAPDEL;
+	char msg[BUFFER_SIZE];
+
+	memcpy(&msg[0], &op, sizeof(int));
+	memcpy(&msg[4], &id, sizeof(int));
+
+	post(c, msg);
+	return *(int*) &msg[0];
+}
+
+/*
+ * Makes lookups, stats and reads on the client look at a snapshot. Writes
+ * and every other call still go to the live image. Must be called while no
+ * other call is in progress on the client.
+ * Returns 0
+ * id[in] - The snapshot id, 0 to go back to the live image
+ */
+int MFS_Client_UseSnapshot(MFS_Client *c, int id){
+	ra_forget(c, -1);
+	pthread_mutex_lock(&c->lock);
+	c->snap = id;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
 
-	post(msg);
-	return (int) msg[0];
+/*
+ * Sends every later call to another volume of a server hosting several
+ * images. Buffered writes go out to the old volume first. Must be called
+ * while no other call is in progress on the client.
+ * Returns 0
+ * volume[in] - Index of the image on the server command line, 0 for the first
+ */
+int MFS_Client_Volume(MFS_Client *c, int volume){
+	wb_sync_all(c);
+	ra_forget(c, -1);
+	pthread_mutex_lock(&c->lock);
+	c->volume = volume;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+/*
+ * Compresses requests and replies on the client. Payloads that do not
+ * compress are sent as they are, and either way only the part of a message
+ * that means anything goes out, so the datagrams get smaller.
+ * Returns 0
+ * on[in] - 1 to compress, 0 to send whole messages
+ */
+int MFS_Client_Compress(MFS_Client *c, int on){
+	pthread_mutex_lock(&c->lock);
+	c->flags = on ? c->flags | MFS_FLAG_LZ : c->flags & ~MFS_FLAG_LZ;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+/*
+ * Sets how long a call waits for its reply before the request is sent again.
+ * Short timeouts recover from lost datagrams sooner, see UDP_Faults, but
+ * resend requests a busy server is still working on.
+ * Returns 0, -1 if ms is not positive
+ * ms[in] - The timeout, 5000 unless changed
+ */
+int MFS_Client_Timeout(MFS_Client *c, int ms){
+	if(ms <= 0){
+		return -1;
+	}
+	pthread_mutex_lock(&c->lock);
+	c->timeout_ms = ms;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
 }
 
 /*
  * Forces all server data to disk and terminates the server.
  * Useful for testing purposes.
  */
-int MFS_Shutdown(){
-	op = OP_TERM;
+int MFS_Client_Shutdown(MFS_Client *c){
+	int op = OP_TERM;
 	char msg[BUFFER_SIZE];
+	wb_sync_all(c);
 
 	memcpy(&msg[0], &op, sizeof(int));
-	
-	post(msg);
+
+	post(c, msg);
 	return 0;
 }
 
+//The original single client API, kept as a thin layer over one shared client
+
+/*
+ * Connects the client to the server.
+ * Returns 0 on success, -1 otherwise
+ * hostname[in] - The address of the server
+ * port[in] - The port the server is listening on
+ */
+int MFS_Init(char *hostname, int port){
+	if(client){
+		MFS_Client_Close(client);
+	}
+	client = MFS_Client_Init(hostname, port);
+	return client ? 0 : -1;
+}
+
+int MFS_Lookup(int pinum, char *name){
+	return MFS_Client_Lookup(client, pinum, name);
+}
+
+int MFS_Stat(int inum, MFS_Stat_t *m){
+	return MFS_Client_Stat(client, inum, m);
+}
+
+int MFS_Write(int inum, char *buffer, int offset, int nbytes){
+	return MFS_Client_Write(client, inum, buffer, offset, nbytes);
+}
+
+int MFS_Read(int inum, char *buffer, int offset, int nbytes){
+	return MFS_Client_Read(client, inum, buffer, offset, nbytes);
+}
+
+int MFS_Creat(int pinum, int type, char *name){
+	return MFS_Client_Creat(client, pinum, type, name);
+}
+
+int MFS_Unlink(int pinum, char *name){
+	return MFS_Client_Unlink(client, pinum, name);
+}
+
+int MFS_Fallocate(int inum, int offset, int nbytes){
+	return MFS_Client_Fallocate(client, inum, offset, nbytes);
+}
+
+int MFS_Append(int inum, char *buffer, int nbytes){
+	return MFS_Client_Append(client, inum, buffer, nbytes);
+}
+
+int MFS_Shutdown(){
+	return MFS_Client_Shutdown(client);
+}
+
+int MFS_Buffer(int on){
+	return MFS_Client_Buffer(client, on);
+}
+
+int MFS_Sync(){
+	return MFS_Client_Sync(client);
+}
+
+int MFS_Snapshot(){
+	return MFS_Client_Snapshot(client);
+}
+
+int MFS_DeleteSnapshot(int id){
+	return MFS_Client_DeleteSnapshot(client, id);
+}
+
+int MFS_UseSnapshot(int id){
+	return MFS_Client_UseSnapshot(client, id);
+}
+
+int MFS_Compress(int on){
+	return MFS_Client_Compress(client, on);
+}
+
+int MFS_Volume(int volume){
+	return MFS_Client_Volume(client, volume);
+}
+
+int MFS_Timeout(int ms){
+	return MFS_Client_Timeout(client, ms);
+}
@@ -4,7 +4,8 @@
 #define MFS_DIRECTORY    (0)
 #define MFS_REGULAR_FILE (1)
 
-#define MFS_BLOCK_SIZE   (4096) 
+#define MFS_BLOCK_SIZE   (4096)  // block size of images made without mkfs -b, the client library reads ahead and buffers writes in these
+#define MFS_MAX_PAYLOAD  (32768) // most bytes one read or write request moves, the block size of the image is the limit below it
 
 #define OP_LOOKUP 0
 #define OP_STAT   1
@@ -13,12 +14,37 @@
 #define OP_CREAT  4
 #define OP_UNLINK 5
 #define OP_TERM   6
+#define OP_FALLOCATE 7
+#define OP_APPEND 8 // write at the end of file, replies with the offset used
+#define OP_SNAPSHOT 9 // snapshot the image, replies with the snapshot id
+#define OP_SNAPDEL 10 // delete a snapshot
 
 #define RES_FAIL -1
+#define RES_BUSY -2 // server overloaded, resend after the number of ms in the next int
+#define RES_CORRUPT -3 // a block the request needed failed its checksum, nothing of it is returned
+
+// byte offset of the request id, just past the largest write payload.
+// the server leaves it alone, so every reply carries the id of its request.
+// On the wire a message is only the part of it that means anything followed
+// by the MFS_TRAILER bytes at MFS_REQ_ID, the receiver puts them back (see LZ_Expand)
+#define MFS_REQ_ID (16 + MFS_MAX_PAYLOAD)
+#define MFS_TRAILER (16) // request id, snapshot id, flags and volume id
+
+// byte offset of the snapshot id lookups, stats and reads look at, 0 for the live image
+#define MFS_SNAP_ID (MFS_REQ_ID + 4)
+
+// byte offset of the request flags
+#define MFS_FLAGS (MFS_REQ_ID + 8)
+#define MFS_FLAG_LZ (0x1) // the client sends and takes compressed frames, see lz.h
+
+// byte offset of the volume id, which of the images a server hosts the request is for
+#define MFS_VOLUME (MFS_REQ_ID + 12)
 
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
     int size;   // bytes
+    int blksize; // block size of the image, the most one read or write of it moves
+    int extents; // runs of adjacent blocks the file is stored in, 1 once contiguous, 0 if it has none
     // note: no permissions, access times, etc.
 } MFS_Stat_t;
 
@@ -28,6 +54,30 @@ typedef struct __MFS_DirEnt_t {
 } MFS_DirEnt_t;
 
 
+// a connection to a server, calls on one client may be made from any number of threads
+typedef struct __MFS_Client MFS_Client;
+
+MFS_Client *MFS_Client_Init(char *hostname, int port);
+void MFS_Client_Close(MFS_Client *c);
+int MFS_Client_Lookup(MFS_Client *c, int pinum, char *name);
+int MFS_Client_Stat(MFS_Client *c, int inum, MFS_Stat_t *m);
+int MFS_Client_Write(MFS_Client *c, int inum, char *buffer, int offset, int nbytes);
+int MFS_Client_Read(MFS_Client *c, int inum, char *buffer, int offset, int nbytes);
+int MFS_Client_Creat(MFS_Client *c, int pinum, int type, char *name);
+int MFS_Client_Unlink(MFS_Client *c, int pinum, char *name);
+int MFS_Client_Fallocate(MFS_Client *c, int inum, int offset, int nbytes);
+int MFS_Client_Append(MFS_Client *c, int inum, char *buffer, int nbytes);
+int MFS_Client_Shutdown(MFS_Client *c);
+int MFS_Client_Buffer(MFS_Client *c, int on);
+int MFS_Client_Sync(MFS_Client *c);
+int MFS_Client_Snapshot(MFS_Client *c);
+int MFS_Client_DeleteSnapshot(MFS_Client *c, int id);
+int MFS_Client_UseSnapshot(MFS_Client *c, int id);
+int MFS_Client_Compress(MFS_Client *c, int on);
+int MFS_Client_Volume(MFS_Client *c, int volume);
+int MFS_Client_Timeout(MFS_Client *c, int ms);
+
+// single client api, all calls go through one client made by MFS_Init
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
@@ -35,6 +85,16 @@ int MFS_Write(int inum, char *buffer, int offset, int nbytes);
 int MFS_Read(int inum, char *buffer, int offset, int nbytes);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
+int MFS_Fallocate(int inum, int offset, int nbytes);
+int MFS_Append(int inum, char *buffer, int nbytes);
 int MFS_Shutdown();
+int MFS_Buffer(int on);
+int MFS_Sync();
+int MFS_Snapshot();
+int MFS_DeleteSnapshot(int id);
+int MFS_UseSnapshot(int id);
+int MFS_Compress(int on);
+int MFS_Volume(int volume);
+int MFS_Timeout(int ms);
 
 #endif // __MFS_h__
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,9 +8,10 @@
 #include <unistd.h>
 
 #include "ufs.h"
+#include "crc.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-b <block_size>] [-p]\n");
     exit(1);
 }
 
@@ -18,8 +21,10 @@ int main(int argc, char *argv[]) {
     int num_inodes = 32;
     int num_data = 32;
     int visual = 0;
+    int prealloc = 0;
+    int bsize = UFS_BLOCK_SIZE;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:vpb:")) != -1) {
 	switch (ch) {
 	case 'i':
 	    num_inodes = atoi(optarg);
@@ -33,6 +38,12 @@ int main(int argc, char *argv[]) {
 	case 'v':
 	    visual = 1;
 	    break;
+	case 'p':
+	    prealloc = 1;
+	    break;
+	case 'b':
+	    bsize = atoi(optarg);
+	    break;
 	default:
 	    usage();
 	}
@@ -43,10 +54,9 @@ int main(int argc, char *argv[]) {
     if (image_file == NULL)
 	usage();
 
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
+    // a power of two, so the server splits offsets with a shift and a mask
+    if (bsize < UFS_BLOCK_SIZE || bsize > UFS_MAX_BLOCK_SIZE || (bsize & (bsize - 1)) != 0) {
+	fprintf(stderr, "block size must be a power of two from %d to %d\n", UFS_BLOCK_SIZE, UFS_MAX_BLOCK_SIZE);
 	exit(1);
     }
 
@@ -61,31 +71,63 @@ int main(int argc, char *argv[]) {
 
     // presumed: block 0 is the super block
     super_t s;
+    s.block_size = bsize;
+
+    // each bitmap block tracks one bit per inode/data block
+    int bits_per_block = bsize * 8;
 
     // inode bitmap
     s.inode_bitmap_addr = 1;
-    s.inode_bitmap_len = num_inodes / UFS_BLOCK_SIZE;
-    if (num_inodes % UFS_BLOCK_SIZE != 0)
+    s.inode_bitmap_len = num_inodes / bits_per_block;
+    if (num_inodes % bits_per_block != 0)
 	s.inode_bitmap_len++;
 
     // data bitmap
     s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
-    s.data_bitmap_len = num_data / UFS_BLOCK_SIZE;
-    if (num_data % UFS_BLOCK_SIZE != 0)
+    s.data_bitmap_len = num_data / bits_per_block;
+    if (num_data % bits_per_block != 0)
 	s.data_bitmap_len++;
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
-    s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-    if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
+    long long total_inode_bytes = (long long) num_inodes * sizeof(inode_t);
+    s.inode_region_len = total_inode_bytes / bsize;
+    if (total_inode_bytes % bsize != 0)
 	s.inode_region_len++;
 
+    // reference counts, all zero until a snapshot shares a block
+    s.ref_addr = s.inode_region_addr + s.inode_region_len;
+    long long total_ref_bytes = (long long) num_data * sizeof(ufs_ref_t);
+    s.ref_len = total_ref_bytes / bsize;
+    if (total_ref_bytes % bsize != 0)
+	s.ref_len++;
+
+    // snapshot table, then a map of the inode table and a copy of the inode bitmap for each snapshot
+    int map_len = s.inode_region_len * sizeof(unsigned int) / bsize;
+    if ((s.inode_region_len * sizeof(unsigned int)) % bsize != 0)
+	map_len++;
+    s.snap_addr = s.ref_addr + s.ref_len;
+    s.snap_len = 1 + UFS_MAX_SNAPSHOTS * (map_len + s.inode_bitmap_len);
+
+    // block checksums, one for every block of the image including these
+    s.csum_addr = s.snap_addr + s.snap_len;
+    s.csum_len = 0;
+    while ((long long) s.csum_len * UFS_CSUMS_PER_BLOCK(bsize) < (long long) s.csum_addr + s.csum_len + num_data)
+	s.csum_len++;
+
     // data blocks
-    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
+    s.data_region_addr = s.csum_addr + s.csum_len;
     s.data_region_len = num_data;
 
-    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
+    int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.ref_len + s.snap_len + s.csum_len + s.data_region_len;
+
+    // every block written below gets its checksum, the rest are zeros and checksum to 0
+    CRC_Init();
+    ufs_csum_t *csums = calloc(s.csum_len, bsize);
+    char *block = calloc(1, bsize);
+    assert(csums != NULL && block != NULL);
+    memcpy(block, &s, sizeof(super_t));
+    csums[0] = CRC_32C(0, block, bsize);
 
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
@@ -94,85 +136,107 @@ int main(int argc, char *argv[]) {
 	exit(1);
     }
 
-    printf("total blocks        %d\n", total_blocks);
+    printf("total blocks        %d [size of each: %d]\n", total_blocks, bsize);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
     printf("  data blocks       %d\n", num_data);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
+    printf("  ref counts address/len   %d [%d]\n", s.ref_addr, s.ref_len);
+    printf("  snapshots address/len    %d [%d]\n", s.snap_addr, s.snap_len);
+    printf("  checksums address/len    %d [%d]\n", s.csum_addr, s.csum_len);
 
     // first, zero out all the blocks
-    int i;
-    for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
-	    perror("write");
-	    exit(1);
+    // the image is created sparse, so untouched bitmap, inode and data blocks
+    // read back as zeros without being written; only the blocks with real
+    // content below are written out
+    off_t image_size = (off_t) total_blocks * bsize;
+    if (ftruncate(fd, image_size) != 0) {
+	perror("ftruncate");
+	exit(1);
+    }
+
+    // optionally reserve the space up front so the server can't hit ENOSPC later
+    if (prealloc) {
+	if (fallocate(fd, 0, 0, image_size) != 0) {
+	    if (errno != EOPNOTSUPP || (errno = posix_fallocate(fd, 0, image_size)) != 0) {
+		perror("fallocate");
+		exit(1);
+	    }
 	}
     }
 
     //
     // need to allocate first inode in inode bitmap
+    // (block is reused for every block written below, zeroed in between)
     //
-    typedef struct {
-	unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
-    } bitmap_t;
-    assert(sizeof(bitmap_t) == UFS_BLOCK_SIZE);
-
-    bitmap_t b;
-    for (i = 0; i < 1024; i++)
-	b.bits[i] = 0;
-    b.bits[0] = 0x1 << 31; // first entry is allocated
+    int i;
+    unsigned int *bits = (unsigned int *) block;
+    memset(block, 0, bsize);
+    bits[0] = 0x1 << 31; // first entry is allocated
     
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, block, bsize, (off_t) s.inode_bitmap_addr * bsize);
+    assert(rc == bsize);
+    csums[s.inode_bitmap_addr] = CRC_32C(0, block, bsize);
 
     //
     // need to allocate first data block in data bitmap
     // (can just reuse this to write out data bitmap too)
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, block, bsize, (off_t) s.data_bitmap_addr * bsize);
+    assert(rc == bsize);
+    csums[s.data_bitmap_addr] = csums[s.inode_bitmap_addr];
 
     //
     // need to write out inode
+    // (the rest of the inode table stays sparse: unused inodes are all zero)
     //
-    typedef struct {
-	inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-    } inode_block;
-
-    inode_block itable;
-    itable.inodes[0].type = UFS_DIRECTORY;
-    itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
+    inode_t *itable = (inode_t *) block;
+    memset(block, 0, bsize);
+    itable[0].type = UFS_DIRECTORY;
+    itable[0].size = 2 * sizeof(dir_ent_t); // in bytes
+    itable[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
+	itable[0].direct[i] = -1;
 
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, block, bsize, (off_t) s.inode_region_addr * bsize);
+    assert(rc == bsize);
+    csums[s.inode_region_addr] = CRC_32C(0, block, bsize);
+
+    //
+    // snapshot ids start at 1, 0 marks a free slot
+    //
+    snap_table_t table;
+    memset(&table, 0, sizeof(table));
+    table.next_id = 1;
+    rc = pwrite(fd, &table, sizeof(table), (off_t) s.snap_addr * bsize);
+    assert(rc == sizeof(table));
+    memset(block, 0, bsize);
+    memcpy(block, &table, sizeof(table));
+    csums[s.snap_addr] = CRC_32C(0, block, bsize);
 
     // 
     // need to write out root directory contents to first data block
     // create a root directory, with nothing in it
     // 
-    typedef struct {
-	dir_ent_t entries[128];
-    } dir_block_t;
-    // xxx assumes 4096 block, 32 byte entries
-    assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
+    dir_ent_t *parent = (dir_ent_t *) block;
+    int entries = bsize / sizeof(dir_ent_t);
+    memset(block, 0, bsize);
+    strcpy(parent[0].name, ".");
+    parent[0].inum = 0;
 
-    dir_block_t parent;
-    strcpy(parent.entries[0].name, ".");
-    parent.entries[0].inum = 0;
+    strcpy(parent[1].name, "..");
+    parent[1].inum = 0;
 
-    strcpy(parent.entries[1].name, "..");
-    parent.entries[1].inum = 0;
+    for (i = 2; i < entries; i++)
+	parent[i].inum = -1;
 
-    for (i = 2; i < 128; i++)
-	parent.entries[i].inum = -1;
+    rc = pwrite(fd, block, bsize, (off_t) s.data_region_addr * bsize);
+    assert(rc == bsize);
+    csums[s.data_region_addr] = CRC_32C(0, block, bsize);
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    rc = pwrite(fd, csums, (size_t) s.csum_len * bsize, (off_t) s.csum_addr * bsize);
+    assert(rc == s.csum_len * bsize);
 
     if (visual) {
 	int i;
@@ -184,6 +248,12 @@ int main(int argc, char *argv[]) {
 	    printf("d");
 	for (i = 0; i < s.inode_region_len; i++)
 	    printf("I");
+	for (i = 0; i < s.ref_len; i++)
+	    printf("R");
+	for (i = 0; i < s.snap_len; i++)
+	    printf("N");
+	for (i = 0; i < s.csum_len; i++)
+	    printf("C");
 	for (i = 0; i < s.data_region_len; i++)
 	    printf("D");
 	printf("\n\n");
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mfs.h"
+#include "udp.h"
+#include "trace.h"
+#include "lz.h"
+
+#define BUFFER_SIZE (MFS_REQ_ID + MFS_TRAILER)
+#define NUM_OPS (OP_SNAPDEL + 1)
+
+char *op_names[NUM_OPS] = { "lookup", "stat", "write", "read", "creat", "unlink", "term", "falloc", "append", "snap", "snapdel" };
+
+//Latency samples for one opcode, in microseconds
+typedef struct {
+	double *lat;
+	int n;
+	int cap;
+	int failed;
+} samples_t;
+
+void usage() {
+	fprintf(stderr, "usage: replay [-s <speed>] [-T] <host> <port> <trace_file>\n");
+	fprintf(stderr, "  -s  replay at speed times the original rate, 0 for as fast as possible (default 1)\n");
+	fprintf(stderr, "  -T  also send OP_TERM requests found in the trace (skipped by default)\n");
+	exit(1);
+}
+
+double now_us(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void add_sample(samples_t *s, double lat, int failed){
+	if(s->n == s->cap){
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->lat = realloc(s->lat, s->cap * sizeof(double));
+		if(!s->lat){
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->lat[s->n++] = lat;
+	s->failed += failed;
+}
+
+int cmp_double(const void *a, const void *b){
+	double x = *(double*)a, y = *(double*)b;
+	return (x > y) - (x < y);
+}
+
+void report(char *name, samples_t *s){
+	if(s->n == 0){
+		return;
+	}
+
+	double sum = 0;
+	for(int i = 0; i < s->n; i++){
+		sum += s->lat[i];
+	}
+	qsort(s->lat, s->n, sizeof(double), cmp_double);
+
+	printf("  %-8s %8d %8d %10.1f %10.1f %10.1f %10.1f\n", name, s->n, s->failed, sum / s->n,
+	       s->lat[s->n / 2], s->lat[(int)(s->n * 0.99)], s->lat[s->n - 1]);
+}
+
+/**
+ * Sends a request and waits for the reply, resending on timeout like the client library does.
+ * Busy replies are waited out for as long as the server asks.
+ * Returns the reply code or -1 if the request could not be sent
+ */
+int send_request(int sd, struct sockaddr_in *server, char *msg){
+	char reply[BUFFER_SIZE];
+	struct sockaddr_in from;
+	fd_set rfds;
+	int rc;
+
+	//Only the part of the request that means anything goes out, see LZ_Trim
+	struct iovec iov[2];
+	LZ_Trim(msg, LZ_RequestLen(msg), iov);
+
+	while(1){
+		if(UDP_WriteV(sd, server, iov, 2) < 0){
+			return -1;
+		}
+
+		struct timeval timeout = { 1, 0 };
+		FD_ZERO(&rfds);
+		FD_SET(sd, &rfds);
+		rc = select(sd + 1, &rfds, 0, 0, &timeout);
+		if(rc <= 0){
+			continue;
+		}
+
+		//Nothing read is handled like nothing came, see UDP_Faults
+		if(UDP_Read(sd, &from, reply, BUFFER_SIZE) < 0){
+			continue;
+		}
+
+		memcpy(&rc, reply, sizeof(int));
+		if(rc != RES_BUSY){
+			return rc;
+		}
+
+		int ms;
+		memcpy(&ms, &reply[4], sizeof(int));
+		struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+		nanosleep(&ts, NULL);
+	}
+}
+
+// replays a trace captured with server -t
+int main(int argc, char *argv[]) {
+	int ch;
+	double speed = 1;
+	int send_term = 0;
+
+	while((ch = getopt(argc, argv, "s:T")) != -1){
+		switch(ch){
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'T':
+				send_term = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if(argc != 3 || speed < 0){
+		usage();
+	}
+
+	FILE *trace = Trace_OpenRead(argv[2]);
+	if(!trace){
+		fprintf(stderr, "cannot read trace file %s\n", argv[2]);
+		exit(1);
+	}
+
+	struct sockaddr_in server;
+	if(UDP_FillSockAddr(&server, argv[0], atoi(argv[1])) < 0){
+		exit(1);
+	}
+
+	int sd = UDP_Open(0);
+	if(sd < 0){
+		exit(1);
+	}
+
+	samples_t samples[NUM_OPS];
+	samples_t all;
+	memset(samples, 0, sizeof(samples));
+	memset(&all, 0, sizeof(all));
+
+	trace_rec_t rec;
+	char msg[BUFFER_SIZE];
+	int rc, skipped = 0;
+	double lag = 0;
+	unsigned int id = (unsigned int) now_us();
+	double start = now_us();
+
+	while((rc = Trace_Next(trace, &rec, msg, BUFFER_SIZE)) == 1){
+		int op;
+		memcpy(&op, msg, sizeof(int));
+		if(op < 0 || op >= NUM_OPS || (op == OP_TERM && !send_term)){
+			skipped++;
+			continue;
+		}
+
+		//Bulk payload is not traced, the server only cares about its length
+		memset(&msg[rec.len], 0, BUFFER_SIZE - rec.len);
+		if(op == OP_WRITE || op == OP_APPEND){
+			int nbytes;
+			memcpy(&nbytes, &msg[8], sizeof(int));
+			if(nbytes > 0 && nbytes <= MFS_MAX_PAYLOAD){
+				memset(&msg[16], 'x', nbytes);
+			}
+		}
+
+		//Hold the request back until its scaled arrival time
+		if(speed > 0){
+			double due = start + rec.ts / 1e3 / speed;
+			double t = now_us();
+			if(due > t){
+				struct timespec ts = { (time_t)((due - t) / 1e6), (long)((due - t) * 1e3) % 1000000000L };
+				nanosleep(&ts, NULL);
+			}else{
+				lag += t - due;
+			}
+		}
+
+		//Traced ids are other clients', the server answers resends of some of them from what it kept
+		id++;
+		memcpy(&msg[MFS_REQ_ID], &id, sizeof(id));
+		double t0 = now_us();
+		rc = send_request(sd, &server, msg);
+		double lat = now_us() - t0;
+
+		add_sample(&samples[op], lat, rc < 0);
+		add_sample(&all, lat, rc < 0);
+	}
+
+	double elapsed = (now_us() - start) / 1e6;
+	if(rc < 0){
+		fprintf(stderr, "trace is truncated or corrupt\n");
+	}
+	Trace_Close(trace);
+
+	printf("replayed %d requests (%d skipped) in %.3f s\n", all.n, skipped, elapsed);
+	printf("throughput %.1f ops/s\n", elapsed > 0 ? all.n / elapsed : 0);
+	if(speed > 0 && all.n){
+		printf("mean schedule lag %.1f us\n", lag / all.n);
+	}
+	printf("latency (us)\n");
+	printf("  %-8s %8s %8s %10s %10s %10s %10s\n", "op", "count", "failed", "avg", "p50", "p99", "max");
+	for(int i = 0; i < NUM_OPS; i++){
+		report(op_names[i], &samples[i]);
+	}
+	report("all", &all);
+
+	UDP_Close(sd);
+	return 0;
+}
@@ -1,70 +1,727 @@
+#define _GNU_SOURCE //O_DIRECT
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 #include "mfs.h"
 #include "udp.h"
 #include "ufs.h"
+#include "trace.h"
+#include "io.h"
+#include "cache.h"
+#include "lz.h"
+#include "dedup.h"
+#include "crc.h"
 
-#define BUFFER_SIZE (5008)
+#define BUFFER_SIZE (MFS_REQ_ID + MFS_TRAILER)
+
+#define WRITEBACK_IDLE_MS  (20)   //Write back buffered data once no request arrives for this long
+#define WRITEBACK_MAX_MS   (1000) //or once the oldest buffered write is this old
+#define WRITEBACK_MAX_PAGES (1024) //or once this many blocks are buffered
+
+#define IO_DEPTH    (256) //Max disk writes in flight
+#define IO_MAX_RUN  (256) //Max blocks written by a single disk write
+
+#define CACHE_MB    (256) //Default size of the data block caches of all volumes together, see -c
+
+#define VOLUME_IDLE_MS  (60000) //Volumes no request has used for this long are evicted
+#define VOLUME_SWEEP_MS (1000)  //How often the first loop looks for them
+
+#define DEFRAG_TICK_MS (10)   //How often the first loop moves fragmented files, see -f
+#define DEFRAG_SCAN    (1024) //Inodes looked at for one to move before the lock is let go
+
+#define READ_TRIES (4) //Times a lookup or stat is read optimistically before it takes the lock
+
+#define QUEUE_MAX     (32)   //Requests a client may have waiting before it is told to back off
+#define BACKLOG_MAX   (1024) //Requests a receive loop holds across all of its clients
+#define RECV_BATCH    (64)   //Requests taken off the socket between scheduling rounds
+#define DRR_QUANTUM   (MFS_MAX_PAYLOAD) //Bulk bytes each client may move per round
+#define BUSY_RETRY_MS (10)   //How long a client that was told to back off waits
+
+#define DONE_SLOTS (4096) //Outcomes of recent requests that changed the image, see done_find
 
 int res;
 
-super_t *metadata; //File image metadata
-int *inode_bitmap; //Bitmap for allocated inodes
-int *data_bitmap;  //Bitmap for allocated data blocks
-inode_t *inodes;   //Inodes
-char *data;		   //Data blocks
+FILE *trace;       //Request trace, NULL unless enabled with -t
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Write back state: the I/O engine, flush sequence numbers and held back replies, and the dirty block lists of every volume
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread unsigned long thread_flush; //Last flush made while handling the current request, 0 if none
+
+__thread int thread_snap = -1; //Slot of the snapshot the current request reads, -1 for the live image
+__thread inode_t snap_inode;   //An inode of that snapshot, copied out of the block holding it
+
+int dedup_on;               //1 with -D, whole block writes share identical blocks through the reference counts
+char *wal_file;             //Delayed allocation log given with -d, NULL unless enabled
+
+__thread int thread_corrupt; //1 once the current request needed a block that failed its checksum
+
+__thread int thread_optimistic; //1 while a lookup or stat runs without the volume lock, see read_optimistic
+__thread int thread_fallback;   //1 once it needed something only the locked path may touch
+
+//Writes to one inode held back by delayed allocation (-d)
+typedef struct {
+	int size;                  //File size including the buffered writes
+	char *pages[DIRECT_PTRS];  //Buffered contents of each file block, NULL if not written
+	int reserved;              //Blocks reserved for write back
+} pending_t;
+
+//Delayed allocation log record, followed by n bytes of data
+typedef struct {
+	int inum;
+	int offset;
+	int n;
+} wal_rec_t;
+
+//One image the server hosts, requests name it by its place on the command line, see MFS_VOLUME.
+//Everything past lock is only there while the volume is resident.
+typedef struct {
+	int id;
+	char *path;
+	char *wal_path;          //Delayed allocation log, NULL unless enabled with -d
+	int resident;            //1 while loaded
+	int users;               //Requests using the volume, it is never evicted while in use
+	long last_used;          //When a request last came for it, ms on the monotonic clock
+	//Reads share the image, anything that changes it runs alone. Lookups and stats
+	//skip it and check seq instead, which is odd while a writer is in.
+	pthread_rwlock_t lock;
+	unsigned int seq;
+
+	FILE *fimg;
+	super_t *metadata; //File image metadata
+	int *inode_bitmap; //Bitmap for allocated inodes
+	int *data_bitmap;  //Bitmap for allocated data blocks
+	inode_t *inodes;   //Inodes
+	int img_fd;        //The image opened for O_DIRECT, data blocks are read and written through the cache
+	Cache *cache;
+
+	int free_blocks;   //Unallocated data blocks
+
+	int block_size;    //Bytes in every block of the image, see mkfs -b
+	int block_shift;   //log2 of block_size, so file offsets split into block and byte with a shift and a mask
+	int block_mask;    //block_size - 1
+
+	ufs_ref_t *refs;            //Extra holders of each data block, NULL on images without room for snapshots
+	snap_table_t *snaps;        //Snapshot table, the inode table map of each slot follows it in memory
+	int map_len;                //Blocks of one slot, its inode table map and its inode bitmap copy
+	int map_bits;               //Block of a slot its inode bitmap copy starts at, 0 on images without one
+	unsigned char *itab_shared; //1 for inode table blocks some snapshot still reads from the live table
+
+	Dedup *dedup;               //Content hash index, NULL unless -D
+
+	ufs_csum_t *csums;           //Checksum of every image block, NULL on images without them
+	unsigned char *bad_map;      //Image blocks that failed their checksum when read, one bit each
+
+	unsigned char *dirty_map;    //Image blocks changed in memory since they were last written, one bit each
+	unsigned char *inflight_map; //Image blocks with a write in flight, one bit each
+	int *dirty_blocks;           //The dirty image blocks, in the order they were changed
+	int ndirty_blocks;
+
+	int wal_fd;               //Delayed allocation log, -1 unless enabled with -d
+	pending_t **pending;      //Buffered writes by inode number
+	int *dirty;               //Inodes with buffered writes
+	int ndirty;
+	int pending_pages;        //Blocks buffered across all inodes
+	int reserved_blocks;      //Free blocks promised to buffered pages that have none yet
+	struct timespec pending_since; //When the oldest buffered write arrived
+
+	int defrag_next;          //Inode the defragmenter looks at next
+	long defrag_files;        //Files it moved into one run
+	long defrag_blocks;       //and the blocks it copied for them
+} volume_t;
+
+volume_t *volumes;
+int nvolumes;
+int nresident;
+int max_resident;        //Volumes kept in memory at once, 0 for no limit, see -m
+long cache_mb = CACHE_MB;
+int defrag_rate;         //Blocks a second the defragmenter may copy, 0 unless enabled with -f
+long defrag_credit;      //Blocks it may still copy
+long defrag_at;          //When it last ran, ms on the monotonic clock
+//Which volumes are resident and who is using them. Taken before the lock of a volume, which is taken before io_lock.
+pthread_mutex_t vol_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread volume_t *vol;  //Volume of the current request
+
+#define INODES_PER_BLOCK (vol->block_size / sizeof(inode_t))
+
+//A run of image blocks being written back as one disk write
+typedef struct {
+	volume_t *vol;
+	int start;
+	int count;
+	unsigned long seq; //Flush the write belongs to
+	char *bufs[];      //Memory of each block, data blocks stay pinned in the cache until written
+} io_run_t;
+
+unsigned long flush_seq;      //Number of flushes that wrote something
+unsigned long completed_seq;  //All flushes up to this one are on disk
+int flush_left[IO_DEPTH];     //Writes still in flight for each recent flush
+unsigned long flush_err[IO_DEPTH]; //The recent flush in each slot that had a write fail
+
+//A reply held back until the flush it depends on is on disk
+typedef struct __reply_t {
+	int sd;
+	struct sockaddr_in addr;
+	unsigned long seq;
+	int len;           //Part of the reply that means anything
+	struct __reply_t *next;
+	char msg[BUFFER_SIZE];
+} reply_t;
+
+reply_t *replies, *replies_tail;
+
+//The outcome of a request that changed the image, kept to answer copies of it. Running one again
+//could append its data twice, take another snapshot, or undo a later write when the copy arrives late.
+typedef struct {
+	in_addr_t ip;
+	in_port_t port;    //0 for an unused slot
+	unsigned int id;   //Request id at MFS_REQ_ID
+	int code;
+	unsigned long seq; //Flush the reply waits for
+} done_t;
+
+done_t done[DONE_SLOTS];
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//A read reply sent straight from where the file data lives
+typedef struct {
+	struct iovec iov[4]; //Return code, up to two pieces of file data and the trailer
+	int iovcnt;
+	char *pinned[2];     //Cache frames to release once the reply is sent
+	int npinned;
+} read_reply_t;
+
+char zeros[UFS_MAX_BLOCK_SIZE]; //What holes read as
+
+/**
+ * Reads a metadata region into block aligned memory, so it can be written back with O_DIRECT
+ */
+void *load_region(int fd, int addr, int len){
+	void *buf;
+	size_t bytes = (size_t) vol->block_size * len;
+	if(posix_memalign(&buf, vol->block_size, bytes) != 0){
+		fprintf(stderr, "An error has occured\n");
+		exit(1);
+	}
+	pread(fd, buf, bytes, (off_t) vol->block_size * addr);
+	return buf;
+}
+
+/**
+ * Returns the inode table map of a snapshot slot
+ */
+unsigned int *snap_map(int slot){
+	return (unsigned int*)((char*)vol->snaps + (size_t)(1 + slot * vol->map_len) * vol->block_size);
+}
+
+/**
+ * Returns the inode bitmap of a snapshot slot as it was when the snapshot was taken
+ */
+unsigned int *snap_bitmap(int slot){
+	return (unsigned int*)((char*)snap_map(slot) + (size_t) vol->map_bits * vol->block_size);
+}
 
 /**
- * Loads a file image and initializes file system metadata, bitmaps, inodes, and data to memory.
+ * Loads a file image and initializes file system metadata, bitmaps and inodes to memory.
+ * Data blocks are left on disk and read through the buffer cache.
+ * Returns 0 on success, -1 if the image can't be opened or has a block size the server can't serve
  * fileimg[in] - the path of the file image
  * file[out] - the resulting file
  */
-void load_image(char* fileimg, FILE **file) {
+int load_image(char* fileimg, FILE **file) {
 	*file = fopen(fileimg, "r+");
 	
-	if(!file){
+	if(!*file){
 		fprintf(stderr, "An error has occured\n");
-		exit(1);
+		return -1;
 	}
 	
 	int fd = fileno(*file);
 
 	//Read in data structures
-	int bytes;
-	metadata = (super_t*)malloc(sizeof(super_t));
-	pread(fd, metadata, sizeof(super_t), 0);
+	vol->metadata = (super_t*)malloc(sizeof(super_t));
+	pread(fd, vol->metadata, sizeof(super_t), 0);
+
+	//Older images leave the block size out
+	vol->block_size = UFS_BSIZE(vol->metadata);
+	if(vol->block_size < UFS_BLOCK_SIZE || vol->block_size > UFS_MAX_BLOCK_SIZE || (vol->block_size & (vol->block_size - 1))){
+		fprintf(stderr, "unsupported block size %d\n", vol->block_size);
+		return -1;
+	}
+	vol->block_mask = vol->block_size - 1;
+	for(vol->block_shift = 0; 1 << vol->block_shift < vol->block_size; vol->block_shift++);
 	
-	bytes = UFS_BLOCK_SIZE * metadata->inode_bitmap_len;
-	inode_bitmap = (int*)malloc(bytes);
-	pread(fd, inode_bitmap, bytes, UFS_BLOCK_SIZE * metadata->inode_bitmap_addr);
+	vol->inode_bitmap = load_region(fd, vol->metadata->inode_bitmap_addr, vol->metadata->inode_bitmap_len);
+	vol->data_bitmap = load_region(fd, vol->metadata->data_bitmap_addr, vol->metadata->data_bitmap_len);
+	vol->inodes = load_region(fd, vol->metadata->inode_region_addr, vol->metadata->inode_region_len);
+
+	//Older images have no room for snapshots
+	vol->map_len = vol->metadata->snap_len > 1 ? (vol->metadata->snap_len - 1) / UFS_MAX_SNAPSHOTS : 0;
+	if(vol->metadata->ref_len > 0 && vol->map_len * vol->block_size / sizeof(unsigned int) > vol->metadata->inode_region_len){
+		vol->refs = load_region(fd, vol->metadata->ref_addr, vol->metadata->ref_len);
+		vol->snaps = load_region(fd, vol->metadata->snap_addr, vol->metadata->snap_len);
+		vol->itab_shared = calloc(vol->metadata->inode_region_len, 1);
+		//Slots made before the inode bitmap copy hold only the map
+		int map_blocks = (vol->metadata->inode_region_len * sizeof(unsigned int) + vol->block_size - 1) / vol->block_size;
+		vol->map_bits = vol->map_len >= map_blocks + vol->metadata->inode_bitmap_len ? map_blocks : 0;
+		for(int i = 0; i < UFS_MAX_SNAPSHOTS; i++){
+			for(int k = 0; vol->snaps->ids[i] && k < vol->metadata->inode_region_len; k++){
+				vol->itab_shared[k] |= snap_map(i)[k] == 0;
+			}
+		}
+	}
+
+	//Bypass the page cache so blocks are not cached twice, not every file system supports it
+	vol->img_fd = open(fileimg, O_RDWR | O_DIRECT);
+	if(vol->img_fd < 0){
+		fprintf(stderr, "O_DIRECT unavailable, using the page cache\n");
+		vol->img_fd = fd;
+	}
+
+	vol->free_blocks = 0;
+	for(int i = 0; i < vol->metadata->data_region_len; i++){
+		vol->free_blocks += !(vol->data_bitmap[i / 32] >> (31 - i % 32) & 0x01);
+	}
+
+	int total_blocks = vol->metadata->data_region_addr + vol->metadata->data_region_len;
+	vol->dirty_map = calloc(total_blocks / 8 + 1, 1);
+	vol->inflight_map = calloc(total_blocks / 8 + 1, 1);
+	vol->dirty_blocks = malloc(total_blocks * sizeof(int));
+	vol->ndirty_blocks = 0;
+
+	//Older images have no checksums
+	if(vol->metadata->csum_len > 0){
+		vol->csums = load_region(fd, vol->metadata->csum_addr, vol->metadata->csum_len);
+		vol->bad_map = calloc(total_blocks / 8 + 1, 1);
+	}
+	return 0;
+}
+
+/**
+ * Records that an image block was changed in memory and must be written back
+ * block[in] - The block address within the image
+ */
+void mark_dirty(int block){
+	if(!(vol->dirty_map[block / 8] & 1 << block % 8)){
+		vol->dirty_map[block / 8] |= 1 << block % 8;
+		vol->dirty_blocks[vol->ndirty_blocks++] = block;
+	}
+}
+
+void dirty_data(int block){
+	mark_dirty(vol->metadata->data_region_addr + block);
+	Cache_Dirty(vol->cache, vol->metadata->data_region_addr + block);
+}
+
+void dirty_inode(int inum){
+	mark_dirty(vol->metadata->inode_region_addr + inum * sizeof(inode_t) / vol->block_size);
+}
+
+void dirty_inode_bitmap(int inum){
+	mark_dirty(vol->metadata->inode_bitmap_addr + inum / 8 / vol->block_size);
+}
+
+void dirty_data_bitmap(int block){
+	mark_dirty(vol->metadata->data_bitmap_addr + block / 8 / vol->block_size);
+}
+
+void dirty_ref(int block){
+	mark_dirty(vol->metadata->ref_addr + block * sizeof(ufs_ref_t) / vol->block_size);
+}
+
+/**
+ * Marks the snapshot table and the map of a slot dirty
+ */
+void dirty_snap(int slot){
+	mark_dirty(vol->metadata->snap_addr);
+	for(int i = 0; i < vol->map_len; i++){
+		mark_dirty(vol->metadata->snap_addr + 1 + slot * vol->map_len + i);
+	}
+}
+
+/**
+ * Returns a data block pinned in the buffer cache, release it with Cache_Put.
+ * Returns NULL only to an optimistic read when the block is not cached.
+ * block[in] - The block id, relative to the data region
+ * read[in] - 0 if the caller overwrites the whole block
+ */
+char *get_block(int block, int read){
+	int addr = vol->metadata->data_region_addr + block;
+	//Missing a block would read it in and maybe write others back, which only the locked path may do
+	char *buf = thread_optimistic ? Cache_Try(vol->cache, addr) : Cache_Get(vol->cache, addr, read);
+	if(!buf){
+		thread_fallback = 1;
+		return NULL;
+	}
+	//A block that failed its checksum is good again once it is overwritten whole
+	if(vol->bad_map && vol->bad_map[addr / 8] & 1 << addr % 8){
+		if(read){
+			thread_corrupt = 1;
+		}else{
+			vol->bad_map[addr / 8] &= ~(1 << addr % 8);
+		}
+	}
+	return buf;
+}
+
+/**
+ * Returns where a metadata block is kept in memory
+ * block[in] - The block address within the image
+ */
+char *block_mem(int block){
+	if(vol->csums && block >= vol->metadata->csum_addr){
+		return (char*)vol->csums + (size_t)(block - vol->metadata->csum_addr) * vol->block_size;
+	}else if(vol->refs && block >= vol->metadata->snap_addr){
+		return (char*)vol->snaps + (size_t)(block - vol->metadata->snap_addr) * vol->block_size;
+	}else if(vol->refs && block >= vol->metadata->ref_addr){
+		return (char*)vol->refs + (size_t)(block - vol->metadata->ref_addr) * vol->block_size;
+	}else if(block >= vol->metadata->inode_region_addr){
+		return (char*)vol->inodes + (size_t)(block - vol->metadata->inode_region_addr) * vol->block_size;
+	}else if(block >= vol->metadata->data_bitmap_addr){
+		return (char*)vol->data_bitmap + (block - vol->metadata->data_bitmap_addr) * vol->block_size;
+	}
+	return (char*)vol->inode_bitmap + (block - vol->metadata->inode_bitmap_addr) * vol->block_size;
+}
+
+/**
+ * Returns 1 for blocks of the checksum region, which have no checksum of their own
+ */
+int is_csum_block(int block){
+	return block >= vol->metadata->csum_addr && block < vol->metadata->csum_addr + vol->metadata->csum_len;
+}
+
+/**
+ * Checks the metadata against its checksums. It is only ever read when the
+ * image is loaded, so this is the one time it is checked; a volume whose
+ * metadata fails is not served.
+ * Returns 0 if every block matches, -1 otherwise
+ */
+int check_meta(FILE *file){
+	char *super = load_region(fileno(file), 0, 1);
+	for(int b = 0; b < vol->metadata->data_region_addr; b++){
+		if(!is_csum_block(b) && CRC_32C(0, b ? block_mem(b) : super, vol->block_size) != vol->csums[b]){
+			fprintf(stderr, "metadata block %d of %s fails its checksum, check the image with fsck\n", b, vol->path);
+			free(super);
+			return -1;
+		}
+	}
+	free(super);
+	return 0;
+}
+
+/**
+ * Checks a data block read from the image against its checksum. A block that
+ * fails is remembered, every request that needs it is answered with RES_CORRUPT.
+ * arg[in] - The volume the block is of
+ * block[in] - The block address within the image
+ */
+void verify_block(void *arg, int block, char *buf){
+	volume_t *v = arg;
+	if(CRC_32C(0, buf, v->block_size) != v->csums[block]){
+		fprintf(stderr, "block %d of %s fails its checksum\n", block, v->path);
+		v->bad_map[block / 8] |= 1 << block % 8;
+	}
+}
+
+/**
+ * Returns 1 if a write of a flush failed. Called with io_lock held.
+ */
+int flush_failed(unsigned long seq){
+	return flush_err[seq % IO_DEPTH] == seq;
+}
+
+/**
+ * Drops one outstanding write from a flush. Flushes complete in order as far
+ * as replies are concerned. The replies held back for a flush that failed
+ * are turned into failures.
+ */
+void flush_put(unsigned long seq){
+	flush_left[seq % IO_DEPTH]--;
+	while(completed_seq < flush_seq && flush_left[(completed_seq + 1) % IO_DEPTH] == 0){
+		completed_seq++;
+		if(!flush_failed(completed_seq)){
+			continue;
+		}
+		for(reply_t *r = replies; r; r = r->next){
+			if(r->seq == completed_seq){
+				int res = RES_FAIL;
+				memcpy(r->msg, &res, sizeof(int));
+			}
+		}
+	}
+}
+
+/**
+ * Called by the I/O engine when a run of blocks is on disk. The engine is
+ * shared, so this may be reaping the writes of any volume.
+ */
+void write_done(unsigned long tag, int res){
+	io_run_t *run = (io_run_t*) tag;
+	volume_t *v = run->vol;
+	if(res < 0){
+		fprintf(stderr, "write back of blocks %d-%d of %s failed: %s\n", run->start, run->start + run->count - 1, v->path, strerror(-res));
+		flush_err[run->seq % IO_DEPTH] = run->seq;
+	}
 
-	bytes = UFS_BLOCK_SIZE * metadata->data_bitmap_len;
-	data_bitmap = (int*)malloc(bytes);
-	pread(fd, data_bitmap, bytes, UFS_BLOCK_SIZE * metadata->data_bitmap_addr);
+	for(int b = run->start; b < run->start + run->count; b++){
+		v->inflight_map[b / 8] &= ~(1 << b % 8);
+		if(b >= v->metadata->data_region_addr){
+			Cache_Put(v->cache, run->bufs[b - run->start]);
+		}
+	}
 
-	bytes = UFS_BLOCK_SIZE * metadata->inode_region_len;
-	inodes = (inode_t*)malloc(bytes);
-	pread(fd, inodes, bytes, UFS_BLOCK_SIZE * metadata->inode_region_addr);
+	flush_put(run->seq);
+	free(run);
+}
 
-	bytes = UFS_BLOCK_SIZE * metadata->data_region_len;
-	data = (char*)malloc(bytes);
-	pread(fd, data, bytes, UFS_BLOCK_SIZE * metadata->data_region_addr);
+int cmp_int(const void *a, const void *b){
+	return *(int*)a - *(int*)b;
 }
 
 /**
- * Writes all data to disk
+ * Writes all changed blocks to disk. Adjacent dirty blocks go out as one
+ * gather write and with the io_uring engine the whole flush is a single
+ * submission that completes in the background.
  */
 void flush_data(FILE *file){
-	pwrite(fileno(file), inode_bitmap, metadata->inode_bitmap_len * UFS_BLOCK_SIZE, UFS_BLOCK_SIZE);
-	pwrite(fileno(file), data_bitmap, metadata->data_bitmap_len * UFS_BLOCK_SIZE, metadata->data_bitmap_addr * UFS_BLOCK_SIZE);
-	pwrite(fileno(file), inodes, metadata->inode_region_len * UFS_BLOCK_SIZE, metadata->inode_region_addr * UFS_BLOCK_SIZE);
-	pwrite(fileno(file), data, metadata->data_region_len * UFS_BLOCK_SIZE, metadata->data_region_addr * UFS_BLOCK_SIZE);
+	pthread_mutex_lock(&io_lock);
+	if(vol->ndirty_blocks == 0){
+		pthread_mutex_unlock(&io_lock);
+		return;
+	}
+
+	//Checksums are taken as blocks go out and written in the same flush. Blocks
+	//that failed theirs keep it, so what was wrong with them is not hidden.
+	if(vol->csums){
+		int n = vol->ndirty_blocks;
+		for(int i = 0; i < n; i++){
+			int b = vol->dirty_blocks[i];
+			if(is_csum_block(b) || vol->bad_map[b / 8] & 1 << b % 8){
+				continue;
+			}
+			//Dirty frames are never evicted, so data blocks are always cached here
+			char *buf = b >= vol->metadata->data_region_addr ? Cache_Peek(vol->cache, b) : block_mem(b);
+			vol->csums[b] = CRC_32C(0, buf, vol->block_size);
+			mark_dirty(vol->metadata->csum_addr + b / UFS_CSUMS_PER_BLOCK(vol->block_size));
+		}
+	}
+
+	qsort(vol->dirty_blocks, vol->ndirty_blocks, sizeof(int), cmp_int);
+	//Flushes are counted in a ring, so one can't start until the one IO_DEPTH before it is done
+	while(flush_seq - completed_seq >= IO_DEPTH){
+		IO_Submit();
+		IO_Reap(1);
+	}
+	//Hold the flush open until every run is queued
+	unsigned long seq = ++flush_seq;
+	flush_left[seq % IO_DEPTH] = 1;
+
+	for(int i = 0; i < vol->ndirty_blocks;){
+		//Extend the run while blocks are adjacent on disk, cache frames can be anywhere in memory
+		int start = vol->dirty_blocks[i];
+		int count = 1;
+		while(i + count < vol->ndirty_blocks && count < IO_MAX_RUN && vol->dirty_blocks[i + count] == start + count){
+			count++;
+		}
+
+		//Two writes of one block in flight at once could land in either order
+		for(int b = start; b < start + count; b++){
+			while(vol->inflight_map[b / 8] & 1 << b % 8){
+				IO_Submit();
+				IO_Reap(1);
+			}
+			vol->dirty_map[b / 8] &= ~(1 << b % 8);
+			vol->inflight_map[b / 8] |= 1 << b % 8;
+		}
+
+		io_run_t *run = malloc(sizeof(io_run_t) + count * sizeof(char*));
+		struct iovec iov[IO_MAX_RUN];
+		run->vol = vol;
+		run->start = start;
+		run->count = count;
+		run->seq = seq;
+		for(int b = 0; b < count; b++){
+			//Dirty frames are never evicted, so data blocks are always cached here
+			int block = start + b;
+			run->bufs[b] = block >= vol->metadata->data_region_addr ? Cache_Writeback(vol->cache, block) : block_mem(block);
+			iov[b].iov_base = run->bufs[b];
+			iov[b].iov_len = vol->block_size;
+		}
+		flush_left[seq % IO_DEPTH]++;
+		IO_WriteV(vol->img_fd, iov, count, (off_t) start * vol->block_size, (unsigned long) run);
+		i += count;
+	}
+	vol->ndirty_blocks = 0;
+	flush_put(seq);
+	thread_flush = seq;
+
+	IO_Submit();
+	IO_Reap(0);
+	pthread_mutex_unlock(&io_lock);
+}
+
+/**
+ * Called by the buffer cache when every frame is dirty, makes them clean.
+ * Only requests on its own volume use a cache, so arg is the current volume.
+ */
+void cache_full(void *arg){
+	flush_data(NULL);
+	pthread_mutex_lock(&io_lock);
+	IO_Drain();
+	pthread_mutex_unlock(&io_lock);
+}
+
+/**
+ * Sends a reply as a compressed frame when the request asked for one,
+ * trimmed to what means anything otherwise. The request flags are still in the buffer.
+ * len[in] - The part of the reply that means anything, the code and what follows it
+ */
+void send_reply(int sd, struct sockaddr_in *addr, char *msg, int len){
+	if(*(int*) &msg[MFS_FLAGS] & MFS_FLAG_LZ){
+		char frame[LZ_HEADER + MFS_REQ_ID];
+		int n = LZ_Pack(msg, len, frame, sizeof(frame));
+		if(n > 0){
+			UDP_Write(sd, addr, frame, n);
+			return;
+		}
+	}
+	struct iovec iov[2];
+	LZ_Trim(msg, len, iov);
+	UDP_WriteV(sd, addr, iov, 2);
+}
+
+/**
+ * Sends the held back replies whose flush is on disk. Called with io_lock held.
+ */
+void send_replies(){
+	while(replies && replies->seq <= completed_seq){
+		reply_t *r = replies;
+		send_reply(r->sd, &r->addr, r->msg, r->len);
+		replies = r->next;
+		free(r);
+	}
+	if(!replies){
+		replies_tail = NULL;
+	}
+}
+
+/**
+ * Sends a reply, or holds it back if the request had to flush and that flush is still in flight
+ * seq[in] - The flush the request depends on
+ * len[in] - The part of the reply that means anything, see send_reply
+ */
+void reply(int sd, struct sockaddr_in *addr, char *msg, unsigned long seq, int len){
+	//Nothing to wait for
+	if(!seq){
+		return send_reply(sd, addr, msg, len);
+	}
+	pthread_mutex_lock(&io_lock);
+	if(seq <= completed_seq){
+		if(flush_failed(seq)){
+			int res = RES_FAIL;
+			memcpy(msg, &res, sizeof(int));
+		}
+		pthread_mutex_unlock(&io_lock);
+		send_reply(sd, addr, msg, len);
+		return;
+	}
+
+	reply_t *r = malloc(sizeof(reply_t));
+	r->sd = sd;
+	r->addr = *addr;
+	r->seq = seq;
+	r->len = len;
+	r->next = NULL;
+	memcpy(r->msg, msg, len);
+	memcpy(&r->msg[MFS_REQ_ID], &msg[MFS_REQ_ID], MFS_TRAILER);
+	if(replies_tail){
+		replies_tail->next = r;
+	}else{
+		replies = r;
+	}
+	replies_tail = r;
+	pthread_mutex_unlock(&io_lock);
+}
+
+/**
+ * Reports finished disk writes and sends the replies that were waiting for them
+ */
+void reap(){
+	pthread_mutex_lock(&io_lock);
+	if(IO_Inflight()){
+		IO_Reap(0);
+	}
+	send_replies();
+	pthread_mutex_unlock(&io_lock);
 }
 
 int inode_inuse(int inum){
-	return inode_bitmap[inum / 32] >> (31 - inum % 32) & 0x01;
+	return vol->inode_bitmap[inum / 32] >> (31 - inum % 32) & 0x01;
+}
+
+/**
+ * Returns 1 if addr is a block in the data region, 0 for unused pointers (0 or -1)
+ */
+int block_valid(unsigned int addr){
+	return addr >= vol->metadata->data_region_addr && addr < vol->metadata->data_region_len + vol->metadata->data_region_addr;
+}
+
+/**
+ * Returns the size of a file, counting writes still buffered by delayed allocation
+ */
+int file_size(int inum){
+	//Writeback frees the buffers under the lock
+	if(thread_optimistic && vol->pending && vol->pending[inum]){
+		thread_fallback = 1;
+		return 0;
+	}
+	return vol->pending && vol->pending[inum] ? vol->pending[inum]->size : vol->inodes[inum].size;
+}
+
+/**
+ * Returns the buffered copy of a file block, or NULL if that block has no buffered writes
+ */
+char *pending_page(int inum, int idx){
+	//Snapshots are taken with nothing buffered, what is buffered now is newer than any of them
+	if(thread_snap >= 0){
+		return NULL;
+	}
+	return vol->pending && vol->pending[inum] ? vol->pending[inum]->pages[idx] : NULL;
+}
+
+/**
+ * Returns an inode as the current request sees it, from the live table or
+ * from the snapshot it reads. A snapshot inode stays valid until the next call.
+ */
+inode_t *get_inode(int inum){
+	if(thread_snap < 0){
+		return &vol->inodes[inum];
+	}
+	unsigned int copy = snap_map(thread_snap)[inum / INODES_PER_BLOCK];
+	if(!copy){
+		return &vol->inodes[inum];
+	}
+	char *page = get_block(copy - vol->metadata->data_region_addr, 1);
+	memcpy(&snap_inode, &page[inum % INODES_PER_BLOCK * sizeof(inode_t)], sizeof(inode_t));
+	Cache_Put(vol->cache, page);
+	return &snap_inode;
+}
+
+/**
+ * Returns 1 if an inode is in use as the current request sees it. Snapshots on
+ * images without room for an inode bitmap copy take every inode as in use.
+ */
+int view_inuse(int inum){
+	if(thread_snap < 0){
+		return inode_inuse(inum);
+	}
+	return !vol->map_bits || snap_bitmap(thread_snap)[inum / 32] >> (31 - inum % 32) & 0x01;
 }
 
 /**
@@ -85,39 +742,44 @@ void set_ret(char* msg, int code){
  * msg[out] - The inode of the child with name or -1 if failure
  */
 void lookup(char *msg){
-	int pinum = (int) msg[4];
+	int pinum = *(int*) &msg[4];
 	char name[28];
 	strcpy(&name[0], &msg[8]);
 
 	//Verify valid inode
-	if(pinum < 0 || pinum > UFS_BLOCK_SIZE * metadata->inode_region_len / sizeof(inode_t)){
+	if(pinum < 0 || pinum > vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t)){
 		return set_ret(msg, RES_FAIL);	
 	}
 
 	//Verify inode is in use
-	if(!inode_inuse(pinum)){
+	if(!view_inuse(pinum)){
 		return set_ret(msg, RES_FAIL);
 	}
 
 	//Inode passed in must be a directory
-	if(inodes[pinum].type != UFS_DIRECTORY){
+	inode_t *dir = get_inode(pinum);
+	if(UFS_TYPE(dir->type) != UFS_DIRECTORY){
 		return set_ret(msg, RES_FAIL);
 	}
 
 	//Scan blocks for the file containing desired name
 	for(int i=0; i < DIRECT_PTRS; i++){
-		unsigned int data_block = inodes[pinum].direct[i];
+		unsigned int data_block = dir->direct[i];
 	
-		if(data_block >= metadata->data_region_addr && 
-		   data_block < metadata->data_region_len + metadata->data_region_addr){
-			int block = data_block - metadata->data_region_addr;
-
-			for(int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++){
-				dir_ent_t *entry = (dir_ent_t*) &data[(block * UFS_BLOCK_SIZE) + (j * sizeof(dir_ent_t))];
-				if(strcmp(name, entry->name) == 0 && entry->inum > -1){
-					return set_ret(msg, entry->inum);
+		if(block_valid(data_block)){
+			dir_ent_t *entries = (dir_ent_t*) get_block(data_block - vol->metadata->data_region_addr, 1);
+			if(!entries){
+				return set_ret(msg, RES_FAIL);
+			}
+
+			for(int j = 0; j < vol->block_size / sizeof(dir_ent_t); j++){
+				if(strcmp(name, entries[j].name) == 0 && entries[j].inum > -1){
+					int inum = entries[j].inum;
+					Cache_Put(vol->cache, (char*) entries);
+					return set_ret(msg, inum);
 				}
 			}
+			Cache_Put(vol->cache, (char*) entries);
 		}
 	}
 
@@ -125,113 +787,488 @@ void lookup(char *msg){
 	return set_ret(msg, RES_FAIL); //File with name was not found
 }
 
+/**
+ * Returns how many runs of adjacent blocks a file is stored in, 1 if it is
+ * contiguous. Holes don't break a run, the blocks on either side only need to
+ * follow each other in the image.
+ * nblocks[out] - The blocks the file has
+ */
+int file_extents(inode_t *in, int *nblocks){
+	int extents = 0;
+	unsigned int last = 0;
+	*nblocks = 0;
+	if(in->type & UFS_INLINE){
+		return 0;
+	}
+	for(int i = 0; i < DIRECT_PTRS; i++){
+		if(!block_valid(in->direct[i])){
+			continue;
+		}
+		extents += !*nblocks || in->direct[i] != last + 1;
+		last = in->direct[i];
+		(*nblocks)++;
+	}
+	return extents;
+}
+
 /**
  * Returns the stats of a file
  * msg[in] - The stat message containing opcode and inode
- * msg[out] - A buffer containing return code, type, and size
+ * msg[out] - A buffer containing return code, type, size, block size and extents
  */
 void stats(char *msg){
-	int inum = (int) msg[4];
+	int inum = *(int*) &msg[4];
 	//Verify valid inode
-	if(inum < 0 || inum > UFS_BLOCK_SIZE * metadata->inode_region_len / sizeof(inode_t)){
+	if(inum < 0 || inum > vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t)){
 		return set_ret(msg, RES_FAIL);	
 	}
 
 	//Verify inode is in use
-	if(!inode_inuse(inum)){
+	if(!view_inuse(inum)){
 		return set_ret(msg, RES_FAIL);
 	}
 	
 	set_ret(msg, 0);
-	memcpy(&msg[4], &inodes[inum].type, sizeof(int));
-	memcpy(&msg[8], &inodes[inum].size, sizeof(int));
+	inode_t *inode = get_inode(inum);
+	int type = UFS_TYPE(inode->type);
+	memcpy(&msg[4], &type, sizeof(int));
+	int size = thread_snap < 0 ? file_size(inum) : inode->size;
+	memcpy(&msg[8], &size, sizeof(int));
+	memcpy(&msg[12], &vol->block_size, sizeof(int));
+	int nblocks;
+	int extents = file_extents(inode, &nblocks);
+	memcpy(&msg[16], &extents, sizeof(int));
+}
+
+/**
+ * Starts an optimistic read of the current volume, see read_optimistic
+ * Returns the sequence number to check the read against with read_retry
+ */
+unsigned int read_begin(){
+	return __atomic_load_n(&vol->seq, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns 1 if a writer was in at any point since read_begin, what was read may be torn
+ */
+int read_retry(unsigned int seq){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (seq & 1) || __atomic_load_n(&vol->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * Lets optimistic readers know a writer holding the volume lock starts changing things
+ */
+void write_begin(){
+	__atomic_store_n(&vol->seq, vol->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Lets optimistic readers know the writer is done
+ */
+void write_end(){
+	__atomic_store_n(&vol->seq, vol->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Runs a lookup or stat of the live image without taking the volume lock.
+ * It works on a copy of the request and keeps the result only if no writer
+ * came in meanwhile. Only cached directory blocks are read.
+ * Returns 1 if msg holds the reply, 0 if the request must run under the lock
+ * msg[in] - The request
+ * msg[out] - The reply, untouched on 0
+ */
+int read_optimistic(char *msg, int op){
+	char copy[40];
+	for(int i = 0; i < READ_TRIES; i++){
+		unsigned int seq = read_begin();
+		//A writer is in, waiting for it on the lock beats spinning
+		if(seq & 1){
+			return 0;
+		}
+
+		memcpy(copy, msg, sizeof(copy));
+		thread_optimistic = 1;
+		thread_fallback = 0;
+		thread_corrupt = 0;
+		if(op == OP_LOOKUP){
+			lookup(copy);
+		}else{
+			stats(copy);
+		}
+		thread_optimistic = 0;
+		if(thread_fallback){
+			return 0;
+		}
+		if(!read_retry(seq)){
+			memcpy(msg, copy, sizeof(copy));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int block_inuse(int block){
+	return vol->data_bitmap[block / 32] >> (31 - block % 32) & 0x01;
 }
 
 /**
- * Finds a new block within the file image.
+ * Finds a new block within the file image. New blocks are zeroed so that
+ * unwritten parts of a file always read back as zeros.
  * Returns the block id or 0 if failure
  */
 unsigned int allocblock(){
+	//Blocks promised to buffered writes are not up for grabs
+	if(vol->free_blocks - vol->reserved_blocks < 1){
+		return 0;
+	}
+
 	int free = 0;
-	for(int i = 0; i < UFS_BLOCK_SIZE * metadata->data_bitmap_len / 4; i++){
+	for(int i = 0; i < vol->block_size * vol->metadata->data_bitmap_len / 4; i++){
 		for(int j = 31; j > -1; j--){
-			if(!(data_bitmap[i] >> j & 0x01)){
+			if(!(vol->data_bitmap[i] >> j & 0x01)){
 				//Found free spot
 				free = i * 32 + 31 - j;
-				data_bitmap[i] |= 1UL << j;
 				break;
 			}
 		}
 
 		if(free){
-			if(free >= metadata->data_region_len ){	
+			if(free >= vol->metadata->data_region_len ){	
 				return 0;
 			}
+			vol->data_bitmap[free / 32] |= 1UL << (31 - free % 32);
+			vol->free_blocks--;
 			break;
 		}
 	}
 
+	if(free){
+		char *buf = get_block(free, 0);
+		memset(buf, 0, vol->block_size);
+		dirty_data(free);
+		dirty_data_bitmap(free);
+		Cache_Put(vol->cache, buf);
+	}
 	return free;
 }
 
 /**
- * Helper method to append data to a file or directory
- * inode[in] - inode of file to write to
- * buffer[in] - The data to write
- * n[in] - The number of bytes to write
- * offset[in] - Number of bytes from start of file to begin writing
+ * Finds n free blocks in a row within the file image and zeroes them.
+ * Returns the id of the first block or 0 if there is no run long enough
+ * n[in] - The number of blocks needed
  */
-int writef(FILE *file, int inode, void* buffer, int n, int offset){
-	if(offset / UFS_BLOCK_SIZE >= DIRECT_PTRS){
-		return -1;
+unsigned int allocrun(int n){
+	if(vol->free_blocks - vol->reserved_blocks < n){
+		return 0;
 	}
-	
-	unsigned int block = inodes[inode].direct[offset / UFS_BLOCK_SIZE];
-	if(block == 0){
-		block = allocblock();
-		if(!block){
-			return -1;
-		}
-
-		block += metadata->data_region_addr;
-		inodes[inode].direct[offset / UFS_BLOCK_SIZE] = block;
-	}
-	block -= metadata->data_region_addr;
 
-	//Case if not all data cant fit in current block
-	if(offset % UFS_BLOCK_SIZE + n > UFS_BLOCK_SIZE){
-		int split = UFS_BLOCK_SIZE - (offset % UFS_BLOCK_SIZE + n);
-		
-		//Allocate second block
-		if(offset / UFS_BLOCK_SIZE + 1 >= DIRECT_PTRS){
-			return -1;
-		}
-		unsigned int block2 = inodes[inode].direct[offset / UFS_BLOCK_SIZE + 1];
-		if(block2 == 0){
-			block2 = allocblock();
-			if(!block2){
-				return -1;
+	int run = 0;
+	for(int b = 1; b < vol->metadata->data_region_len; b++){
+		run = block_inuse(b) ? 0 : run + 1;
+		if(run == n){
+			int first = b - n + 1;
+			for(b = first; b < first + n; b++){
+				char *buf = get_block(b, 0);
+				memset(buf, 0, vol->block_size);
+				vol->data_bitmap[b / 32] |= 1UL << (31 - b % 32);
+				dirty_data(b);
+				dirty_data_bitmap(b);
+				Cache_Put(vol->cache, buf);
 			}
-
-			block2 += metadata->data_region_addr;
-			inodes[inode].direct[offset / UFS_BLOCK_SIZE + 1] = block2;
+			vol->free_blocks -= n;
+			return first;
 		}
-		block2 -= metadata->data_region_addr;
+	}
+	return 0;
+}
 
-		
-		//Write to first block
-		memcpy(&data[block * UFS_BLOCK_SIZE + offset % UFS_BLOCK_SIZE], buffer, n + split);
-		//Write to second block
-		memcpy(&data[block2 * UFS_BLOCK_SIZE], &((char*)buffer)[n + split], -1 * split);
+/**
+ * Returns a block to the free pool
+ * block[in] - The block id, relative to the data region
+ */
+void freeblock(int block){
+	if(vol->dedup){
+		Dedup_Forget(vol->dedup, block);
+	}
+	vol->data_bitmap[block / 32] &= ~(1UL << (31 - block % 32));
+	dirty_data_bitmap(block);
+	vol->free_blocks++;
+}
 
-	//Case if all data can fit in current block
+/**
+ * Drops one holder of a data block, the block is freed once nothing holds it
+ * block[in] - The block id, relative to the data region
+ */
+void release_block(int block){
+	if(vol->refs && vol->refs[block] > 0){
+		vol->refs[block]--;
+		dirty_ref(block);
 	}else{
-		memcpy(&data[block * UFS_BLOCK_SIZE + offset % UFS_BLOCK_SIZE], buffer, n);
+		freeblock(block);
 	}
+}
 
-	//Update metadata
-	if(offset + n > inodes[inode].size){
-		inodes[inode].size = offset + n;
+/**
+ * Gives an inode the live copy of its inode table block to itself before it
+ * changes. While snapshots still read that block from the live table, it is
+ * copied out for them and the copy takes a hold on every data block its
+ * inodes point at. Must be called before an inode is changed.
+ * Returns 0 on success, -1 if no block is free for the copy
+ * inum[in] - The inode about to change
+ */
+int own_inode(int inum){
+	int k = inum / INODES_PER_BLOCK;
+	if(!vol->refs || !vol->itab_shared[k]){
+		return 0;
+	}
+
+	unsigned int copy = allocblock();
+	if(!copy){
+		return -1;
+	}
+	inode_t *table = (inode_t*)((char*)vol->inodes + (size_t) k * vol->block_size);
+	char *page = get_block(copy, 0);
+	memcpy(page, table, vol->block_size);
+	dirty_data(copy);
+	Cache_Put(vol->cache, page);
+
+	//Every snapshot reading the live block now reads the copy, which has one holder per snapshot
+	int holders = 0;
+	for(int i = 0; i < UFS_MAX_SNAPSHOTS; i++){
+		if(vol->snaps->ids[i] && snap_map(i)[k] == 0){
+			snap_map(i)[k] = copy + vol->metadata->data_region_addr;
+			dirty_snap(i);
+			holders++;
+		}
+	}
+	vol->refs[copy] = holders - 1;
+	dirty_ref(copy);
+
+	for(int i = 0; i < INODES_PER_BLOCK; i++){
+		if(table[i].type & UFS_INLINE){
+			continue;
+		}
+		for(int j = 0; j < DIRECT_PTRS; j++){
+			if(block_valid(table[i].direct[j])){
+				vol->refs[table[i].direct[j] - vol->metadata->data_region_addr]++;
+				dirty_ref(table[i].direct[j] - vol->metadata->data_region_addr);
+			}
+		}
+	}
+	vol->itab_shared[k] = 0;
+	return 0;
+}
+
+/**
+ * Returns 1 if addr is a data block some snapshot also holds
+ */
+int block_shared(unsigned int addr){
+	return vol->refs && block_valid(addr) && vol->refs[addr - vol->metadata->data_region_addr] > 0;
+}
+
+/**
+ * Gives a file block to the live image before it changes in place, copying it
+ * when snapshots still hold it. The inode must already be owned, see own_inode.
+ * Returns the block id relative to the data region, -1 if no block is free for the copy
+ * inum[in] - The file
+ * idx[in] - Index of a valid block of the file
+ */
+int own_block(int inum, int idx){
+	unsigned int block = vol->inodes[inum].direct[idx] - vol->metadata->data_region_addr;
+	if(!block_shared(vol->inodes[inum].direct[idx])){
+		return block;
+	}
+
+	unsigned int copy = allocblock();
+	if(!copy){
+		return -1;
+	}
+	char *from = get_block(block, 1);
+	char *to = get_block(copy, 0);
+	memcpy(to, from, vol->block_size);
+	dirty_data(copy);
+	Cache_Put(vol->cache, to);
+	Cache_Put(vol->cache, from);
+
+	release_block(block);
+	dirty_inode(inum);
+	vol->inodes[inum].direct[idx] = copy + vol->metadata->data_region_addr;
+	return copy;
+}
+
+/**
+ * Points a file block at a block already holding the same contents, so the
+ * data need not be written. The inode must already be owned, see own_inode.
+ * The block found takes one more holder and is copied before it changes
+ * like any shared block, see own_block.
+ * Returns 1 if the file block now shares a block, 0 if the data has to be written
+ * inum[in] - A regular file
+ * idx[in] - Index of the file block
+ * data[in] - The whole new contents of the block
+ * hash[out] - Hash of the contents, to index the block under once written
+ */
+int dedup(int inum, int idx, char *data, unsigned long *hash){
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	*hash = Dedup_Hash(data, vol->block_size);
+	int hit = Dedup_Find(vol->dedup, *hash);
+	unsigned int cur = vol->inodes[inum].direct[idx];
+	int same = 0;
+	if(hit >= 0 && block_inuse(hit) && (ufs_ref_t)(vol->refs[hit] + 1) != 0){
+		//A block that fails its checksum is no one else's business
+		int corrupt = thread_corrupt;
+		thread_corrupt = 0;
+		char *page = get_block(hit, 1);
+		same = !thread_corrupt && memcmp(page, data, vol->block_size) == 0;
+		Cache_Put(vol->cache, page);
+		thread_corrupt = corrupt;
+	}
+
+	//Rewriting a block with what it already holds changes nothing
+	if(same && cur != hit + vol->metadata->data_region_addr){
+		if(block_valid(cur)){
+			release_block(cur - vol->metadata->data_region_addr);
+		}
+		vol->refs[hit]++;
+		dirty_ref(hit);
+		vol->inodes[inum].direct[idx] = hit + vol->metadata->data_region_addr;
+		dirty_inode(inum);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	Dedup_Count(vol->dedup, same, (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec);
+	return same;
+}
+
+/**
+ * Marks every entry in a new directory block as unused
+ * block[in] - The block id, relative to the data region
+ */
+void init_dir_block(int block){
+	dir_ent_t *entries = (dir_ent_t*) get_block(block, 1);
+	for(int i = 0; i < vol->block_size / sizeof(dir_ent_t); i++){
+		entries[i].inum = -1;
+	}
+	dirty_data(block);
+	Cache_Put(vol->cache, (char*) entries);
+}
+
+/**
+ * Moves the contents of an inline file out of its inode and into a data block
+ * so the file can grow past UFS_INLINE_MAX bytes.
+ * Returns 0 on success, -1 if no block is free
+ * inum[in] - inode of the inline file
+ */
+int promote(int inum){
+	char buf[UFS_INLINE_MAX];
+	memcpy(buf, vol->inodes[inum].direct, UFS_INLINE_MAX);
+
+	unsigned int block = 0;
+	if(vol->inodes[inum].size > 0){
+		block = allocblock();
+		if(!block){
+			return -1;
+		}
+		char *page = get_block(block, 1);
+		memcpy(page, buf, vol->inodes[inum].size);
+		Cache_Put(vol->cache, page);
+		block += vol->metadata->data_region_addr;
+	}
+
+	memset(vol->inodes[inum].direct, 0, sizeof(vol->inodes[inum].direct));
+	vol->inodes[inum].direct[0] = block;
+	vol->inodes[inum].type &= ~UFS_INLINE;
+	dirty_inode(inum);
+	return 0;
+}
+
+/**
+ * Helper method to append data to a file or directory
+ * inode[in] - inode of file to write to
+ * buffer[in] - The data to write
+ * n[in] - The number of bytes to write
+ * offset[in] - Number of bytes from start of file to begin writing
+ */
+int writef(FILE *file, int inode, void* buffer, int n, int offset){
+	if(offset / vol->block_size >= DIRECT_PTRS || own_inode(inode) == -1){
+		return -1;
+	}
+	dirty_inode(inode);
+
+	//Small files are kept in the inode until they outgrow it
+	if(vol->inodes[inode].type & UFS_INLINE){
+		if(offset + n <= UFS_INLINE_MAX){
+			memcpy((char*)vol->inodes[inode].direct + offset, buffer, n);
+			if(offset + n > vol->inodes[inode].size){
+				vol->inodes[inode].size = offset + n;
+			}
+			flush_data(file);
+			return 0;
+		}
+
+		if(promote(inode) == -1){
+			return -1;
+		}
+	}
+	
+	//The whole write must fit in the file before anything is written
+	if(n > 0 && (offset + n - 1) / vol->block_size >= DIRECT_PTRS){
+		return -1;
+	}
+
+	//Copy block by block, filling in any holes the write lands on
+	for(int done = 0; done < n;){
+		int idx = (offset + done) >> vol->block_shift;
+		int off = (offset + done) & vol->block_mask;
+		int len = vol->block_size - off < n - done ? vol->block_size - off : n - done;
+
+		//Whole blocks of a file may share a block that already holds the same data
+		unsigned long hash;
+		int whole = vol->dedup && len == vol->block_size && UFS_TYPE(vol->inodes[inode].type) == UFS_REGULAR_FILE;
+		if(whole && dedup(inode, idx, &((char*)buffer)[done], &hash)){
+			done += len;
+			continue;
+		}
+
+		unsigned int block = vol->inodes[inode].direct[idx];
+		if(!block_valid(block)){
+			block = allocblock();
+			if(!block){
+				return -1;
+			}
+			if(UFS_TYPE(vol->inodes[inode].type) == UFS_DIRECTORY){
+				init_dir_block(block);
+			}
+
+			block += vol->metadata->data_region_addr;
+			vol->inodes[inode].direct[idx] = block;
+		}else{
+			//Blocks a snapshot still holds are copied before they change
+			int owned = own_block(inode, idx);
+			if(owned == -1){
+				return -1;
+			}
+			block = owned + vol->metadata->data_region_addr;
+		}
+		block -= vol->metadata->data_region_addr;
+
+		//Only a partial write needs the old contents
+		char *page = get_block(block, len < vol->block_size);
+		memcpy(&page[off], &((char*)buffer)[done], len);
+		dirty_data(block);
+		Cache_Put(vol->cache, page);
+		if(whole){
+			Dedup_Insert(vol->dedup, hash, block);
+		}
+		done += len;
+	}
+
+	//Update metadata
+	if(offset + n > vol->inodes[inode].size){
+		vol->inodes[inode].size = offset + n;
 	}
 
 	flush_data(file);
@@ -239,6 +1276,236 @@ int writef(FILE *file, int inode, void* buffer, int n, int offset){
 	return 0;
 }
 
+/**
+ * Opens the delayed allocation log and sets up the per inode write buffers
+ * Returns 0 on success, -1 if the log can't be opened
+ * path[in] - The log file
+ */
+int dalloc_init(char *path){
+	vol->wal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if(vol->wal_fd < 0){
+		fprintf(stderr, "cannot open log file\n");
+		return -1;
+	}
+
+	int num_inodes = vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t);
+	vol->pending = calloc(num_inodes, sizeof(pending_t*));
+	vol->dirty = malloc(num_inodes * sizeof(int));
+	return 0;
+}
+
+/**
+ * Buffers a write under delayed allocation. No blocks are allocated here,
+ * only reserved, the write is acknowledged once it is in the log.
+ * Returns 0 on success, -1 otherwise
+ * inum[in] - inode of file to write to
+ * buffer[in] - The data to write
+ * n[in] - The number of bytes to write
+ * offset[in] - Number of bytes from start of file to begin writing
+ * log[in] - 0 when replaying the log itself
+ */
+int dalloc_write(int inum, char *buffer, int n, int offset, int log){
+	if(n > 0 && (offset + n - 1) / vol->block_size >= DIRECT_PTRS){
+		return -1;
+	}
+
+	//Snapshots are only taken with nothing buffered, so owning the inode now covers write back
+	if(own_inode(inum) == -1){
+		return -1;
+	}
+
+	pending_t *p = vol->pending[inum];
+	int is_inline = vol->inodes[inum].type & UFS_INLINE;
+
+	//Every block this write creates a page for, and which has no block yet or shares it with a
+	//snapshot, needs one at write back. An inline file leaves its inode on write back, so its
+	//contents also need a page for block 0.
+	int need = 0;
+	int first = offset / vol->block_size;
+	int last = n > 0 ? (offset + n - 1) / vol->block_size : first - 1;
+	if(is_inline && !p && first > 0){
+		need++;
+	}
+	for(int i = first; i <= last; i++){
+		if(!(p && p->pages[i]) && (is_inline || !block_valid(vol->inodes[inum].direct[i]) || block_shared(vol->inodes[inum].direct[i]))){
+			need++;
+		}
+	}
+	if(need > vol->free_blocks - vol->reserved_blocks){
+		return -1;
+	}
+
+	//Durable once in the log
+	wal_rec_t rec = { inum, offset, n };
+	if(log && (write(vol->wal_fd, &rec, sizeof(rec)) != sizeof(rec) || write(vol->wal_fd, buffer, n) != n || fdatasync(vol->wal_fd) != 0)){
+		return -1;
+	}
+
+	if(!p){
+		p = vol->pending[inum] = calloc(1, sizeof(pending_t));
+		p->size = vol->inodes[inum].size;
+		vol->dirty[vol->ndirty++] = inum;
+		if(vol->ndirty == 1){
+			clock_gettime(CLOCK_MONOTONIC, &vol->pending_since);
+		}
+
+		if(is_inline){
+			p->pages[0] = calloc(1, vol->block_size);
+			memcpy(p->pages[0], vol->inodes[inum].direct, UFS_INLINE_MAX);
+			vol->pending_pages++;
+		}
+	}
+	vol->reserved_blocks += need;
+	p->reserved += need;
+
+	for(int done = 0; done < n;){
+		int idx = (offset + done) >> vol->block_shift;
+		int off = (offset + done) & vol->block_mask;
+		int len = vol->block_size - off < n - done ? vol->block_size - off : n - done;
+
+		if(!p->pages[idx]){
+			p->pages[idx] = calloc(1, vol->block_size);
+			if(!is_inline && block_valid(vol->inodes[inum].direct[idx])){
+				char *page = get_block(vol->inodes[inum].direct[idx] - vol->metadata->data_region_addr, 1);
+				memcpy(p->pages[idx], page, vol->block_size);
+				Cache_Put(vol->cache, page);
+			}
+			vol->pending_pages++;
+		}
+
+		memcpy(&p->pages[idx][off], &buffer[done], len);
+		done += len;
+	}
+
+	if(offset + n > p->size){
+		p->size = offset + n;
+	}
+	return 0;
+}
+
+/**
+ * Moves the buffered writes of one inode into the image. The blocks that are
+ * still holes are allocated here, as one contiguous run when one is free.
+ * inum[in] - inode with buffered writes
+ */
+void writeback(int inum){
+	pending_t *p = vol->pending[inum];
+
+	//Buffered inline files always outgrow the inode, block 0 holds the old contents
+	if(vol->inodes[inum].type & UFS_INLINE){
+		memset(vol->inodes[inum].direct, 0, sizeof(vol->inodes[inum].direct));
+		vol->inodes[inum].type &= ~UFS_INLINE;
+	}
+
+	//Pages identical to a block already in the image share it and are done with
+	unsigned long hash[DIRECT_PTRS];
+	for(int i = 0; vol->dedup && i < DIRECT_PTRS; i++){
+		if(p->pages[i] && dedup(inum, i, p->pages[i], &hash[i])){
+			free(p->pages[i]);
+			p->pages[i] = NULL;
+			vol->pending_pages--;
+		}
+	}
+
+	//Blocks a snapshot still holds are left to it and rewritten elsewhere
+	int holes = 0;
+	for(int i = 0; i < DIRECT_PTRS; i++){
+		if(p->pages[i] && block_shared(vol->inodes[inum].direct[i])){
+			release_block(vol->inodes[inum].direct[i] - vol->metadata->data_region_addr);
+			vol->inodes[inum].direct[i] = 0;
+		}
+		holes += p->pages[i] && !block_valid(vol->inodes[inum].direct[i]);
+	}
+
+	//Blocks were reserved when the writes came in, so this can't run out
+	vol->reserved_blocks -= p->reserved;
+	unsigned int run = holes ? allocrun(holes) : 0;
+	for(int i = 0; i < DIRECT_PTRS; i++){
+		if(!p->pages[i]){
+			continue;
+		}
+
+		if(!block_valid(vol->inodes[inum].direct[i])){
+			unsigned int block = run ? run++ : allocblock();
+			vol->inodes[inum].direct[i] = block + vol->metadata->data_region_addr;
+		}
+
+		char *page = get_block(vol->inodes[inum].direct[i] - vol->metadata->data_region_addr, 0);
+		memcpy(page, p->pages[i], vol->block_size);
+		dirty_data(vol->inodes[inum].direct[i] - vol->metadata->data_region_addr);
+		Cache_Put(vol->cache, page);
+		if(vol->dedup){
+			Dedup_Insert(vol->dedup, hash[i], vol->inodes[inum].direct[i] - vol->metadata->data_region_addr);
+		}
+		free(p->pages[i]);
+		vol->pending_pages--;
+	}
+
+	vol->inodes[inum].size = p->size;
+	dirty_inode(inum);
+	free(p);
+	vol->pending[inum] = NULL;
+}
+
+/**
+ * Writes back every inode with buffered writes, makes the image durable and
+ * empties the log
+ */
+void writeback_all(FILE *file){
+	for(int i = 0; i < vol->ndirty; i++){
+		writeback(vol->dirty[i]);
+	}
+	vol->ndirty = 0;
+
+	flush_data(file);
+	pthread_mutex_lock(&io_lock);
+	IO_Drain();
+	pthread_mutex_unlock(&io_lock);
+	fsync(fileno(file));
+	if(ftruncate(vol->wal_fd, 0) != 0){
+		perror("ftruncate");
+	}
+}
+
+/**
+ * Returns 1 once buffered writes should be written back even though requests keep arriving
+ */
+int writeback_due(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (now.tv_sec - vol->pending_since.tv_sec) * 1000 + (now.tv_nsec - vol->pending_since.tv_nsec) / 1000000;
+	return vol->pending_pages >= WRITEBACK_MAX_PAGES || ms >= WRITEBACK_MAX_MS;
+}
+
+/**
+ * Applies writes left in the log by a server that stopped before writing them back
+ */
+void wal_recover(FILE *file){
+	wal_rec_t rec;
+	char buf[UFS_MAX_BLOCK_SIZE];
+	int applied = 0;
+	int num_inodes = vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t);
+
+	lseek(vol->wal_fd, 0, SEEK_SET);
+	while(read(vol->wal_fd, &rec, sizeof(rec)) == sizeof(rec)){
+		//A torn record at the end was never acknowledged
+		if(rec.n < 0 || rec.n > vol->block_size || read(vol->wal_fd, buf, rec.n) != rec.n){
+			break;
+		}
+		if(rec.inum < 0 || rec.inum >= num_inodes || !inode_inuse(rec.inum) || rec.offset < 0){
+			continue;
+		}
+		if(UFS_TYPE(vol->inodes[rec.inum].type) == UFS_REGULAR_FILE && dalloc_write(rec.inum, buf, rec.n, rec.offset, 0) == 0){
+			applied++;
+		}
+	}
+
+	if(applied){
+		fprintf(stderr, "recovered %d writes from log\n", applied);
+	}
+	writeback_all(file);
+}
+
 /**
  * Writes a buffer to a file of UFS_REGULAR_FILE type
  * msg[in] - The payload
@@ -250,7 +1517,7 @@ void img_write(char *msg, FILE *file){
 	int offset = *(int*) &msg[12];
 
 	//Verify valid inode
-	if(inum < 0 || inum > UFS_BLOCK_SIZE * metadata->inode_region_len / sizeof(inode_t)){
+	if(inum < 0 || inum > vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t)){
 		return set_ret(msg, RES_FAIL);	
 	}
 
@@ -260,20 +1527,37 @@ void img_write(char *msg, FILE *file){
 	}
 
 	//Inode passed in must be a regular file
-	if(inodes[inum].type != UFS_REGULAR_FILE){
+	if(UFS_TYPE(vol->inodes[inum].type) != UFS_REGULAR_FILE){
 		return set_ret(msg, RES_FAIL);
 	}
 
-	//Max byte size == 4096
-	if(bytes > 4096){
+	//Max byte size is one block
+	if(bytes > vol->block_size){
 		return set_ret(msg, RES_FAIL);
 	}
 
-	//Offset cant be nagative or greater than file size
-	if(offset < 0 || offset > inodes[inum].size){
+	//Offset cant be nagative, writing past the end of file leaves a hole
+	if(offset < 0 || bytes < 0){
 		return set_ret(msg, RES_FAIL);
 	}
 
+	//Under delayed allocation buffer anything that would need blocks
+	if(vol->wal_fd >= 0 && (vol->pending[inum] || !(vol->inodes[inum].type & UFS_INLINE) || offset + bytes > UFS_INLINE_MAX)){
+		int rc = dalloc_write(inum, &msg[16], bytes, offset, 1);
+		//Buffered pages reserve a block each, which pages that dedup may not need, so settle them and try again
+		if(rc == -1 && vol->dedup && vol->ndirty){
+			writeback_all(file);
+			rc = dalloc_write(inum, &msg[16], bytes, offset, 1);
+		}
+		if(rc == -1){
+			return set_ret(msg, RES_FAIL);
+		}
+		if(vol->pending_pages >= WRITEBACK_MAX_PAGES){
+			writeback_all(file);
+		}
+		return set_ret(msg, 0);
+	}
+
 	if(writef(file, inum, &msg[16], bytes, offset) == -1){
 		return set_ret(msg, RES_FAIL);
 	}else{
@@ -282,16 +1566,42 @@ void img_write(char *msg, FILE *file){
 }
 
 /**
- * Reads n bytes from file at byte offset
- * msg[in] - The message payload
+ * Writes a buffer at the end of a regular file. The size is taken and the
+ * write made under the write lock of the volume, so concurrent appends never overlap.
+ * msg[in] - The message payload: opcode, inode, length, unused, data
+ * msg[out] - The offset the data was written at or -1 if failure
+ * file[in] - The file to write to
+ */
+void img_append(char *msg, FILE *file){
+	int inum = *(int*) &msg[4];
+
+	//Verify valid inode before looking at its size, img_write checks the rest
+	if(inum < 0 || inum > vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t) || !inode_inuse(inum)){
+		return set_ret(msg, RES_FAIL);
+	}
+
+	int offset = file_size(inum);
+	memcpy(&msg[12], &offset, sizeof(int));
+	img_write(msg, file);
+	if(*(int*) &msg[0] == 0){
+		set_ret(msg, offset);
+	}
+}
+
+/**
+ * Reserves blocks for a byte range of a regular file so later writes to it
+ * never need to allocate. The holes in the range are filled from a single
+ * contiguous run when one is free. The file grows to cover the range.
+ * msg[in] - The message payload: opcode, inode, length, offset
+ * file[in] - The file to write to
  */
-void img_read(char *msg){
+void img_fallocate(char *msg, FILE *file){
 	int inum = *(int*) &msg[4];
 	int bytes = *(int*) &msg[8];
 	int offset = *(int*) &msg[12];
 
 	//Verify valid inode
-	if(inum < 0 || inum > UFS_BLOCK_SIZE * metadata->inode_region_len / sizeof(inode_t)){
+	if(inum < 0 || inum > vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t)){
 		return set_ret(msg, RES_FAIL);	
 	}
 
@@ -301,41 +1611,188 @@ void img_read(char *msg){
 	}
 
 	//Inode passed in must be a regular file
-	if(inodes[inum].type != UFS_REGULAR_FILE){
+	if(UFS_TYPE(vol->inodes[inum].type) != UFS_REGULAR_FILE){
+		return set_ret(msg, RES_FAIL);
+	}
+
+	//Range must be non empty and fit within the max file size
+	if(offset < 0 || bytes <= 0 || (offset + bytes - 1) / vol->block_size >= DIRECT_PTRS){
+		return set_ret(msg, RES_FAIL);
+	}
+
+	//Settle buffered writes first so the range is allocated against the real layout
+	if(vol->pending && vol->pending[inum]){
+		writeback_all(file);
+	}
+
+	if(own_inode(inum) == -1){
+		return set_ret(msg, RES_FAIL);
+	}
+
+	//Ranges that still fit inline have nothing to reserve
+	if(vol->inodes[inum].type & UFS_INLINE && offset + bytes > UFS_INLINE_MAX){
+		if(promote(inum) == -1){
+			return set_ret(msg, RES_FAIL);
+		}
+	}
+
+	if(!(vol->inodes[inum].type & UFS_INLINE)){
+		int first = offset / vol->block_size;
+		int last = (offset + bytes - 1) / vol->block_size;
+
+		int holes = 0;
+		for(int i = first; i <= last; i++){
+			holes += !block_valid(vol->inodes[inum].direct[i]);
+		}
+
+		//Prefer one contiguous run, otherwise take whatever blocks are free
+		unsigned int run = holes ? allocrun(holes) : 0;
+		int taken[DIRECT_PTRS];
+		int ntaken = 0;
+		for(int i = first; i <= last; i++){
+			if(block_valid(vol->inodes[inum].direct[i])){
+				continue;
+			}
+
+			unsigned int block = run ? run++ : allocblock();
+			if(!block){
+				//Out of space, give back what this call took
+				for(int j = 0; j < ntaken; j++){
+					freeblock(vol->inodes[inum].direct[taken[j]] - vol->metadata->data_region_addr);
+					vol->inodes[inum].direct[taken[j]] = 0;
+				}
+				return set_ret(msg, RES_FAIL);
+			}
+			vol->inodes[inum].direct[i] = block + vol->metadata->data_region_addr;
+			taken[ntaken++] = i;
+		}
+	}
+
+	if(offset + bytes > vol->inodes[inum].size){
+		vol->inodes[inum].size = offset + bytes;
+	}
+	dirty_inode(inum);
+
+	flush_data(file);
+	return set_ret(msg, 0);
+}
+
+/**
+ * Reads n bytes from file at byte offset. Nothing is copied, the reply is
+ * the return code followed by pointers into the cached blocks, buffered pages
+ * or inode holding the data.
+ * msg[in] - The message payload
+ * msg[out] - The return code
+ * r[out] - What to send, the return code alone on failure
+ */
+void img_read(char *msg, read_reply_t *r){
+	r->iov[0].iov_base = msg;
+	r->iov[0].iov_len = sizeof(int);
+	r->iovcnt = 1;
+	r->npinned = 0;
+
+	int inum = *(int*) &msg[4];
+	int bytes = *(int*) &msg[8];
+	int offset = *(int*) &msg[12];
+
+	//Verify valid inode
+	if(inum < 0 || inum > vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t)){
+		return set_ret(msg, RES_FAIL);	
+	}
+
+	//Verify inode is in use
+	if(!view_inuse(inum)){
+		return set_ret(msg, RES_FAIL);
+	}
+
+	//Inode passed in must be a regular file
+	inode_t *inode = get_inode(inum);
+	if(UFS_TYPE(inode->type) != UFS_REGULAR_FILE){
 		return set_ret(msg, RES_FAIL);
 	}
 
-	//Max byte size == 4096
-	if(bytes > 4096){
+	//Max byte size is one block
+	if(bytes > vol->block_size || bytes < 0){
 		return set_ret(msg, RES_FAIL);
 	}
 
 	//Offset cant be nagative or greater than file size
-	if(offset < 0 || offset > inodes[inum].size || offset + bytes > inodes[inum].size){
+	int size = thread_snap < 0 ? file_size(inum) : inode->size;
+	if(offset < 0 || offset > size || offset + bytes > size){
 		return set_ret(msg, RES_FAIL);
 	}
 
-	unsigned int block = inodes[inum].direct[offset / UFS_BLOCK_SIZE] - metadata->data_region_addr;
-	if(offset % UFS_BLOCK_SIZE + bytes > UFS_BLOCK_SIZE){ //Case if we need to do a split read
-		int split = UFS_BLOCK_SIZE - (offset % UFS_BLOCK_SIZE + bytes);
-		int addr = block * UFS_BLOCK_SIZE + offset % UFS_BLOCK_SIZE;
-		memcpy(&msg[4], &data[addr], bytes + split);
-		memcpy(&msg[4 + bytes + split], &data[addr+bytes+split], -1 * split);
-	} else { //Case if we can read in one go
-		memcpy(&msg[4], &data[block * UFS_BLOCK_SIZE + offset % UFS_BLOCK_SIZE], bytes);
+	//Inline files are read straight out of the inode
+	if(inode->type & UFS_INLINE && !pending_page(inum, 0)){
+		r->iov[1].iov_base = (char*)inode->direct + offset;
+		r->iov[1].iov_len = bytes;
+		r->iovcnt = 2;
+		return set_ret(msg, 0);
+	}
+
+	//A read may span two blocks and holes read as zeros
+	for(int done = 0; done < bytes;){
+		int idx = (offset + done) >> vol->block_shift;
+		int off = (offset + done) & vol->block_mask;
+		int len = vol->block_size - off < bytes - done ? vol->block_size - off : bytes - done;
+
+		unsigned int block = inode->direct[idx];
+		char *page = pending_page(inum, idx);
+		if(!page && !(inode->type & UFS_INLINE) && block_valid(block)){
+			//Stays pinned until the reply is sent
+			page = get_block(block - vol->metadata->data_region_addr, 1);
+			r->pinned[r->npinned++] = page;
+		}else if(!page){
+			page = zeros;
+		}
+
+		r->iov[r->iovcnt].iov_base = &page[off];
+		r->iov[r->iovcnt].iov_len = len;
+		r->iovcnt++;
+		done += len;
 	}
 
 	return set_ret(msg, 0);
 }
 
+/**
+ * Sends a read reply and unpins its blocks. A reply that has to wait for a
+ * flush is copied into msg and held back like any other.
+ * seq[in] - The flush the request depends on
+ */
+void reply_read(int sd, struct sockaddr_in *addr, char *msg, read_reply_t *r, unsigned long seq){
+	pthread_mutex_lock(&io_lock);
+	int now = seq <= completed_seq && !flush_failed(seq);
+	pthread_mutex_unlock(&io_lock);
+
+	//Compressed replies are packed from one buffer, so they take the copy
+	if(now && !(*(int*) &msg[MFS_FLAGS] & MFS_FLAG_LZ)){
+		//The request id and the rest of the trailer follow the data, see LZ_Expand
+		r->iov[r->iovcnt].iov_base = &msg[MFS_REQ_ID];
+		r->iov[r->iovcnt].iov_len = MFS_TRAILER;
+		UDP_WriteV(sd, addr, r->iov, r->iovcnt + 1);
+	}else{
+		char *p = &msg[sizeof(int)];
+		for(int i = 1; i < r->iovcnt; i++){
+			memcpy(p, r->iov[i].iov_base, r->iov[i].iov_len);
+			p += r->iov[i].iov_len;
+		}
+		reply(sd, addr, msg, seq, p - msg);
+	}
+
+	for(int i = 0; i < r->npinned; i++){
+		Cache_Put(vol->cache, r->pinned[i]);
+	}
+}
+
 /**
  * Creates a new file or directory
  * msg[in] - The message payload
  * file[in] - The file to write to
  */
 void img_creat(char *msg, FILE *file){
-	int pinum = (int) msg[4];
-	int type = (int) msg[8];
+	int pinum = *(int*) &msg[4];
+	int type = *(int*) &msg[8];
 
 	char buffer[37];
 	memcpy(&buffer[4], &pinum, 4);
@@ -351,15 +1808,17 @@ void img_creat(char *msg, FILE *file){
 	}
 
 	//Parent inode must be a directory
-	if(inodes[pinum].type != UFS_DIRECTORY){
+	if(UFS_TYPE(vol->inodes[pinum].type) != UFS_DIRECTORY){
 		return set_ret(msg, RES_FAIL);
 	}
 
 	//Scan inode bitmap looking for free inode
+	//The bitmap is sized in whole blocks, so it has bits past the end of the inode table
 	int free = -1;
-	for(int i = 0; i < UFS_BLOCK_SIZE * metadata->inode_bitmap_len / 4; i++){
-		for(int j = 31; j > 0; j--){
-			if(!(inode_bitmap[i] >> j & 0x01)){
+	int num_inodes = vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t);
+	for(int i = 0; i < vol->block_size * vol->metadata->inode_bitmap_len / 4; i++){
+		for(int j = 31; j > -1; j--){
+			if(!(vol->inode_bitmap[i] >> j & 0x01)){
 				//Found free spot
 				free = i * 32 + 31 - j;
 				break;
@@ -371,13 +1830,25 @@ void img_creat(char *msg, FILE *file){
 		}
 	}
 	
-	if(free < 0){
+	if(free < 0 || free >= num_inodes){
 		return set_ret(msg, RES_FAIL);
 	}
 
-	//If type directory we must populate with default entries "." and ".."
-	if(type == UFS_DIRECTORY){
-		dir_ent_t entry;
+	if(own_inode(free) == -1){
+		return set_ret(msg, RES_FAIL);
+	}
+
+	//Start from a clean inode, new regular files begin inline
+	memset(&vol->inodes[free], 0, sizeof(inode_t));
+	vol->inodes[free].type = type;
+	if(type == UFS_REGULAR_FILE){
+		vol->inodes[free].type |= UFS_INLINE;
+	}
+	dirty_inode(free);
+
+	//If type directory we must populate with default entries "." and ".."
+	if(type == UFS_DIRECTORY){
+		dir_ent_t entry;
 		entry.inum = free; // current directory
 		strcpy(entry.name, ".");
 		if(writef(file, free, &entry, sizeof(dir_ent_t), 0) == -1){ return set_ret(msg, RES_FAIL); }
@@ -385,12 +1856,7 @@ void img_creat(char *msg, FILE *file){
 		entry.inum = pinum; // parent directory
 		strcpy(entry.name, "..");
 		if(writef(file, free, &entry, sizeof(dir_ent_t), sizeof(dir_ent_t)) == -1){ return set_ret(msg, RES_FAIL); }
-
-		//Initialize remaining directory entries to -1 (free)
-		entry.inum = -1;
-		for(int i = 2*sizeof(dir_ent_t); i < UFS_BLOCK_SIZE; i+=sizeof(dir_ent_t)){
-			memcpy(&data[free * UFS_BLOCK_SIZE + i], &entry, sizeof(dir_ent_t));
-		}
+		//Remaining entries were marked free when writef allocated the block
 	}
 	
 	//Update parent directory
@@ -401,16 +1867,16 @@ void img_creat(char *msg, FILE *file){
 	//Find free entry in parent directory
 	int offset = 0;
 	for(int i = 0; i < DIRECT_PTRS; i++){
-		int data_block = inodes[pinum].direct[i];
-		if(data_block >= metadata->data_region_addr && 
-		   data_block < metadata->data_region_len + metadata->data_region_addr){
-			data_block -= metadata->data_region_addr;
-			for(int j = 0; j < UFS_BLOCK_SIZE / sizeof(dir_ent_t); j++){
-				if(((dir_ent_t*)&data[data_block * UFS_BLOCK_SIZE + j * sizeof(dir_ent_t)])->inum == -1){
-					offset = i * UFS_BLOCK_SIZE + j * sizeof(dir_ent_t);
+		int data_block = vol->inodes[pinum].direct[i];
+		if(block_valid(data_block)){
+			dir_ent_t *entries = (dir_ent_t*) get_block(data_block - vol->metadata->data_region_addr, 1);
+			for(int j = 0; j < vol->block_size / sizeof(dir_ent_t); j++){
+				if(entries[j].inum == -1){
+					offset = i * vol->block_size + j * sizeof(dir_ent_t);
 					break;
 				}
 			}
+			Cache_Put(vol->cache, (char*) entries);
 		}
 		if(offset){
 			break;
@@ -418,16 +1884,13 @@ void img_creat(char *msg, FILE *file){
 	}
 
 	if(!offset){
-		offset = inodes[pinum].size;
+		offset = vol->inodes[pinum].size;
 	}
 
 	if(writef(file, pinum, &entry, sizeof(dir_ent_t), offset) == 0){
-		//Initialize inode
-		inodes[free].type = type;
-		if(type == UFS_REGULAR_FILE){
-			inodes[free].size = 0;
-		}
-		inode_bitmap[free / 32] |= 1UL << (31 - free % 32);
+		//Mark inode in use
+		vol->inode_bitmap[free / 32] |= 1UL << (31 - free % 32);
+		dirty_inode_bitmap(free);
 		flush_data(file);
 		return set_ret(msg, 0);
 	}
@@ -441,7 +1904,7 @@ void img_creat(char *msg, FILE *file){
  * msg[in] - The message payload
  */
 void img_unlink(char *msg, FILE *file){
-	int pinum = (int) msg[4];
+	int pinum = *(int*) &msg[4];
 
 	char buffer[37];
 	memcpy(&buffer[4], &pinum, 4);
@@ -457,36 +1920,73 @@ void img_unlink(char *msg, FILE *file){
 
 	//Can't delete non-empty directory
 	int fd = *(int *) &buffer[0];
-	if(inodes[fd].type == UFS_DIRECTORY && inodes[fd].size > 2 * sizeof(dir_ent_t)){
+	if(UFS_TYPE(vol->inodes[fd].type) == UFS_DIRECTORY && vol->inodes[fd].size > 2 * sizeof(dir_ent_t)){
 		return set_ret(msg, RES_FAIL);
 	}
 
-	//free inode
-	inode_bitmap[fd / 32] &= ~(1UL << (31 - fd % 32));
+	//Settle buffered writes so the log never refers to a freed inode
+	if(vol->pending && vol->pending[fd]){
+		writeback_all(file);
+	}
 
-	//Free all allocated memory blocks
-	for(int i = 0; i < inodes[fd].size / 4096; i++){
-		int block = inodes[fd].direct[i] - metadata->data_region_addr;
-		data_bitmap[block / 32] &= ~(1UL << (31 - block % 32));
+	//Find the entry first so a parent block held by a snapshot is copied before anything changes
+	int slot = -1;
+	for(int i = 0; i < vol->inodes[pinum].size / vol->block_size + 1 && i < DIRECT_PTRS && slot < 0; i++){
+		if(!block_valid(vol->inodes[pinum].direct[i])){
+			continue;
+		}
+		dir_ent_t *entries = (dir_ent_t*) get_block(vol->inodes[pinum].direct[i] - vol->metadata->data_region_addr, 1);
+		for(int j = 0; j < vol->block_size / sizeof(dir_ent_t); j++){
+			if(entries[j].inum == fd){
+				slot = i;
+				break;
+			}
+		}
+		Cache_Put(vol->cache, (char*) entries);
+	}
+	if(own_inode(fd) == -1 || own_inode(pinum) == -1 || (slot >= 0 && own_block(pinum, slot) == -1)){
+		return set_ret(msg, RES_FAIL);
 	}
 
-	//set file size to 0
-	inodes[fd].size = 0;
+	//free inode
+	vol->inode_bitmap[fd / 32] &= ~(1UL << (31 - fd % 32));
+	dirty_inode_bitmap(fd);
+
+	//Free all allocated memory blocks, inline files don't own any
+	if(!(vol->inodes[fd].type & UFS_INLINE)){
+		for(int i = 0; i < DIRECT_PTRS && i * vol->block_size < vol->inodes[fd].size; i++){
+			if(block_valid(vol->inodes[fd].direct[i])){
+				release_block(vol->inodes[fd].direct[i] - vol->metadata->data_region_addr);
+			}
+		}
+	}
+
+	//set file size to 0 and drop the block pointers
+	vol->inodes[fd].size = 0;
+	memset(vol->inodes[fd].direct, 0, sizeof(vol->inodes[fd].direct));
+	dirty_inode(fd);
 
 	//Clear entry in parent directory
-	for(int i = 0; i < inodes[pinum].size / 4096 + 1; i++){
-		int block = inodes[pinum].direct[i] - metadata->data_region_addr;
-		for(int j = 0; j < UFS_BLOCK_SIZE; j += sizeof(dir_ent_t)){
-			dir_ent_t* entry = (dir_ent_t*) &data[block * UFS_BLOCK_SIZE + j];
+	for(int i = 0; i < vol->inodes[pinum].size / vol->block_size + 1 && i < DIRECT_PTRS; i++){
+		if(!block_valid(vol->inodes[pinum].direct[i])){
+			continue;
+		}
+		int block = vol->inodes[pinum].direct[i] - vol->metadata->data_region_addr;
+		char *buf = get_block(block, 1);
+		for(int j = 0; j < vol->block_size; j += sizeof(dir_ent_t)){
+			dir_ent_t* entry = (dir_ent_t*) &buf[j];
 			if(entry->inum == fd){
 				entry->inum = -1;
+				dirty_data(block);
 				
 				//Update size if needed
-				if(i * UFS_BLOCK_SIZE + j == inodes[pinum].size - sizeof(dir_ent_t)){
-					inodes[pinum].size -= sizeof(dir_ent_t);
+				if(i * vol->block_size + j == vol->inodes[pinum].size - sizeof(dir_ent_t)){
+					vol->inodes[pinum].size -= sizeof(dir_ent_t);
+					dirty_inode(pinum);
 				}
 			}
 		}
+		Cache_Put(vol->cache, buf);
 	}
 
 	flush_data(file);
@@ -494,70 +1994,1063 @@ void img_unlink(char *msg, FILE *file){
 }
 
 /**
- * Updates all disk data and closes file. Server exits after sending return code
+ * Returns the slot of a snapshot, -1 if there is none with that id
+ * id[in] - The snapshot id, 0 finds a free slot
  */
-void terminate(FILE *file){
+int snap_slot(int id){
+	for(int i = 0; vol->refs && i < UFS_MAX_SNAPSHOTS; i++){
+		if(vol->snaps->ids[i] == id){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Takes a snapshot of the image. Nothing is copied, the snapshot reads the live
+ * inode table until an inode changes, see own_inode.
+ * msg[out] - The id of the new snapshot or -1 if failure
+ * file[in] - The image
+ */
+void img_snapshot(char *msg, FILE *file){
+	int slot = snap_slot(0);
+	if(slot < 0){
+		return set_ret(msg, RES_FAIL);
+	}
+
+	//Buffered writes are acknowledged, so they belong in the snapshot
+	if(vol->pending && vol->ndirty){
+		writeback_all(file);
+	}
+
+	int id = vol->snaps->next_id++;
+	vol->snaps->ids[slot] = id;
+	memset(snap_map(slot), 0, (size_t) vol->map_len * vol->block_size);
+	if(vol->map_bits){
+		memcpy(snap_bitmap(slot), vol->inode_bitmap, (size_t) vol->metadata->inode_bitmap_len * vol->block_size);
+	}
+	memset(vol->itab_shared, 1, vol->metadata->inode_region_len);
+	dirty_snap(slot);
+
 	flush_data(file);
-	close(fileno(file));
+	return set_ret(msg, id);
 }
 
-// server code
-int main(int argc, char *argv[]) {
-	if(argc != 3){
-		fprintf(stderr, "An error has occured\n");
-		exit(1);
+/**
+ * Deletes a snapshot. Blocks it was the last holder of are freed.
+ * msg[in] - The message payload: opcode, snapshot id
+ * file[in] - The image
+ */
+void img_snapdel(char *msg, FILE *file){
+	int id = *(int*) &msg[4];
+	int slot = id ? snap_slot(id) : -1;
+	if(slot < 0){
+		return set_ret(msg, RES_FAIL);
 	}
 
-	if(access(argv[2], F_OK | R_OK | W_OK) == -1){
-		fprintf(stderr, "image does not exist\n");
-		exit(1);
+	unsigned int *map = snap_map(slot);
+	for(int k = 0; k < vol->metadata->inode_region_len; k++){
+		if(!map[k]){
+			continue;
+		}
+		int copy = map[k] - vol->metadata->data_region_addr;
+		map[k] = 0;
+		if(vol->refs[copy] > 0){
+			vol->refs[copy]--;
+			dirty_ref(copy);
+			continue;
+		}
+
+		//Last holder of the inode table copy, so it lets go of the blocks its inodes point at
+		inode_t *table = (inode_t*) get_block(copy, 1);
+		for(int i = 0; i < INODES_PER_BLOCK; i++){
+			if(table[i].type & UFS_INLINE){
+				continue;
+			}
+			for(int j = 0; j < DIRECT_PTRS; j++){
+				if(block_valid(table[i].direct[j])){
+					release_block(table[i].direct[j] - vol->metadata->data_region_addr);
+				}
+			}
+		}
+		Cache_Put(vol->cache, (char*) table);
+		freeblock(copy);
 	}
+	vol->snaps->ids[slot] = 0;
+	dirty_snap(slot);
 
-	int port = atoi(argv[1]);
-	FILE *fimg;
-	load_image(argv[2], &fimg);
-
-    int sd = UDP_Open(port);
-    assert(sd > -1);
-
-    while (1) {
-		struct sockaddr_in addr;
-		char msg[BUFFER_SIZE];
-		//printf("server:: waiting...\n");
-		UDP_Read(sd, &addr, msg, BUFFER_SIZE);
-		
-		int op;
-		memcpy(&op, &msg[0], 4);
-		switch((const int)op){
-			case OP_LOOKUP:
-				lookup(msg);
+	memset(vol->itab_shared, 0, vol->metadata->inode_region_len);
+	for(int i = 0; i < UFS_MAX_SNAPSHOTS; i++){
+		for(int k = 0; vol->snaps->ids[i] && k < vol->metadata->inode_region_len; k++){
+			vol->itab_shared[k] |= snap_map(i)[k] == 0;
+		}
+	}
+
+	flush_data(file);
+	return set_ret(msg, 0);
+}
+
+/**
+ * Releases what a volume holds in memory and closes its files. Its dirty
+ * blocks must have been written back and its writes be on disk.
+ */
+void volume_free(volume_t *v){
+	if(v->cache){
+		Cache_Close(v->cache);
+	}
+	if(v->dedup){
+		Dedup_Close(v->dedup);
+	}
+	if(v->wal_fd >= 0){
+		close(v->wal_fd);
+	}
+	if(v->img_fd >= 0 && v->img_fd != fileno(v->fimg)){
+		close(v->img_fd);
+	}
+	if(v->fimg){
+		fclose(v->fimg);
+	}
+	free(v->metadata);
+	free(v->inode_bitmap);
+	free(v->data_bitmap);
+	free(v->inodes);
+	free(v->refs);
+	free(v->snaps);
+	free(v->itab_shared);
+	free(v->csums);
+	free(v->bad_map);
+	free(v->dirty_map);
+	free(v->inflight_map);
+	free(v->dirty_blocks);
+	free(v->pending);
+	free(v->dirty);
+
+	memset(&v->fimg, 0, sizeof(volume_t) - offsetof(volume_t, fimg));
+	v->img_fd = -1;
+	v->wal_fd = -1;
+}
+
+/**
+ * Makes a volume resident: loads its image and checks its metadata, sets up
+ * its cache and dedup index and applies what its log still holds.
+ * Called with vol_lock held.
+ * Returns 0 on success, -1 if the image can't be served
+ */
+int volume_load(volume_t *v){
+	vol = v;
+	if(load_image(v->path, &v->fimg) == -1 || (v->csums && check_meta(v->fimg) == -1)){
+		volume_free(v);
+		return -1;
+	}
+
+	//-c is for the whole process, shared evenly by the volumes that can be in memory at once.
+	//The cache never needs more frames than there are data blocks.
+	int shares = max_resident && max_resident < nvolumes ? max_resident : nvolumes;
+	long frames = cache_mb * (1 << 20) / shares / v->block_size;
+	if(frames > v->metadata->data_region_len){
+		frames = v->metadata->data_region_len;
+	}
+	v->cache = Cache_Init(v->img_fd, frames, v->block_size, cache_full, v->csums ? verify_block : NULL, v);
+	if(!v->cache){
+		fprintf(stderr, "cannot allocate buffer cache\n");
+		volume_free(v);
+		return -1;
+	}
+
+	//Shared blocks are counted in the reference count region, which older images lack
+	if(dedup_on && !v->refs){
+		fprintf(stderr, "%s has no reference counts, dedup unavailable\n", v->path);
+	}else if(dedup_on && !(v->dedup = Dedup_Init(v->metadata->data_region_len))){
+		fprintf(stderr, "cannot allocate dedup index\n");
+		volume_free(v);
+		return -1;
+	}
+
+	if(v->wal_path){
+		if(dalloc_init(v->wal_path) == -1){
+			volume_free(v);
+			return -1;
+		}
+		wal_recover(v->fimg);
+	}
+
+	//Requests that don't take vol_lock may use it from here on, see vol_get
+	__atomic_store_n(&v->resident, 1, __ATOMIC_SEQ_CST);
+	nresident++;
+	return 0;
+}
+
+/**
+ * Writes back everything a volume has changed and drops it from memory,
+ * unless a request is using it. Called with vol_lock held.
+ * Returns 1 if the volume was unloaded, 0 if it is in use
+ */
+int volume_unload(volume_t *v){
+	//Requests count themselves in before they look at resident, so either they see it
+	//cleared and go through vol_lock or it sees them and leaves the volume alone
+	__atomic_store_n(&v->resident, 0, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&v->users, __ATOMIC_SEQ_CST)){
+		__atomic_store_n(&v->resident, 1, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+
+	vol = v;
+	if(v->wal_fd >= 0){
+		writeback_all(v->fimg);
+	}
+	flush_data(v->fimg);
+	//Completions hold on to the cache and the maps of the volume
+	pthread_mutex_lock(&io_lock);
+	IO_Drain();
+	send_replies();
+	pthread_mutex_unlock(&io_lock);
+
+	volume_free(v);
+	nresident--;
+	return 1;
+}
+
+/**
+ * Returns the monotonic clock in ms
+ */
+long now_ms(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Evicts the resident volume that has waited longest for a request, unless
+ * every one of them is in use. Called with vol_lock held.
+ */
+void evict_lru(){
+	volume_t *lru = NULL;
+	for(int i = 0; i < nvolumes; i++){
+		volume_t *v = &volumes[i];
+		if(v->resident && !v->users && (!lru || v->last_used < lru->last_used)){
+			lru = v;
+		}
+	}
+	if(lru){
+		volume_unload(lru);
+	}
+}
+
+/**
+ * Evicts the volumes no request has used for VOLUME_IDLE_MS
+ */
+void evict_idle(){
+	pthread_mutex_lock(&vol_lock);
+	for(int i = 0; i < nvolumes; i++){
+		volume_t *v = &volumes[i];
+		if(v->resident && !v->users && now_ms() - v->last_used >= VOLUME_IDLE_MS){
+			volume_unload(v);
+		}
+	}
+	pthread_mutex_unlock(&vol_lock);
+}
+
+/**
+ * Returns a volume for the current request, loading it if it is not resident.
+ * Every call must be matched by a vol_put once the request is done with it.
+ * Returns NULL if there is no such volume or it can't be loaded
+ * id[in] - The volume id of the request, see MFS_VOLUME
+ */
+volume_t *vol_get(int id){
+	if(id < 0 || id >= nvolumes){
+		return NULL;
+	}
+
+	volume_t *v = &volumes[id];
+	//A resident volume is only counted in, see volume_unload for the other side
+	__atomic_add_fetch(&v->users, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&v->resident, __ATOMIC_SEQ_CST)){
+		__atomic_store_n(&v->last_used, now_ms(), __ATOMIC_RELAXED);
+		return v;
+	}
+	__atomic_sub_fetch(&v->users, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&vol_lock);
+	//Loads are rare, requests for other volumes wait for them rather than race them
+	if(!v->resident){
+		if(max_resident && nresident >= max_resident){
+			evict_lru();
+		}
+		if(volume_load(v) == -1){
+			pthread_mutex_unlock(&vol_lock);
+			return NULL;
+		}
+	}
+	__atomic_add_fetch(&v->users, 1, __ATOMIC_SEQ_CST);
+	v->last_used = now_ms();
+	pthread_mutex_unlock(&vol_lock);
+	return v;
+}
+
+/**
+ * Lets go of a volume returned by vol_get
+ */
+void vol_put(volume_t *v){
+	__atomic_sub_fetch(&v->users, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns 1 if a resident volume has writes buffered by delayed allocation
+ */
+int any_buffered(){
+	int buffered = 0;
+	pthread_mutex_lock(&vol_lock);
+	for(int i = 0; i < nvolumes && !buffered; i++){
+		volume_t *v = &volumes[i];
+		if(v->resident && v->wal_fd >= 0){
+			pthread_rwlock_rdlock(&v->lock);
+			buffered = v->ndirty > 0;
+			pthread_rwlock_unlock(&v->lock);
+		}
+	}
+	pthread_mutex_unlock(&vol_lock);
+	return buffered;
+}
+
+/**
+ * Writes back the buffered writes of every resident volume that is due
+ * idle[in] - 1 once requests stopped arriving, everything buffered is due
+ */
+void writeback_idle(int idle){
+	pthread_mutex_lock(&vol_lock);
+	for(int i = 0; i < nvolumes; i++){
+		volume_t *v = &volumes[i];
+		if(!v->resident || v->wal_fd < 0){
+			continue;
+		}
+		pthread_rwlock_wrlock(&v->lock);
+		vol = v;
+		if(v->ndirty && (idle || writeback_due())){
+			write_begin();
+			writeback_all(v->fimg);
+			write_end();
+		}
+		pthread_rwlock_unlock(&v->lock);
+	}
+	pthread_mutex_unlock(&vol_lock);
+}
+
+/**
+ * Returns how fragmented the files of the current volume are: the runs past
+ * the first of every file, over the most there could be. 0 when every file is
+ * contiguous, 1 when no two blocks of any file are adjacent.
+ */
+double frag_score(){
+	long extra = 0, most = 0;
+	int ninodes = vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t);
+	for(int inum = 0; inum < ninodes; inum++){
+		int nblocks;
+		int extents = inode_inuse(inum) ? file_extents(&vol->inodes[inum], &nblocks) : 0;
+		if(extents){
+			extra += extents - 1;
+			most += nblocks - 1;
+		}
+	}
+	return most ? (double) extra / most : 0;
+}
+
+/**
+ * Moves the blocks of a fragmented file into one run of free blocks. The copies
+ * are made first and the pointers switched after, all under the volume lock, so
+ * requests see the file either where it was or where it went.
+ * Files sharing blocks with a snapshot or through dedup are left alone, moving
+ * them would split what is shared. So are files with writes still buffered.
+ * Returns the blocks moved, 0 if the file was left where it is
+ * inum[in] - An inode in use
+ */
+int defrag_file(int inum){
+	inode_t *in = &vol->inodes[inum];
+	if((vol->pending && vol->pending[inum]) || (vol->refs && vol->itab_shared[inum / INODES_PER_BLOCK])){
+		return 0;
+	}
+	int idx[DIRECT_PTRS];
+	int n = 0;
+	for(int i = 0; i < DIRECT_PTRS; i++){
+		if(block_valid(in->direct[i])){
+			if(block_shared(in->direct[i])){
+				return 0;
+			}
+			idx[n++] = i;
+		}
+	}
+
+	unsigned int first = allocrun(n);
+	if(!first){
+		return 0;
+	}
+	thread_corrupt = 0;
+	for(int k = 0; k < n; k++){
+		char *from = get_block(in->direct[idx[k]] - vol->metadata->data_region_addr, 1);
+		char *to = get_block(first + k, 0);
+		memcpy(to, from, vol->block_size);
+		dirty_data(first + k);
+		Cache_Put(vol->cache, to);
+		Cache_Put(vol->cache, from);
+	}
+	//The copy would pass a block that failed its checksum off as good
+	if(thread_corrupt){
+		thread_corrupt = 0;
+		for(int k = 0; k < n; k++){
+			freeblock(first + k);
+		}
+		return 0;
+	}
+
+	for(int k = 0; k < n; k++){
+		freeblock(in->direct[idx[k]] - vol->metadata->data_region_addr);
+		in->direct[idx[k]] = first + k + vol->metadata->data_region_addr;
+	}
+	dirty_inode(inum);
+	return n;
+}
+
+/**
+ * Looks at the next DEFRAG_SCAN inodes of the current volume for a fragmented
+ * file no bigger than the budget left and moves it, see defrag_file.
+ * Returns the blocks moved, 0 if none of them could be
+ */
+int defrag_one(){
+	int ninodes = vol->block_size * vol->metadata->inode_region_len / sizeof(inode_t);
+	for(int i = 0; i < DEFRAG_SCAN && i < ninodes; i++){
+		int inum = vol->defrag_next;
+		vol->defrag_next = (inum + 1) % ninodes;
+
+		int nblocks;
+		if(inode_inuse(inum) && file_extents(&vol->inodes[inum], &nblocks) > 1 && nblocks <= defrag_credit){
+			write_begin();
+			int moved = defrag_file(inum);
+			write_end();
+			if(moved){
+				return moved;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Moves fragmented files of every resident volume into contiguous runs, as
+ * many blocks as the budget given with -f allows. The lock of a volume is let
+ * go between files so requests keep being served.
+ */
+void defrag(){
+	//The budget builds up by the time passed, enough for the largest file at most
+	long now = now_ms();
+	long most = defrag_rate > DIRECT_PTRS ? defrag_rate : DIRECT_PTRS;
+	defrag_credit += defrag_rate * (now - defrag_at) / 1000;
+	defrag_credit = defrag_credit > most ? most : defrag_credit;
+	defrag_at = now;
+
+	pthread_mutex_lock(&vol_lock);
+	for(int i = 0; i < nvolumes && defrag_credit > 1; i++){
+		volume_t *v = &volumes[i];
+		int moved = 1;
+		while(v->resident && moved && defrag_credit > 1){
+			pthread_rwlock_wrlock(&v->lock);
+			vol = v;
+			moved = defrag_one();
+			if(moved){
+				v->defrag_files++;
+				v->defrag_blocks += moved;
+				defrag_credit -= moved;
+				flush_data(v->fimg);
+			}
+			pthread_rwlock_unlock(&v->lock);
+		}
+	}
+	pthread_mutex_unlock(&vol_lock);
+}
+
+/**
+ * Updates all disk data and closes every volume. Server exits after sending return code.
+ * Requests still in progress are let finish, no other one starts.
+ */
+void terminate(){
+	pthread_mutex_lock(&vol_lock);
+	for(int i = 0; i < nvolumes; i++){
+		volume_t *v = &volumes[i];
+		if(!v->resident){
+			continue;
+		}
+		//Never released
+		pthread_rwlock_wrlock(&v->lock);
+		vol = v;
+		write_begin();
+		if(v->wal_fd >= 0){
+			writeback_all(v->fimg);
+		}
+		flush_data(v->fimg);
+	}
+
+	pthread_mutex_lock(&io_lock);
+	IO_Close();
+	send_replies();
+	pthread_mutex_unlock(&io_lock);
+
+	for(int i = 0; i < nvolumes; i++){
+		volume_t *v = &volumes[i];
+		if(!v->resident){
+			continue;
+		}
+		if(nvolumes > 1){
+			fprintf(stderr, "%s: ", v->path);
+		}
+		Cache_Stats(v->cache, stderr);
+		if(v->dedup){
+			Dedup_Stats(v->dedup, stderr);
+		}
+		if(defrag_rate){
+			vol = v;
+			fprintf(stderr, "defrag: %ld files moved, %ld blocks copied, fragmentation %.3f\n",
+			        v->defrag_files, v->defrag_blocks, frag_score());
+		}
+		volume_free(v);
+	}
+}
+
+//A request waiting its turn
+typedef struct __request_t {
+	struct sockaddr_in addr;
+	struct __request_t *next;
+	char msg[BUFFER_SIZE];
+} request_t;
+
+//Requests from one client, served in the order they arrived
+typedef struct {
+	struct sockaddr_in addr;
+	request_t *head, *tail;
+	int len;
+	int deficit; //Bulk bytes the client may still move this round
+} client_q_t;
+
+//One receive loop per socket, see -n
+typedef struct {
+	int id;
+	int sd;
+	int efd;            //I/O completion eventfd, -1 with the pwrite engine
+	client_q_t *active; //Clients with requests waiting, BACKLOG_MAX at most
+	int nactive;
+	int backlog;        //Requests waiting across all clients
+	request_t *spare;   //Requests done with, message buffers are too large to go back and forth to malloc
+} loop_t;
+
+/**
+ * Returns a request to fill in, reusing one that was done with
+ */
+request_t *req_get(loop_t *l){
+	request_t *r = l->spare;
+	if(!r){
+		return malloc(sizeof(request_t));
+	}
+	l->spare = r->next;
+	return r;
+}
+
+/**
+ * Keeps a request that was done with for the next one
+ */
+void req_put(loop_t *l, request_t *r){
+	r->next = l->spare;
+	l->spare = r;
+}
+
+/**
+ * Returns the slot the outcome of a request is kept in. Slots are shared, a
+ * newer request takes the slot over, so only recent requests are remembered.
+ */
+done_t *done_slot(struct sockaddr_in *addr, char *msg){
+	unsigned int id = *(unsigned int*) &msg[MFS_REQ_ID];
+	unsigned int h = (id ^ addr->sin_addr.s_addr ^ (unsigned int) addr->sin_port << 16) * 2654435761u;
+	return &done[h >> 20 & (DONE_SLOTS - 1)];
+}
+
+/**
+ * Looks for the outcome of a request that already ran, so a resend is
+ * answered without running it again. Called with the volume write lock held,
+ * which keeps the copies of one request from running at once.
+ * Returns 1 and puts the reply code in msg if the request ran, 0 otherwise
+ * seq[out] - The flush its reply waits for
+ */
+int done_find(struct sockaddr_in *addr, char *msg, unsigned long *seq){
+	done_t *d = done_slot(addr, msg);
+	int found = 0;
+	pthread_mutex_lock(&done_lock);
+	if(d->port == addr->sin_port && d->ip == addr->sin_addr.s_addr && d->id == *(unsigned int*) &msg[MFS_REQ_ID]){
+		set_ret(msg, d->code);
+		*seq = d->seq;
+		found = 1;
+	}
+	pthread_mutex_unlock(&done_lock);
+	return found;
+}
+
+/**
+ * Remembers the outcome of a request that ran, see done_find
+ * seq[in] - The flush its reply waits for
+ */
+void done_add(struct sockaddr_in *addr, char *msg, unsigned long seq){
+	done_t *d = done_slot(addr, msg);
+	pthread_mutex_lock(&done_lock);
+	d->ip = addr->sin_addr.s_addr;
+	d->port = addr->sin_port;
+	d->id = *(unsigned int*) &msg[MFS_REQ_ID];
+	d->code = *(int*) &msg[0];
+	d->seq = seq;
+	pthread_mutex_unlock(&done_lock);
+}
+
+/**
+ * Handles one request and replies to it
+ * sd[in] - The socket the request came in on, the reply goes out on it
+ * msg[in] - The request, overwritten with the reply
+ */
+void handle(int sd, struct sockaddr_in *addr, char *msg){
+	int op;
+	read_reply_t rr;
+	memcpy(&op, &msg[0], 4);
+	thread_flush = 0;
+	thread_corrupt = 0;
+
+	//Stops every loop and every volume, whichever one the request names
+	if(op == OP_TERM){
+		pthread_mutex_lock(&trace_lock);
+		if(trace){
+			Trace_Close(trace);
+			trace = NULL;
+		}
+		terminate();
+		send_reply(sd, addr, msg, sizeof(int));
+		exit(0);
+	}
+
+	vol = vol_get(*(int*) &msg[MFS_VOLUME]);
+	if(!vol){
+		set_ret(msg, RES_FAIL);
+		return reply(sd, addr, msg, 0, sizeof(int));
+	}
+	volume_t *v = vol;
+	FILE *fimg = v->fimg;
+	thread_snap = -1;
+
+	//Lookups and stats of the live image first try without the lock
+	if((op == OP_LOOKUP || op == OP_STAT) && !*(int*) &msg[MFS_SNAP_ID] && read_optimistic(msg, op)){
+		vol_put(v);
+		if(thread_corrupt){
+			set_ret(msg, RES_CORRUPT);
+		}
+		return reply(sd, addr, msg, 0, op == OP_STAT ? 5 * sizeof(int) : sizeof(int));
+	}
+	thread_corrupt = 0;
+
+	//Reads may look at a snapshot instead of the live image
+	int snap = 0;
+	int writer = !(op == OP_LOOKUP || op == OP_STAT || op == OP_READ);
+	if(!writer){
+		pthread_rwlock_rdlock(&v->lock);
+		snap = *(int*) &msg[MFS_SNAP_ID];
+		thread_snap = snap ? snap_slot(snap) : -1;
+	}else{
+		pthread_rwlock_wrlock(&v->lock);
+		//A resend of a request that already ran gets the reply it had
+		if(done_find(addr, msg, &thread_flush)){
+			pthread_rwlock_unlock(&v->lock);
+			vol_put(v);
+			return reply(sd, addr, msg, thread_flush, sizeof(int));
+		}
+		write_begin();
+	}
+
+	if(snap && thread_snap < 0){
+		pthread_rwlock_unlock(&v->lock);
+		vol_put(v);
+		set_ret(msg, RES_FAIL);
+		return reply(sd, addr, msg, 0, sizeof(int));
+	}
+
+	switch((const int)op){
+		case OP_LOOKUP:
+			lookup(msg);
+			break;
+		case OP_STAT:
+			stats(msg);
+			break;
+		case OP_WRITE:
+			img_write(msg, fimg);
+			break;
+		case OP_READ:
+			//The reply points into the image, so it goes out before writers are let in
+			img_read(msg, &rr);
+			if(thread_corrupt){
+				for(int i = 0; i < rr.npinned; i++){
+					Cache_Put(vol->cache, rr.pinned[i]);
+				}
+				break;
+			}
+			reply_read(sd, addr, msg, &rr, thread_flush);
+			pthread_rwlock_unlock(&v->lock);
+			vol_put(v);
+			return;
+		case OP_CREAT:
+			img_creat(msg, fimg);
+			break;
+		case OP_UNLINK:
+			img_unlink(msg, fimg);
+			break;
+		case OP_FALLOCATE:
+			img_fallocate(msg, fimg);
+			break;
+		case OP_APPEND:
+			img_append(msg, fimg);
+			break;
+		case OP_SNAPSHOT:
+			img_snapshot(msg, fimg);
+			break;
+		case OP_SNAPDEL:
+			img_snapdel(msg, fimg);
+			break;
+		default:
+			fprintf(stderr, "Unsupported Opcode recieved\n");
+			exit(1);
+	}
+	//Whatever the request did, what it read can't be trusted
+	if(thread_corrupt){
+		set_ret(msg, RES_CORRUPT);
+	}
+	if(writer){
+		done_add(addr, msg, thread_flush);
+		write_end();
+	}
+	pthread_rwlock_unlock(&v->lock);
+	vol_put(v);
+
+	//Requests that flushed are answered once their writes are on disk, stats are the only replies past the code
+	reply(sd, addr, msg, thread_flush, op == OP_STAT ? 5 * sizeof(int) : sizeof(int));
+}
+
+/**
+ * Returns 1 for reads, writes and appends, which are scheduled by the bytes they move.
+ * Everything else is metadata and goes first.
+ */
+int is_bulk(char *msg){
+	int op = *(int*) &msg[0];
+	return op == OP_WRITE || op == OP_READ || op == OP_APPEND;
+}
+
+/**
+ * Returns what a bulk request costs against a client's deficit
+ */
+int bulk_cost(char *msg){
+	int bytes = *(int*) &msg[8];
+	return bytes < 1 ? 1 : bytes > DRR_QUANTUM ? DRR_QUANTUM : bytes;
+}
+
+/**
+ * Queues a request behind the others from the same client. A client that
+ * already has QUEUE_MAX requests waiting, or any client once the loop is
+ * holding BACKLOG_MAX, is told to retry after BUSY_RETRY_MS instead.
+ * r[in] - The request, given back here if it is turned away
+ */
+void enqueue(loop_t *l, request_t *r){
+	client_q_t *c = NULL;
+	for(int i = 0; i < l->nactive; i++){
+		if(l->active[i].addr.sin_addr.s_addr == r->addr.sin_addr.s_addr && l->active[i].addr.sin_port == r->addr.sin_port){
+			c = &l->active[i];
+			break;
+		}
+	}
+
+	if(l->backlog >= BACKLOG_MAX || (c && c->len >= QUEUE_MAX)){
+		int ms = BUSY_RETRY_MS;
+		set_ret(r->msg, RES_BUSY);
+		memcpy(&r->msg[4], &ms, sizeof(int));
+		send_reply(l->sd, &r->addr, r->msg, 2 * sizeof(int));
+		req_put(l, r);
+		return;
+	}
+
+	if(!c){
+		c = &l->active[l->nactive++];
+		memset(c, 0, sizeof(client_q_t));
+		c->addr = r->addr;
+	}
+
+	r->next = NULL;
+	if(c->tail){
+		c->tail->next = r;
+	}else{
+		c->head = r;
+	}
+	c->tail = r;
+	c->len++;
+	l->backlog++;
+}
+
+/**
+ * Handles the request at the head of a client queue
+ */
+void serve_next(loop_t *l, client_q_t *c){
+	request_t *r = c->head;
+	c->head = r->next;
+	if(!c->head){
+		c->tail = NULL;
+	}
+	c->len--;
+	l->backlog--;
+
+	handle(l->sd, &r->addr, r->msg);
+	if(l->efd >= 0){
+		reap();
+	}
+	req_put(l, r);
+}
+
+/**
+ * One scheduling round. Metadata requests are served first, one per client
+ * in turn until none is left at the head of any queue. Then reads and writes
+ * get a deficit round robin pass, so a client streaming large writes moves
+ * no more bytes per round than one doing small ones.
+ */
+void schedule(loop_t *l){
+	int served;
+	do{
+		served = 0;
+		for(int i = 0; i < l->nactive; i++){
+			client_q_t *c = &l->active[i];
+			if(c->head && !is_bulk(c->head->msg)){
+				serve_next(l, c);
+				served++;
+			}
+		}
+	}while(served);
+
+	for(int i = 0; i < l->nactive; i++){
+		client_q_t *c = &l->active[i];
+		if(!c->head || !is_bulk(c->head->msg)){
+			continue;
+		}
+		c->deficit += DRR_QUANTUM;
+		while(c->head && is_bulk(c->head->msg) && bulk_cost(c->head->msg) <= c->deficit){
+			c->deficit -= bulk_cost(c->head->msg);
+			serve_next(l, c);
+		}
+	}
+
+	//Clients with nothing left waiting drop out and start over with no deficit
+	int n = 0;
+	for(int i = 0; i < l->nactive; i++){
+		if(l->active[i].head){
+			l->active[n++] = l->active[i];
+		}
+	}
+	l->nactive = n;
+}
+
+/**
+ * Receive loop for one socket. The first loop also watches disk completions,
+ * writes back delayed allocation buffers and evicts idle volumes.
+ */
+void *serve(void *arg){
+	loop_t *l = arg;
+
+	int efd = l->efd = IO_EventFd();
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = l->sd };
+	epoll_ctl(ep, EPOLL_CTL_ADD, l->sd, &ev);
+	if(l->id == 0 && efd >= 0){
+		ev.data.fd = efd;
+		epoll_ctl(ep, EPOLL_CTL_ADD, efd, &ev);
+	}
+
+	//Drain the socket on every wake up
+	fcntl(l->sd, F_SETFL, fcntl(l->sd, F_GETFL) | O_NONBLOCK);
+	l->active = malloc(BACKLOG_MAX * sizeof(client_q_t));
+	long swept = now_ms();
+
+	while(1){
+		int buffered = l->id == 0 && wal_file && any_buffered();
+
+		//Only sleep once every queued request has been served, the first loop wakes up to evict idle volumes
+		struct epoll_event evs[2];
+		int timeout = l->backlog ? 0 : buffered ? WRITEBACK_IDLE_MS : -1;
+		if(timeout < 0 && l->id == 0 && nvolumes > 1){
+			timeout = VOLUME_SWEEP_MS;
+		}
+		if(l->id == 0 && defrag_rate && (timeout < 0 || timeout > DEFRAG_TICK_MS)){
+			timeout = DEFRAG_TICK_MS;
+		}
+		int ready = epoll_wait(ep, evs, 2, timeout);
+
+		//Write back buffered writes once requests stop arriving, or they have waited long enough
+		if(buffered){
+			writeback_idle(ready == 0 && timeout > 0);
+		}
+
+		if(l->id == 0 && defrag_rate && now_ms() - defrag_at >= DEFRAG_TICK_MS){
+			defrag();
+		}
+
+		if(l->id == 0 && nvolumes > 1 && now_ms() - swept >= VOLUME_SWEEP_MS){
+			evict_idle();
+			swept = now_ms();
+		}
+
+		if(efd >= 0){
+			reap();
+		}
+
+		//Take in a batch of what has arrived, so a flood from one client can't hide the others
+		for(int n = 0; ready > 0 && n < RECV_BATCH; n++){
+			request_t *r = req_get(l);
+
+			//printf("server:: waiting...\n");
+			int len = UDP_Read(l->sd, &r->addr, r->msg, BUFFER_SIZE);
+			if(len < 0){
+				req_put(l, r);
 				break;
-			case OP_STAT:
-				stats(msg);
+			}
+
+			//Requests are put back into the whole message, compressed or trimmed, malformed ones dropped.
+			//Handlers read no further than the length the request gives for itself.
+			if(len >= (int) sizeof(int) && *(int*) r->msg == LZ_MARKER){
+				char frame[BUFFER_SIZE];
+				memcpy(frame, r->msg, len);
+				if(LZ_Unpack(frame, len, r->msg, BUFFER_SIZE) != 0){
+					req_put(l, r);
+					continue;
+				}
+			}else if(LZ_Expand(r->msg, len, LZ_RequestLen(r->msg)) != 0){
+				req_put(l, r);
+				continue;
+			}
+
+			if(trace){
+				pthread_mutex_lock(&trace_lock);
+				if(trace){
+					Trace_Append(trace, &r->addr, r->msg);
+				}
+				pthread_mutex_unlock(&trace_lock);
+			}
+
+			enqueue(l, r);
+		}
+
+		schedule(l);
+		//printf("server:: reply\n");
+	}
+	return NULL;
+}
+
+// server code
+// usage: server [-t <trace_file>] [-d <log_file>] [-u] [-c <cache_mb>] [-n <threads>] [-D] [-m <volumes>] [-f <blocks_per_sec>] <port> <image_file> [<image_file> ...]
+// Every image is a volume, requests name theirs by its place in the list. A single image is
+// loaded at start and stays; with several, each is loaded when the first request for it comes
+// and evicted once unused for VOLUME_IDLE_MS, or sooner to keep at most -m of them in memory.
+// The -c cache size is shared by the volumes that can be in memory at once.
+int main(int argc, char *argv[]) {
+	int ch;
+	char *trace_file = NULL;
+	int engine = IO_PWRITE;
+	int nloops = 1;
+
+	while((ch = getopt(argc, argv, "t:d:uc:n:Dm:f:")) != -1){
+		switch(ch){
+			case 'c':
+				cache_mb = atol(optarg);
 				break;
-			case OP_WRITE:
-				img_write(msg, fimg);
+			case 'n':
+				nloops = atoi(optarg);
 				break;
-			case OP_READ:
-				img_read(msg);
+			case 'u':
+				engine = IO_URING;
 				break;
-			case OP_CREAT:
-				img_creat(msg, fimg);
+			case 't':
+				trace_file = optarg;
 				break;
-			case OP_UNLINK:
-				img_unlink(msg, fimg);
+			case 'd':
+				wal_file = optarg;
+				break;
+			case 'D':
+				dedup_on = 1;
+				break;
+			case 'm':
+				max_resident = atoi(optarg);
+				break;
+			case 'f':
+				defrag_rate = atoi(optarg);
 				break;
-			case OP_TERM:
-				terminate(fimg);
-				UDP_Write(sd, &addr, msg, BUFFER_SIZE);
-				return 0;
 			default:
-				fprintf(stderr, "Unsupported Opcode recieved\n");
+				fprintf(stderr, "An error has occured\n");
 				exit(1);
 		}
+	}
+	argc -= optind;
+	argv += optind;
 
-        UDP_Write(sd, &addr, msg, BUFFER_SIZE);
-		//printf("server:: reply\n");
-    }
-    return 0; 
+	if(argc < 2 || nloops < 1 || max_resident < 0 || defrag_rate < 0){
+		fprintf(stderr, "An error has occured\n");
+		exit(1);
+	}
+
+	nvolumes = argc - 1;
+	volumes = calloc(nvolumes, sizeof(volume_t));
+	for(int i = 0; i < nvolumes; i++){
+		volume_t *v = &volumes[i];
+		v->id = i;
+		v->path = argv[1 + i];
+		v->img_fd = -1;
+		v->wal_fd = -1;
+		pthread_rwlock_init(&v->lock, NULL);
+		if(access(v->path, F_OK | R_OK | W_OK) == -1){
+			fprintf(stderr, "image does not exist\n");
+			exit(1);
+		}
+
+		//Every volume keeps its own log, named after the one given when there are several
+		if(wal_file && nvolumes == 1){
+			v->wal_path = wal_file;
+		}else if(wal_file){
+			v->wal_path = malloc(strlen(wal_file) + 16);
+			sprintf(v->wal_path, "%s.%d", wal_file, i);
+		}
+	}
+
+	int port = atoi(argv[0]);
+	CRC_Init();
+
+	if(trace_file && !(trace = Trace_Open(trace_file))){
+		fprintf(stderr, "cannot open trace file\n");
+		exit(1);
+	}
+
+	if(IO_Init(engine, IO_DEPTH, write_done) != engine){
+		fprintf(stderr, "io_uring unavailable, using pwrite\n");
+	}
+
+	defrag_at = now_ms();
+	if(nvolumes == 1 && volume_load(&volumes[0]) == -1){
+		exit(1);
+	}
+
+	//With more than one loop every loop gets its own socket on the port and the kernel spreads clients across them
+	loop_t *loops = calloc(nloops, sizeof(loop_t));
+	for(int i = 0; i < nloops; i++){
+		loops[i].id = i;
+		loops[i].sd = nloops == 1 ? UDP_Open(port) : UDP_OpenShared(port);
+		assert(loops[i].sd > -1);
+	}
+
+	for(int i = 1; i < nloops; i++){
+		pthread_t t;
+		if(pthread_create(&t, NULL, serve, &loops[i]) != 0){
+			fprintf(stderr, "cannot start receive loop\n");
+			exit(1);
+		}
+	}
+	serve(&loops[0]);
+	return 0; 
 }
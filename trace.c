@@ -0,0 +1,125 @@
+#include <string.h>
+#include <time.h>
+#include "mfs.h"
+#include "trace.h"
+
+static struct timespec start; //Time the trace was opened, records are relative to it
+
+/**
+ * Returns the number of bytes of a request worth keeping in a trace.
+ * Everything past the op specific arguments (names, write payload) is dropped.
+ * msg[in] - The raw request
+ */
+int Trace_MsgLen(char *msg){
+	int op;
+	memcpy(&op, msg, sizeof(int));
+
+	switch(op){
+		case OP_LOOKUP:
+		case OP_UNLINK:
+			return 8 + 28;  //op, pinum, name
+		case OP_STAT:
+			return 8;       //op, inum
+		case OP_SNAPDEL:
+			return 8;       //op, snapshot id
+		case OP_WRITE:
+		case OP_READ:
+		case OP_FALLOCATE:
+		case OP_APPEND:
+			return 16;      //op, inum, nbytes, offset
+		case OP_CREAT:
+			return 12 + 28; //op, pinum, type, name
+		default:
+			return 4;       //op
+	}
+}
+
+/**
+ * Creates a trace file and writes its header.
+ * Returns the trace or NULL on failure
+ * path[in] - Where to write the trace
+ */
+FILE *Trace_Open(char *path){
+	FILE *trace = fopen(path, "w");
+	if(!trace){
+		return NULL;
+	}
+
+	//Requests arrive much faster than we want to hit the disk
+	setvbuf(trace, NULL, _IOFBF, 1 << 20);
+
+	trace_hdr_t hdr = { TRACE_MAGIC, TRACE_VERSION };
+	if(fwrite(&hdr, sizeof(hdr), 1, trace) != 1){
+		fclose(trace);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	return trace;
+}
+
+/**
+ * Appends a received request to the trace.
+ * Returns 0 on success, -1 otherwise
+ * trace[in] - The trace opened by Trace_Open
+ * addr[in] - The client the request came from
+ * msg[in] - The request as received, before it is handled
+ */
+int Trace_Append(FILE *trace, struct sockaddr_in *addr, char *msg){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	trace_rec_t rec;
+	rec.ts = (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+	rec.addr = addr->sin_addr.s_addr;
+	rec.port = addr->sin_port;
+	rec.len = Trace_MsgLen(msg);
+
+	if(fwrite(&rec, sizeof(rec), 1, trace) != 1 || fwrite(msg, rec.len, 1, trace) != 1){
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Flushes and closes a trace
+ */
+int Trace_Close(FILE *trace){
+	return fclose(trace);
+}
+
+/**
+ * Opens an existing trace for reading and validates its header.
+ * Returns the trace or NULL on failure
+ * path[in] - The trace file
+ */
+FILE *Trace_OpenRead(char *path){
+	FILE *trace = fopen(path, "r");
+	if(!trace){
+		return NULL;
+	}
+
+	trace_hdr_t hdr;
+	if(fread(&hdr, sizeof(hdr), 1, trace) != 1 || hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION){
+		fclose(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+/**
+ * Reads the next record of a trace.
+ * Returns 1 if a record was read, 0 at end of trace, -1 on a malformed record
+ * rec[out] - The record header
+ * msg[out] - The stored part of the request, n bytes available
+ */
+int Trace_Next(FILE *trace, trace_rec_t *rec, char *msg, int n){
+	if(fread(rec, sizeof(*rec), 1, trace) != 1){
+		return 0;
+	}
+
+	if(rec->len > n || fread(msg, rec->len, 1, trace) != 1){
+		return -1;
+	}
+	return 1;
+}
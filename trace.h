@@ -0,0 +1,35 @@
+#ifndef __TRACE_h__
+#define __TRACE_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define TRACE_MAGIC   (0x5453464d) // "MFST"
+#define TRACE_VERSION (1)
+
+// written once at the start of every trace file
+typedef struct __trace_hdr_t {
+    uint32_t magic;
+    uint32_t version;
+} trace_hdr_t;
+
+// one received request, followed by len bytes of the raw message
+// (bulk OP_WRITE and OP_APPEND payload is not stored, only its length field)
+typedef struct __trace_rec_t {
+    uint64_t ts;    // nanoseconds since the trace was opened
+    uint32_t addr;  // client address (network byte order)
+    uint16_t port;  // client port (network byte order)
+    uint16_t len;   // bytes of message that follow
+} trace_rec_t;
+
+FILE *Trace_Open(char *path);
+int Trace_Append(FILE *trace, struct sockaddr_in *addr, char *msg);
+int Trace_Close(FILE *trace);
+
+FILE *Trace_OpenRead(char *path);
+int Trace_Next(FILE *trace, trace_rec_t *rec, char *msg, int n);
+
+int Trace_MsgLen(char *msg);
+
+#endif // __TRACE_h__
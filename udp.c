@@ -1,4 +1,242 @@
 #include "udp.h"
+#include <pthread.h>
+#include <time.h>
+
+#define REORDER_US (1000) // a reordered datagram is held this much longer, so ones sent after it overtake it
+
+// faults injected into the datagrams of this process, see UDP_Faults
+typedef struct {
+    double loss;    // chance a datagram sent or received is lost
+    double dup;     // chance a datagram sent goes out twice
+    double reorder; // chance a datagram sent is held back past later ones
+    int delay_us;   // every datagram sent is held back this long
+    int jitter_us;  // give or take up to this much
+} faults_t;
+
+// a datagram held back, waiting to be sent
+typedef struct held_t {
+    struct held_t *next;
+    long due_us;
+    int fd;
+    struct sockaddr_in addr;
+    int n;
+    char buf[];
+} held_t;
+
+static faults_t faults;
+static int faults_on;
+static pthread_once_t faults_once = PTHREAD_ONCE_INIT;
+
+// datagrams held back, soonest first, and the thread that sends them
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t held_cond;
+static held_t *held;
+static int sender_running;
+
+static __thread unsigned int fault_seed;
+
+static long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// returns a random number from 0 up to 1
+static double rnd() {
+    if (!fault_seed) {
+	fault_seed = (unsigned int) now_us() ^ (unsigned int) pthread_self();
+    }
+    return rand_r(&fault_seed) / ((double) RAND_MAX + 1);
+}
+
+// returns 1 with probability p
+static int chance(double p) {
+    return p > 0 && rnd() < p;
+}
+
+// sends the held back datagrams as they fall due
+static void *sender(void *arg) {
+    pthread_mutex_lock(&held_lock);
+    while (1) {
+	if (!held) {
+	    pthread_cond_wait(&held_cond, &held_lock);
+	    continue;
+	}
+	long wait = held->due_us - now_us();
+	if (wait > 0) {
+	    struct timespec ts;
+	    clock_gettime(CLOCK_MONOTONIC, &ts);
+	    ts.tv_sec += (ts.tv_nsec / 1000 + wait) / 1000000;
+	    ts.tv_nsec = (ts.tv_nsec / 1000 + wait) % 1000000 * 1000;
+	    pthread_cond_timedwait(&held_cond, &held_lock, &ts);
+	    continue;
+	}
+	held_t *h = held;
+	held = h->next;
+	pthread_mutex_unlock(&held_lock);
+	sendto(h->fd, h->buf, h->n, 0, (struct sockaddr *) &h->addr, sizeof(h->addr));
+	free(h);
+	pthread_mutex_lock(&held_lock);
+    }
+    return NULL;
+}
+
+// sends whatever is still held back, so the last replies of a server that exits get out
+static void send_held() {
+    pthread_mutex_lock(&held_lock);
+    while (held) {
+	held_t *h = held;
+	held = h->next;
+	sendto(h->fd, h->buf, h->n, 0, (struct sockaddr *) &h->addr, sizeof(h->addr));
+	free(h);
+    }
+    pthread_mutex_unlock(&held_lock);
+}
+
+// holds a datagram back for us, called with held_lock held
+static void hold(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt, int n, long us) {
+    held_t *h = malloc(sizeof(held_t) + n);
+    if (!h) {
+	return;
+    }
+    h->due_us = now_us() + us;
+    h->fd = fd;
+    h->addr = *addr;
+    h->n = n;
+    for (int i = 0, off = 0; i < iovcnt; off += iov[i].iov_len, i++) {
+	memcpy(&h->buf[off], iov[i].iov_base, iov[i].iov_len);
+    }
+
+    if (!sender_running) {
+	pthread_t t;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&held_cond, &attr);
+	sender_running = pthread_create(&t, NULL, sender, NULL) == 0;
+	if (!sender_running) {
+	    free(h);
+	    return;
+	}
+	pthread_detach(t);
+	atexit(send_held);
+    }
+
+    held_t **p = &held;
+    while (*p && (*p)->due_us <= h->due_us) {
+	p = &(*p)->next;
+    }
+    h->next = *p;
+    *p = h;
+    pthread_cond_signal(&held_cond);
+}
+
+// sends a datagram through the faults
+static int fault_send(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt) {
+    int n = 0;
+    for (int i = 0; i < iovcnt; i++) {
+	n += iov[i].iov_len;
+    }
+
+    // copies not held back go out once the lock is let go
+    pthread_mutex_lock(&held_lock);
+    faults_t f = faults;
+    int copies = chance(f.loss) ? 0 : 1 + chance(f.dup);
+    int now = 0;
+    for (int i = 0; i < copies; i++) {
+	long us = f.delay_us + (long) (rnd() * (2 * f.jitter_us + 1)) - f.jitter_us;
+	if (chance(f.reorder)) {
+	    us += REORDER_US;
+	}
+	if (us > 0) {
+	    hold(fd, addr, iov, iovcnt, n, us);
+	} else {
+	    now++;
+	}
+    }
+    pthread_mutex_unlock(&held_lock);
+
+    for (int i = 0; i < now; i++) {
+	struct msghdr hdr;
+	bzero(&hdr, sizeof(hdr));
+	hdr.msg_name    = addr;
+	hdr.msg_namelen = sizeof(struct sockaddr_in);
+	hdr.msg_iov     = iov;
+	hdr.msg_iovlen  = iovcnt;
+	sendmsg(fd, &hdr, 0);
+    }
+    return n;
+}
+
+// parses a fault spec, see UDP_Faults, and puts it in place
+static int set_faults(char *spec) {
+    faults_t f;
+    bzero(&f, sizeof(f));
+    if (spec) {
+	char copy[256];
+	snprintf(copy, sizeof(copy), "%s", spec);
+	char *save, *tok;
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+	    char *eq = strchr(tok, '=');
+	    char *end;
+	    if (!eq) {
+		return -1;
+	    }
+	    *eq = '\0';
+	    double v = strtod(eq + 1, &end);
+	    if (*end || end == eq + 1 || v < 0) {
+		return -1;
+	    }
+	    if (strcmp(tok, "loss") == 0 && v <= 1) {
+		f.loss = v;
+	    } else if (strcmp(tok, "dup") == 0 && v <= 1) {
+		f.dup = v;
+	    } else if (strcmp(tok, "reorder") == 0 && v <= 1) {
+		f.reorder = v;
+	    } else if (strcmp(tok, "delay") == 0) {
+		f.delay_us = v * 1000;
+	    } else if (strcmp(tok, "jitter") == 0) {
+		f.jitter_us = v * 1000;
+	    } else {
+		return -1;
+	    }
+	}
+    }
+
+    pthread_mutex_lock(&held_lock);
+    faults = f;
+    __atomic_store_n(&faults_on, f.loss || f.dup || f.reorder || f.delay_us || f.jitter_us, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&held_lock);
+    return 0;
+}
+
+static void faults_env() {
+    char *spec = getenv("UDP_FAULTS");
+    if (spec && set_faults(spec) < 0) {
+	fprintf(stderr, "UDP_FAULTS: cannot parse %s\n", spec);
+    }
+}
+
+// injects faults into every datagram this process sends and receives, for
+// testing retries without special networking. The UDP_FAULTS environment
+// variable sets them up the same way, e.g. UDP_FAULTS=loss=0.01,delay=2,jitter=1
+//   loss=<p>     a datagram sent or received is lost
+//   dup=<p>      a datagram sent goes out twice
+//   reorder=<p>  a datagram sent is held back so later ones overtake it
+//   delay=<ms>   every datagram sent is held back this long
+//   jitter=<ms>  give or take up to this much
+// probabilities are from 0 to 1, NULL or "" turns faults off.
+// returns 0, -1 if the spec can't be parsed and nothing changed
+int UDP_Faults(char *spec) {
+    // the environment is only looked at before the first change
+    pthread_once(&faults_once, faults_env);
+    return set_faults(spec);
+}
+
+static int faulty() {
+    pthread_once(&faults_once, faults_env);
+    return __atomic_load_n(&faults_on, __ATOMIC_RELAXED);
+}
 
 // create a socket and bind it to a port on the current machine
 // used to listen for incoming packets
@@ -26,6 +264,38 @@ int UDP_Open(int port) {
     return fd;
 }
 
+// like UDP_Open, but any number of sockets may share the port
+// and the kernel spreads incoming packets across them by sender
+int UDP_OpenShared(int port) {
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+	perror("setsockopt");
+	close(fd);
+	return -1;
+    }
+
+    struct sockaddr_in my_addr;
+    bzero(&my_addr, sizeof(my_addr));
+
+    my_addr.sin_family      = AF_INET;
+    my_addr.sin_port        = htons(port);
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(fd, (struct sockaddr *) &my_addr, sizeof(my_addr)) == -1) {
+	perror("bind");
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
 // fill sockaddr_in struct with proper goodies
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
     bzero(addr, sizeof(struct sockaddr_in));
@@ -49,18 +319,59 @@ int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
 }
 
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n) {
+    if (faulty()) {
+	struct iovec iov = { buffer, n };
+	return fault_send(fd, addr, &iov, 1);
+    }
     int addr_len = sizeof(struct sockaddr_in);
     int rc = sendto(fd, buffer, n, 0, (struct sockaddr *) addr, addr_len);
     return rc;
 }
 
+// send one datagram gathered from several buffers, no need to copy them together first
+int UDP_WriteV(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt) {
+    if (faulty()) {
+	return fault_send(fd, addr, iov, iovcnt);
+    }
+    struct msghdr hdr;
+    bzero(&hdr, sizeof(hdr));
+    hdr.msg_name    = addr;
+    hdr.msg_namelen = sizeof(struct sockaddr_in);
+    hdr.msg_iov     = iov;
+    hdr.msg_iovlen  = iovcnt;
+    int rc = sendmsg(fd, &hdr, 0);
+    return rc;
+}
+
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
     int len = sizeof(struct sockaddr_in); 
     int rc = recvfrom(fd, buffer, n, 0, (struct sockaddr *) addr, (socklen_t *) &len);
     // assert(len == sizeof(struct sockaddr_in)); 
+    // a lost datagram reads like nothing had come yet
+    if (rc >= 0 && faulty()) {
+	pthread_mutex_lock(&held_lock);
+	int lost = chance(faults.loss);
+	pthread_mutex_unlock(&held_lock);
+	if (lost) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+    }
     return rc;
 }
 
 int UDP_Close(int fd) {
+    // datagrams still held back would go out on whatever gets the descriptor next
+    pthread_mutex_lock(&held_lock);
+    for (held_t **p = &held; *p; ) {
+	held_t *h = *p;
+	if (h->fd == fd) {
+	    *p = h->next;
+	    free(h);
+	} else {
+	    p = &h->next;
+	}
+    }
+    pthread_mutex_unlock(&held_lock);
     return close(fd);
 }
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -28,11 +29,15 @@
 // 
 
 int UDP_Open(int port);
+int UDP_OpenShared(int port);
 int UDP_Close(int fd);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
+int UDP_WriteV(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt);
 
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
 
+int UDP_Faults(char *spec);
+
 #endif // __UDP_h__
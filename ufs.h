@@ -4,12 +4,19 @@
 #define UFS_DIRECTORY    (0)
 #define UFS_REGULAR_FILE (1)
 
-#define UFS_BLOCK_SIZE (4096)
+#define UFS_BLOCK_SIZE     (4096)  // block size of images made before it was recorded, and the default
+#define UFS_MAX_BLOCK_SIZE (32768) // a read or write of a whole block has to fit in one UDP datagram
 
 #define DIRECT_PTRS (30)
 
+// type flag: a regular file whose contents are stored in direct[] itself
+// rather than in data blocks, used while the file fits in UFS_INLINE_MAX bytes
+#define UFS_INLINE     (0x100)
+#define UFS_TYPE(t)    ((t) & 0xff)
+#define UFS_INLINE_MAX ((int) (DIRECT_PTRS * sizeof(unsigned int)))
+
 typedef struct {
-    int type;   // MFS_DIRECTORY or MFS_REGULAR
+    int type;   // MFS_DIRECTORY or MFS_REGULAR, possibly with UFS_INLINE set
     int size;   // bytes
     unsigned int direct[DIRECT_PTRS];
 } inode_t;
@@ -29,7 +36,41 @@ typedef struct __super {
     int inode_region_len;  // in blocks
     int data_region_addr;  // block address
     int data_region_len;   // in blocks
+    // fields below read as zero on images made before snapshots, which then have none
+    int ref_addr;          // block address of the data block reference counts
+    int ref_len;           // in blocks
+    int snap_addr;         // block address of the snapshot table, followed by the inode table maps
+    int snap_len;          // in blocks
+    // fields below read as zero on images made before checksums, which are then not checked
+    int csum_addr;         // block address of the block checksums
+    int csum_len;          // in blocks
+    // field below reads as zero on images made before block sizes were recorded, which have UFS_BLOCK_SIZE blocks
+    int block_size;        // bytes, a power of two from UFS_BLOCK_SIZE to UFS_MAX_BLOCK_SIZE
 } super_t;
 
+#define UFS_BSIZE(s) ((s)->block_size ? (s)->block_size : UFS_BLOCK_SIZE)
+
+#define UFS_MAX_SNAPSHOTS (16)
+
+// one CRC32C per image block in the checksum region, the checksum region itself
+// excepted. Checksums are taken without the usual inversions (see CRC_32C) so a
+// block of zeros checksums to 0 and the blocks of a sparse image need none written
+typedef unsigned int ufs_csum_t;
+#define UFS_CSUMS_PER_BLOCK(bsize) ((int) ((bsize) / sizeof(ufs_csum_t)))
+
+// extra holders of a data block beyond the first, one per data block in the
+// reference count region; a block shared with snapshots is copied before it changes
+typedef unsigned short ufs_ref_t;
+
+// block snap_addr. Slot i is followed by its inode table map at block
+// snap_addr + 1 + i * map_len: one unsigned int per inode table block, the
+// block holding the snapshot's copy of it, 0 while it is still the live one.
+// The map is followed by a copy of the inode bitmap as it was when the
+// snapshot was taken, inode_bitmap_len blocks, on images made with room for it
+typedef struct {
+    int next_id;                  // id the next snapshot gets, ids start at 1
+    int ids[UFS_MAX_SNAPSHOTS];   // snapshot in each slot, 0 if the slot is free
+} snap_table_t;
+
 
 #endif // __ufs_h__